@@ -10,8 +10,11 @@
  * compressible, unlike the original. The resulting string has three
  * RLE runs and one incremental sequence.
  * Passing a negative num_planes reverses the transformation.
+ * The 4-plane transform used by lzjody has a dispatched fast path.
  */
 
+#include "lzjody_kernels.h"
+
 extern int byteplane_transform(const unsigned char * const in,
 		unsigned char * const out, int length,
 		int num_planes)
@@ -20,6 +23,15 @@ extern int byteplane_transform(const unsigned char * const in,
 	int plane = 0;
 	int opos = 0;
 
+	if (length < 0) return -1;
+	if (num_planes == 4) {
+		lzjody_kern.bp4_split(in, out, (unsigned int)length);
+		return 0;
+	}
+	if (num_planes == -4) {
+		lzjody_kern.bp4_merge(in, out, (unsigned int)length);
+		return 0;
+	}
 	if (num_planes > 1) {
 		/* Split 'in' to byteplanes, placing result in 'out' */
 		while (plane < num_planes) {
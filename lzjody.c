@@ -6,9 +6,12 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "byteplane_xfrm.h"
 #include "lzjody.h"
+#include "lzjody_kernels.h"
 
 /* Debugging stuff */
 #ifndef DLOG
@@ -26,7 +29,10 @@
 #define P_LIT	0x20	/* Literal values */
 #define P_LZL	0x10	/* LZ match flag: size > 255 */
 #define P_EXT	0x00	/* Extended algorithms (ignore 0x10 and P_SHORT) */
-#define P_PLANE 0x04	/* Byte plane transform */
+#define P_PLANE 0x04	/* Byte plane transform (4 planes) */
+#define P_PLANE2 0x05	/* Byte plane transform (2 planes) */
+#define P_PLANE8 0x06	/* Byte plane transform (8 planes) */
+#define P_PLANE16 0x07	/* Byte plane transform (16 planes) */
 #define P_SEQ32	0x03	/* Sequential 32-bit values */
 #define P_SEQ16	0x02	/* Sequential 16-bit values */
 #define P_SEQ8	0x01	/* Sequential 8-bit values */
@@ -52,19 +58,72 @@
  */
 #define MIN_LZ_MATCH 3
 #define MAX_LZ_MATCH 4095
+#define MAX_LZ_MATCH_WIDE 0xffff
 #define MIN_RLE_LENGTH 3
 /* Sequence lengths are not byte counts, they are word counts! */
 #define MIN_SEQ32_LENGTH 2
 #define MIN_SEQ16_LENGTH 3
 #define MIN_SEQ8_LENGTH 4
 #define MIN_PLANE_LENGTH 8
+#define RANDOM_MIN_LENGTH 1024	/* Smallest block checked by looks_random() */
 
 /* If a byte occurs more times than this in a block, use linear scanning */
 #ifndef MAX_LZ_BYTE_SCANS
  #define MAX_LZ_BYTE_SCANS 0x800
 #endif
 
+/* LZ hash chain match finder parameters */
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_HASH_BITS_WIDE 16	/* Hash size for large blocks */
+#define LZ_HASH_SIZE_WIDE (1 << LZ_HASH_BITS_WIDE)
+#define MAX_RESET_BLOCKS 32768	/* Longest reset interval; 4 bits of log2 */
+#define HDR_DEDUP 0x80	/* Header flag: dedup, log2 of the cache blocks below */
+#define HDR_INDEX 0x40	/* Header flag: the stream ends with a block index */
+#define FAST_HASH_BITS 12	/* Single-probe table size for the fastest level */
+#define FAST_HASH_SIZE (1 << FAST_HASH_BITS)
+#define FAST_SKIP_SHIFT 5	/* Literal skipping speeds up every 2^n misses */
+
+/* Large block format limits
+ * Normal standard commands carry a 20-bit value (21 bits for RLE and
+ * literals) and extended commands a 24-bit value */
+#define P_WIDE_MAX 0x1fffff
+#define P_WIDE_LZMAX 0xfffff
+#define P_WIDE_XMAX 0xffffff
+#ifndef LZ_CHAIN_DEPTH
+ #define LZ_CHAIN_DEPTH 64	/* Default maximum candidates examined per position */
+#endif
+
+/* Parsing strategies */
+#define PARSE_GREEDY 0	/* Take the first thing that compresses */
+#define PARSE_LAZY 1	/* Put a match off if a better one starts at the next byte */
+#define PARSE_OPTIMAL 2	/* Find the cheapest encoding of the whole block */
+#define PARSE_FAST 3	/* RLE and a single LZ probe, skipping through literals */
+
+/* Most RLE, sequence and LZ encodings considered at one position */
+#define PARSE_MAX_CAND 36
+
+/* Settings for each compression level */
+static const struct {
+	unsigned int depth;	/* Hash chain search limit */
+	unsigned int nice;	/* Stop searching at a match this long; 0 = no limit */
+	unsigned int parse;	/* PARSE_xxx */
+	unsigned int planes;	/* Retry literal runs as byte planes */
+} levels[LZJODY_MAX_LEVEL + 1] = {
+	{ 0, 0, PARSE_FAST, 0 },
+	{ 4, 16, PARSE_GREEDY, 0 },
+	{ 16, 64, PARSE_GREEDY, 0 },
+	{ LZ_CHAIN_DEPTH, 0, PARSE_GREEDY, 1 },
+	{ 32, 128, PARSE_LAZY, 1 },
+	{ 64, 256, PARSE_LAZY, 1 },
+	{ 128, 0, PARSE_LAZY, 1 },
+	{ 64, 128, PARSE_OPTIMAL, 1 },
+	{ 256, 512, PARSE_OPTIMAL, 1 },
+	{ 1024, 2048, PARSE_OPTIMAL, 1 }
+};
+
 struct comp_data_t {
+	struct lzjody_ctx *ctx;	/* Context owning this state */
 	const unsigned char *in;
 	unsigned char *out;
 	unsigned int ipos;
@@ -73,46 +132,200 @@ struct comp_data_t {
 	unsigned int literal_start;
 	unsigned int length;	/* Length of input data */
 	int options;	/* 0=exhaustive search, 1=stop at first match */
+	struct lz_chain_t *chain;	/* Hash chains, or NULL for jump lists */
+	unsigned int wide;	/* Large block encoding */
+	unsigned int big_lit;	/* Extra length needed after a long literal run */
+	unsigned int long_lz;	/* Extra length needed for a long LZ offset */
+	unsigned int max_lz;	/* Longest LZ match that can be encoded */
+	unsigned int low;	/* Oldest position LZ matches may refer to */
+	unsigned int nice;	/* Stop searching at a match this long; 0 = no limit */
+};
+
+/* One way to encode the input at a position (lazy and optimal parsing) */
+struct parse_t {
+	unsigned int length;	/* Input bytes covered */
+	unsigned int value;	/* LZ match start or sequence count */
+	unsigned char type;	/* P_LZ, P_RLE, P_SEQ* or P_LIT */
+};
+
+/* Optimal parser state for one position in the block */
+struct opt_node_t {
+	uint32_t price;	/* Cheapest output size reaching here with a command */
+	uint32_t length;	/* Input covered by that command */
+	uint32_t value;	/* parse_t value of that command */
+	uint32_t lprice;	/* Cheapest output size reaching here with literals */
+	uint32_t lits;	/* Length of that literal run */
+	uint32_t next;	/* Next position on the chosen path */
+	unsigned char type;	/* parse_t type of the command */
+	unsigned char lit;	/* The step to 'next' is a literal run */
 };
 
+/* One block in the whole-block dedup cache */
+struct dedup_slot_t {
+	uint64_t hash;	/* dedup_hash() of the block */
+	uint64_t seq;	/* Stream block number of the block */
+	uint32_t length;	/* Block length */
+};
+
+/* Jump lists of the locations of each byte value, stored back to back
+ * in pos[] in counting sort order: the list for byte value c is
+ * pos[start[c]] through pos[start[c + 1] - 1] */
 struct lz_index_t {
-	uint16_t byte[256][MAX_LZ_BYTE_SCANS];	/* Lists of locations of each byte value */
-	uint16_t bytecnt[256];	/* How many offsets exist per byte */
+	uint16_t start[257];	/* Offset of each byte value's list in pos[] */
+	uint16_t pos[LZJODY_BSIZE];	/* Locations grouped by byte value */
+};
+
+/* Hash chains of MIN_LZ_MATCH (or 4) byte sequences; positions are
+ * stored plus one so that zero can terminate a chain */
+struct lz_chain_t {
+	uint32_t *head;	/* Newest position for each hash */
+	uint32_t *prev;	/* Next older position with the same hash */
+	unsigned int hashed;	/* Positions below this are in the chains */
+	unsigned int hash_bits;	/* log2 of the number of head[] entries in use */
+	unsigned int hash_bytes;	/* Bytes hashed per position */
+};
+
+/* All per-call working state; one of these per thread makes the
+ * compressor and decompressor fully reentrant */
+struct lzjody_ctx {
+	struct comp_data_t data;	/* Block being compressed */
+	struct lz_index_t idx;	/* LZ index for the block */
+	struct lz_chain_t chain;	/* LZ hash chains for the block */
+	unsigned int chain_depth;	/* Hash chain search limit; 0 = jump lists */
+	int level;	/* Compression level */
+	unsigned int nice;	/* Good enough match length; 0 = no limit */
+	unsigned int parse;	/* PARSE_xxx */
+	unsigned int planes;	/* Retry literal runs as byte planes */
+	struct opt_node_t *opt;	/* Optimal parser nodes, allocated on first use */
+	unsigned int opt_cap;	/* Nodes in opt[] */
+	unsigned int bsize;	/* Block size */
+	unsigned int wide;	/* Large block format (bsize > LZJODY_BSIZE) */
+	/* Byte plane transform state for lzjody_flush_literals() */
+	struct comp_data_t d2;
+	struct lz_index_t idx2;
+	struct lz_chain_t chain2;	/* Large literal runs only */
+	unsigned char *lit_in;
+	unsigned char *lit_out;
+	/* Decompressor byte plane transform scratch space */
+	unsigned char *bp_temp;
+	/* Buffers for large blocks (one allocation), or NULL */
+	void *large;
+	/* Sliding window for streaming mode: history then the current block */
+	void *window;	/* Window allocation (chain links, then win[]) */
+	unsigned char *win;
+	unsigned int win_size;	/* Bytes of history kept; 0 = no window */
+	unsigned int win_cap;	/* Size of win[] */
+	unsigned int win_pos;	/* Start of the current block in win[] */
+	unsigned int win_bits;	/* Hash size for the window's chains */
+	unsigned int reset_blocks;	/* Blocks between reset points */
+	unsigned int block_count;	/* Blocks since the last reset point */
+	/* Preset dictionary: the dictionary, then room for one block */
+	void *dict_buf;	/* Dictionary allocation (chains, then dict[]) */
+	unsigned char *dict;
+	unsigned int dict_len;	/* Dictionary size; 0 = no dictionary */
+	unsigned int dict_id;	/* Dictionary ID for the stream header */
+	unsigned int dict_hashed;	/* Positions hashed from the dictionary alone */
+	struct lz_chain_t dchain;	/* Chains over the dictionary and block */
+	/* Whole-block dedup: a ring of recent blocks and, when compressing,
+	 * a hash table of ring slots plus one for the newest of each hash */
+	void *dd_buf;	/* Dedup allocation (table, slots, then blocks) */
+	uint32_t *dd_tab;
+	struct dedup_slot_t *dd_slot;
+	unsigned char *dd_ring;
+	unsigned int dd_blocks;	/* Blocks in the ring; 0 = no dedup */
+	unsigned int dd_bits;	/* log2 of the number of dd_tab[] entries */
+	uint64_t dd_seq;	/* Number of the next block */
+	uint64_t dd_base;	/* Number of the block at the last reset point */
+	int seekable;	/* Stream has a block index (HDR_INDEX) */
+	/* Buffers for 4 KiB blocks */
+	uint32_t head_4k[LZ_HASH_SIZE];
+	uint32_t fast_tab[FAST_HASH_SIZE];	/* Newest position + 1 for each hash */
+	uint32_t prev_4k[LZJODY_BSIZE];
+	unsigned char lit_in_4k[LZJODY_BSIZE];
+	unsigned char lit_out_4k[LZJODY_BSIZE + 4];
+	unsigned char bp_temp_4k[LZJODY_BSIZE];
 };
 
 static inline int lzjody_find_lz(struct comp_data_t * const restrict data,
 		const struct lz_index_t * const restrict idx);
+static inline int lzjody_find_lz_chain(struct comp_data_t * const restrict data);
 static inline int lzjody_find_rle(struct comp_data_t * const restrict data);
 static inline int lzjody_find_seq32(struct comp_data_t * const restrict data);
 static inline int lzjody_find_seq16(struct comp_data_t * const restrict data);
 static inline int lzjody_find_seq8(struct comp_data_t * const restrict data);
 
+/* Detectors that might succeed at a position (see compress_probe) */
+#define PROBE_RLE	0x01
+#define PROBE_SEQ8	0x02
+#define PROBE_SEQ16	0x04
+#define PROBE_SEQ32	0x08
+#define PROBE_ALL	0x0f
+
+/* Load the next 8 input bytes once and test the first elements of every
+ * RLE/sequence detector against them. A detector whose bit is clear
+ * cannot reach its minimum length, so skipping it changes nothing. */
+static inline unsigned int compress_probe(const unsigned char * const restrict p,
+		const unsigned int remain)
+{
+	uint16_t w0, w1, w2;
+	uint32_t d0, d1;
+	unsigned int probe = 0;
+
+	/* Near the end of the block just try everything */
+	if (remain < 8) return PROBE_ALL;
+
+	memcpy(&w0, p, sizeof(uint16_t));
+	memcpy(&w1, p + 2, sizeof(uint16_t));
+	memcpy(&w2, p + 4, sizeof(uint16_t));
+	memcpy(&d0, p, sizeof(uint32_t));
+	memcpy(&d1, p + 4, sizeof(uint32_t));
+
+	if ((*p == *(p + 1)) && (*p == *(p + 2))) probe |= PROBE_RLE;
+	if (((uint8_t)(*p + 1) == *(p + 1)) && ((uint8_t)(*p + 2) == *(p + 2))
+			&& ((uint8_t)(*p + 3) == *(p + 3))) probe |= PROBE_SEQ8;
+	if (((uint16_t)(w0 + 1) == w1) && ((uint16_t)(w0 + 2) == w2)) probe |= PROBE_SEQ16;
+	if ((d0 + 1) == d1) probe |= PROBE_SEQ32;
+	return probe;
+}
+
 static int compress_scan(struct comp_data_t * const restrict data,
 		const struct lz_index_t * const restrict idx)
 {
+	unsigned int probe;
 	int err;
 
 	while (data->ipos < data->length) {
 		/* Scan for compressible items
-		 * Try each compressor in sequence; if none works,
-		 * just add the byte to the literal stream */
+		 * Try each compressor that passes the probe in sequence; if
+		 * none works, just add the byte to the literal stream */
 		DLOG("[c_scan] ipos: 0x%x, opos: 0x%x\n", data->ipos, data->opos);
 
-		err = lzjody_find_rle(data);
-		if (err < 0) return err;
-		if (err > 0) continue;
-
-		err = lzjody_find_seq8(data);
-		if (err < 0) return err;
-		if (err > 0) continue;
-		err = lzjody_find_seq16(data);
-		if (err < 0) return err;
-		if (err > 0) continue;
-		err = lzjody_find_seq32(data);
-		if (err < 0) return err;
-		if (err > 0) continue;
+		probe = compress_probe(data->in + data->ipos, data->length - data->ipos);
+		if (probe) {
+			if (probe & PROBE_RLE) {
+				err = lzjody_find_rle(data);
+				if (err < 0) return err;
+				if (err > 0) continue;
+			}
+			if (probe & PROBE_SEQ8) {
+				err = lzjody_find_seq8(data);
+				if (err < 0) return err;
+				if (err > 0) continue;
+			}
+			if (probe & PROBE_SEQ16) {
+				err = lzjody_find_seq16(data);
+				if (err < 0) return err;
+				if (err > 0) continue;
+			}
+			if (probe & PROBE_SEQ32) {
+				err = lzjody_find_seq32(data);
+				if (err < 0) return err;
+				if (err > 0) continue;
+			}
+		}
 
-		err = lzjody_find_lz(data, idx);
+		if (data->chain) err = lzjody_find_lz_chain(data);
+		else err = lzjody_find_lz(data, idx);
 		if (err < 0) return err;
 		if (err > 0) continue;
 
@@ -128,23 +341,37 @@ static int compress_scan(struct comp_data_t * const restrict data,
 static int index_bytes(const struct comp_data_t * const restrict data,
 		struct lz_index_t * const restrict idx)
 {
+	uint16_t cnt[256];	/* Count, then fill cursor, for each byte value */
 	unsigned int pos = 0;
+	unsigned int end;
+	unsigned int total = 0;
 	unsigned char c;
 
-	/* Clear any existing index */
-	for (int i = 0; i < 256; i++) idx->bytecnt[i] = 0;
-
-	/* Read each byte and add its offset to its list */
 	if (data->length < MIN_LZ_MATCH) goto error_index;
+
+	/* Count each byte value; indexing stops once any value's list is full */
+	for (int i = 0; i < 256; i++) cnt[i] = 0;
 	while (pos < (data->length - MIN_LZ_MATCH)) {
 		c = *(data->in + pos);
-		idx->byte[c][idx->bytecnt[c]] = pos;
-		idx->bytecnt[c]++;
-/*		DLOG("pos 0x%x, len 0x%x, byte 0x%x, cnt 0x%x\n",
-				pos, data->length, c,
-				idx->bytecnt[c]); */
+		cnt[c]++;
 		pos++;
-		if (idx->bytecnt[c] == MAX_LZ_BYTE_SCANS) break;
+		if (cnt[c] == MAX_LZ_BYTE_SCANS) break;
+	}
+	end = pos;
+
+	/* Turn the counts into list start offsets */
+	for (int i = 0; i < 256; i++) {
+		idx->start[i] = (uint16_t)total;
+		total += cnt[i];
+		cnt[i] = idx->start[i];
+	}
+	idx->start[256] = (uint16_t)total;
+
+	/* Add each offset to its byte value's list */
+	for (pos = 0; pos < end; pos++) {
+		c = *(data->in + pos);
+		idx->pos[cnt[c]] = (uint16_t)pos;
+		cnt[c]++;
 	}
 	return 0;
 
@@ -153,12 +380,159 @@ error_index:
 	return -1;
 }
 
+/* Count how many bytes at a and b match, up to max */
+static inline unsigned int lz_match_length(const unsigned char * const restrict a,
+		const unsigned char * const restrict b, const unsigned int max)
+{
+	return lzjody_kern.match_length(a, b, max);
+}
+
+/* Count bytes at p equal to c, up to max */
+static inline unsigned int rle_length(const unsigned char * const restrict p,
+		const unsigned char c, const unsigned int max)
+{
+	return lzjody_kern.rle_length(p, c, max);
+}
+
+/* Count bytes at p that increment by one from p[0], up to max bytes */
+static inline unsigned int seq8_length(const unsigned char * const restrict p,
+		const unsigned int max)
+{
+	return lzjody_kern.seq8_length(p, *p, max);
+}
+
+/* Count 16-bit values at p that increment by one, up to max values */
+static inline unsigned int seq16_length(const unsigned char * const restrict p,
+		const unsigned int max)
+{
+	uint16_t num;
+
+	memcpy(&num, p, sizeof(uint16_t));
+	return lzjody_kern.seq16_length(p, num, max);
+}
+
+/* Count 32-bit values at p that increment by one, up to max values */
+static inline unsigned int seq32_length(const unsigned char * const restrict p,
+		const unsigned int max)
+{
+	uint32_t num;
+
+	memcpy(&num, p, sizeof(uint32_t));
+	return lzjody_kern.seq32_length(p, num, max);
+}
+
+/* Hash the MIN_LZ_MATCH bytes at p */
+static inline unsigned int lz_hash(const unsigned char * const p,
+		const unsigned int bits)
+{
+	const uint32_t v = ((uint32_t)*p << 16) | ((uint32_t)*(p + 1) << 8) | *(p + 2);
+
+	return (unsigned int)((v * 2654435761U) >> (32 - bits));
+}
+
+/* Hash the 4 bytes at p; long windows would fill the chains with
+ * 3-byte matches that are too short to encode at a distance anyway */
+static inline unsigned int lz_hash4(const unsigned char * const p,
+		const unsigned int bits)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(uint32_t));
+	return (unsigned int)((v * 2654435761U) >> (32 - bits));
+}
+
+static inline unsigned int lz_chain_hash(const struct lz_chain_t * const restrict chain,
+		const unsigned char * const p)
+{
+	if (chain->hash_bytes == 4) return lz_hash4(p, chain->hash_bits);
+	return lz_hash(p, chain->hash_bits);
+}
+
+/* Empty the hash chains for a new block, using 2^bits hash heads
+ * and hashing 'bytes' (MIN_LZ_MATCH or 4) bytes per position */
+static void lz_chain_reset(struct lz_chain_t * const restrict chain,
+		const unsigned int bits, const unsigned int bytes)
+{
+	memset(chain->head, 0, sizeof(uint32_t) << bits);
+	chain->hash_bits = bits;
+	chain->hash_bytes = bytes;
+	chain->hashed = 0;
+	return;
+}
+
+/* Add every position before 'end' to the hash chains
+ * Positions are added lazily so a chain never holds positions at or
+ * beyond the current input position */
+static inline void lz_chain_update(const struct comp_data_t * const restrict data,
+		struct lz_chain_t * const restrict chain, unsigned int end)
+{
+	unsigned int pos = chain->hashed;
+	unsigned int h;
+
+	if (end > data->length - chain->hash_bytes) end = data->length - chain->hash_bytes;
+	while (pos < end) {
+		h = lz_chain_hash(chain, data->in + pos);
+		chain->prev[pos] = chain->head[h];
+		chain->head[h] = pos + 1;
+		pos++;
+	}
+	if (pos > chain->hashed) chain->hashed = pos;
+	return;
+}
+
+/* Large block format control byte(s)
+ * Short forms are the same as for 4 KiB blocks. Normal standard forms
+ * put the top value bits in the control byte followed by two bytes, and
+ * normal extended forms are followed by a three-byte value. */
+static int lzjody_write_control_wide(struct comp_data_t * const restrict data,
+		const unsigned char type,
+		const unsigned int value)
+{
+	unsigned char * const out = data->out + data->opos;
+
+	DLOG("control: (i 0x%x, o 0x%x) t 0x%x, val 0x%x (wide)\n",
+			data->ipos, data->opos, type, value);
+	if ((type & P_MASK) == P_EXT) {
+		if (value > P_WIDE_XMAX) goto error_value_too_large;
+		if (value > P_SHORT_XMAX) {
+			*out = type;
+			*(out + 1) = (unsigned char)(value >> 16);
+			*(out + 2) = (unsigned char)(value >> 8);
+			*(out + 3) = (unsigned char)value;
+			data->opos += 4;
+		} else {
+			*out = type | P_SHORT;
+			*(out + 1) = (unsigned char)value;
+			data->opos += 2;
+		}
+		return 0;
+	}
+	if (value > (((type & P_MASK) == P_LZ) ? P_WIDE_LZMAX : P_WIDE_MAX))
+		goto error_value_too_large;
+	if (value > P_SHORT_MAX) {
+		*out = type | (unsigned char)(value >> 16);
+		*(out + 1) = (unsigned char)(value >> 8);
+		*(out + 2) = (unsigned char)value;
+		data->opos += 3;
+	} else {
+		*out = type | P_SHORT | (unsigned char)value;
+		data->opos++;
+	}
+	return 0;
+
+error_value_too_large:
+	fprintf(stderr, "error: lzjody_write_control: value 0x%x too large for type 0x%x\n",
+			value, type);
+	return -1;
+}
+
 /* Write the control byte(s) that define data
  * type is the P_xxx value that determines the type of the control byte */
 static int lzjody_write_control(struct comp_data_t * const restrict data,
 		const unsigned char type,
-		const uint16_t value)
+		const unsigned int value)
 {
+	if (data->wide) return lzjody_write_control_wide(data, type, value);
 	if (value > 0x1000) goto error_value_too_large;
 	DLOG("control: (i 0x%x, o 0x%x) t 0x%x, val 0x%x: ",
 			data->ipos, data->opos, type, value);
@@ -215,7 +589,7 @@ static int lzjody_really_flush_literals(struct comp_data_t * const restrict data
 
 	if (data->literals == 0) return 0;
 	DLOG("really_flush_literals: 0x%x (opos 0x%x)\n", data->literals, data->opos);
-	if ((data->opos + data->literals) > (LZJODY_BSIZE + 4)) goto error_opos;
+	if ((data->opos + data->literals) > LZJODY_BOUND(data->ctx->bsize)) goto error_opos;
 	/* First write the control byte... */
 	err = lzjody_write_control(data, P_LIT, data->literals);
 	if (err < 0) return err;
@@ -232,84 +606,314 @@ static int lzjody_really_flush_literals(struct comp_data_t * const restrict data
 
 error_opos:
 	fprintf(stderr, "error: final output position will overflow: 0x%x > 0x%x\n",
-			data->opos + data->literals, LZJODY_BSIZE + 4);
+			data->opos + data->literals, LZJODY_BOUND(data->ctx->bsize));
 	return -1;
 }
 
-/* Intercept a stream of literals and try byte plane transformation */
-static int lzjody_flush_literals(struct comp_data_t * const restrict data)
+/* Plane count for a byte plane command, or 0 if it isn't one */
+static inline int plane_count(const unsigned int mode)
 {
-	static unsigned char lit_in[LZJODY_BSIZE];
-	static unsigned char lit_out[LZJODY_BSIZE + 4];
-	unsigned int i;
-	int err;
-	static struct comp_data_t d2;
-	static struct lz_index_t idx;
-
-	/* For zero literals we'll just do nothing. */
-	if (data->literals == 0) return 0;
+	switch (mode) {
+	case P_PLANE: return 4;
+	case P_PLANE2: return 2;
+	case P_PLANE8: return 8;
+	case P_PLANE16: return 16;
+	default: return 0;
+	}
+}
 
-	/* Handle blocking of recursive calls or very short literal runs */
-	if ((data->literals < MIN_PLANE_LENGTH)
-			|| (data->options & O_REALFLUSH)) {
-		err = lzjody_really_flush_literals(data);
-		if (err < 0) return err;
-		return 0;
+/* Byte plane command for a plane count */
+static inline unsigned char plane_command(const int planes)
+{
+	switch (planes) {
+	case 2: return P_PLANE2;
+	case 8: return P_PLANE8;
+	case 16: return P_PLANE16;
+	default: return P_PLANE;
 	}
+}
 
+/* Estimate how well a byte plane transform with 'planes' planes would
+ * compress: count bytes that equal or are one more than the byte that
+ * would precede them in their plane, i.e. that continue an RLE run or
+ * an 8-bit sequence after the transform */
+static unsigned int plane_score(const unsigned char * const restrict p,
+		const unsigned int length, const unsigned int planes)
+{
+	unsigned int score = 0;
+	unsigned int i;
 
-	d2.in = lit_in;
-	d2.out = lit_out;
-	d2.ipos = 0;
-	d2.opos = 0;
-	d2.literals = 0;
-	d2.literal_start = 0;
-	d2.length = data->literals;
-	/* Don't allow recursive passes or compressed data size prefix */
-	d2.options = (data->options | O_REALFLUSH | O_NOPREFIX);
+	for (i = planes; i < length; i++)
+		score += ((unsigned char)(*(p + i) - *(p + i - planes)) <= 1);
+	return score;
+}
 
-	DLOG("flush_literals: 0x%x\n", data->literals);
+/* Compress pending literals in byte plane order
+ * Returns 1 if the plane command was written, 0 if it didn't help */
+static int lzjody_try_planes(struct comp_data_t * const restrict data,
+		const int planes)
+{
+	struct lzjody_ctx * const ctx = data->ctx;
+	struct comp_data_t * const d2 = &(ctx->d2);
+	unsigned int i;
+	int err;
+
+	d2->ctx = ctx;
+	d2->in = ctx->lit_in;
+	d2->out = ctx->lit_out;
+	d2->ipos = 0;
+	d2->opos = 0;
+	d2->literals = 0;
+	d2->literal_start = 0;
+	d2->length = data->literals;
+	d2->chain = NULL;
+	d2->wide = data->wide;
+	d2->big_lit = data->big_lit;
+	d2->long_lz = data->long_lz;
+	d2->max_lz = data->max_lz;
+	d2->low = 0;
+	d2->nice = data->nice;
+	/* Don't allow recursive passes or compressed data size prefix */
+	d2->options = (data->options | O_REALFLUSH | O_NOPREFIX);
 
 	/* Try to compress a literal run further */
-	DLOG("compress further: 0x%x @ 0x%x\n", data->literals, data->literal_start);
+	DLOG("compress further: 0x%x @ 0x%x, %d planes\n",
+			data->literals, data->literal_start, planes);
 	/* Make a transformed copy of the data */
 	err = byteplane_transform((data->in + data->literal_start),
-			lit_in, data->literals, 4);
+			ctx->lit_in, data->literals, planes);
 	if (err < 0) return err;
 
-	/* Load arrays for match speedup */
-	err = index_bytes(&d2, &idx);
-	if (err < 0) return err;
+	/* Load arrays for match speedup; jump lists only index 4 KiB
+	 * so longer runs in large blocks use right-sized hash chains */
+	if (d2->length > LZJODY_BSIZE) {
+		unsigned int bits = 10;
+
+		while ((bits < LZ_HASH_BITS_WIDE) && ((1U << bits) < d2->length)) bits++;
+		d2->chain = &(ctx->chain2);
+		lz_chain_reset(d2->chain, bits, MIN_LZ_MATCH);
+	} else {
+		err = index_bytes(d2, &(ctx->idx2));
+		if (err < 0) return err;
+	}
 
 	/* Try to compress the data again */
-	err = compress_scan(&d2, &idx);
+	err = compress_scan(d2, &(ctx->idx2));
 	if (err < 0) return err;
-	err = lzjody_really_flush_literals(&d2);
+	err = lzjody_really_flush_literals(d2);
 	if (err < 0) return err;
 
-	/* If there was not enough of a size improvement, give up */
-	if ((d2.opos + 2) >= d2.length) {
+	/* If there was not enough of a size improvement, give up; a large
+	 * block plane command can be one byte longer than its literals */
+	if ((d2->opos + 2 + d2->wide) >= d2->length) {
 		DLOG("[bp] No improvement, skipping (0x%x >= 0x%x)\n",
-				d2.opos,
-				d2.length);
-		err = lzjody_really_flush_literals(data);
-		if (err < 0) return err;
+				d2->opos,
+				d2->length);
 		return 0;
 	}
 
 	/* Dump the newly compressed data as a literal stream */
-	DLOG("Improvement: 0x%x -> 0x%x\n", d2.length, d2.opos);
-	err = lzjody_write_control(data, P_PLANE, d2.opos);
+	DLOG("Improvement: 0x%x -> 0x%x\n", d2->length, d2->opos);
+	err = lzjody_write_control(data, plane_command(planes), d2->opos);
 	if (err < 0) return err;
 
 	i = 0;
-	while (i < d2.opos) {
-		*(data->out + data->opos) = *(d2.out + i);
+	while (i < d2->opos) {
+		*(data->out + data->opos) = *(d2->out + i);
 		data->opos++;
 		i++;
 	}
 	/* Reset literal counter*/
 	data->literals = 0;
+	return 1;
+}
+
+/* Intercept a stream of literals and try byte plane transformation
+ * With O_ALL_PLANES, 2, 8 and 16 planes are also scored and the width
+ * that looks best is tried first, falling back to 4 planes */
+static int lzjody_flush_literals(struct comp_data_t * const restrict data)
+{
+	static const int widths[] = { 2, 8, 16 };
+	const unsigned char * const lit = data->in + data->literal_start;
+	int planes = 4;
+	unsigned int score, best;
+	unsigned int i;
+	int err;
+
+	/* For zero literals we'll just do nothing. */
+	if (data->literals == 0) return 0;
+
+	/* Handle blocking of recursive calls or very short literal runs */
+	if ((data->literals < MIN_PLANE_LENGTH)
+			|| (data->options & O_REALFLUSH)) {
+		err = lzjody_really_flush_literals(data);
+		if (err < 0) return err;
+		return 0;
+	}
+
+	DLOG("flush_literals: 0x%x\n", data->literals);
+
+	if (data->options & O_ALL_PLANES) {
+		best = plane_score(lit, data->literals, 4);
+		for (i = 0; i < (sizeof(widths) / sizeof(int)); i++) {
+			if ((unsigned int)widths[i] >= data->literals) break;
+			score = plane_score(lit, data->literals, (unsigned int)widths[i]);
+			if (score > best) {
+				best = score;
+				planes = widths[i];
+			}
+		}
+		if (planes != 4) {
+			err = lzjody_try_planes(data, planes);
+			if (err != 0) return (err < 0) ? err : 0;
+		}
+	}
+
+	err = lzjody_try_planes(data, 4);
+	if (err < 0) return err;
+	if (err == 0) {
+		err = lzjody_really_flush_literals(data);
+		if (err < 0) return err;
+	}
+	return 0;
+}
+
+/* LZ control value for a match at 'start': 4 KiB blocks store the
+ * absolute offset and large blocks the distance back from ipos */
+static inline unsigned int lz_value(const struct comp_data_t * const restrict data,
+		const unsigned int start)
+{
+	return data->wide ? (data->ipos - start) : start;
+}
+
+/* Write an LZ match and skip the matched input */
+static int lzjody_write_lz(struct comp_data_t * const restrict data,
+		const unsigned int start, const unsigned int length)
+{
+	int err;
+
+	DLOG("LZ compressed %x:%x bytes\n", start, length);
+	err = lzjody_flush_literals(data);
+	if (err < 0) return err;
+	if (length < 256) {
+		err = lzjody_write_control(data, P_LZ, lz_value(data, start));
+		if (err < 0) return err;
+	} else {
+		err = lzjody_write_control(data, (P_LZ | P_LZL), lz_value(data, start));
+		if (err < 0) return err;
+		*(data->out + data->opos) = (unsigned char)(length >> 8);
+		data->opos++;
+	}
+	/* Write LZ match length low byte */
+	*(data->out + data->opos) = (unsigned char)(length & 0xff);
+	data->opos++;
+	/* Skip matched input */
+	data->ipos += length;
+	return 1;
+}
+
+/* Write an RLE run of the byte at ipos and skip the matched input */
+static int lzjody_write_rle(struct comp_data_t * const restrict data,
+		const unsigned int length)
+{
+	const unsigned char c = *(data->in + data->ipos);
+	int err;
+
+	DLOG("RLE: 0x%02x of 0x%02x at i %x, o %x\n",
+			length, c, data->ipos, data->opos);
+	err = lzjody_flush_literals(data);
+	if (err < 0) return err;
+	err = lzjody_write_control(data, P_RLE, length);
+	if (err < 0) return err;
+	/* Write repeated byte */
+	*(data->out + data->opos) = c;
+	data->opos++;
+	/* Skip matched input */
+	data->ipos += length;
+	return 1;
+}
+
+/* Size in bytes of the values of a P_SEQ* command */
+static inline unsigned int seq_width(const unsigned char type)
+{
+	return (type == P_SEQ32) ? 4 : ((type == P_SEQ16) ? 2 : 1);
+}
+
+/* Write a run of 'count' incrementing values starting at ipos
+ * and skip the matched input; type is P_SEQ8, P_SEQ16 or P_SEQ32 */
+static int lzjody_write_seq(struct comp_data_t * const restrict data,
+		const unsigned char type, const unsigned int count)
+{
+	const unsigned int width = seq_width(type);
+	int err;
+
+	DLOG("Seq(%u): 0x%x items at i %x\n", width << 3, count, data->ipos);
+	err = lzjody_flush_literals(data);
+	if (err < 0) return err;
+	err = lzjody_write_control(data, type, count);
+	if (err < 0) return err;
+	/* Write the first value */
+	memcpy(data->out + data->opos, data->in + data->ipos, width);
+	data->opos += width;
+	data->ipos += count * width;
+	return 1;
+}
+
+/* Find best LZ data match for current input position using hash chains
+ * Only positions whose first MIN_LZ_MATCH bytes hash the same as the
+ * current position are examined, newest first, up to chain_depth */
+static inline int lzjody_find_lz_chain(struct comp_data_t * const restrict data)
+{
+	struct lz_chain_t * const chain = data->chain;
+	const unsigned char * const m0 = data->in + data->ipos;
+	const unsigned char *m2;
+	unsigned int remain = data->length - data->ipos;
+	unsigned int max_len;
+	unsigned int min_lz_match = MIN_LZ_MATCH;
+	unsigned int depth = data->ctx->chain_depth;
+	unsigned int best_lz = 0;
+	unsigned int best_lz_start = 0;
+	unsigned int length;
+	unsigned int cand;
+	unsigned int offset;
+
+	/* If literal count > short form constraints, avoid data expansion */
+	if (data->literals > P_SHORT_MAX) min_lz_match += data->big_lit;
+	/* Large blocks always use hash chains */
+	if (depth == 0) depth = LZ_CHAIN_DEPTH;
+
+	if (remain <= min_lz_match) return 0;
+	max_len = (remain > data->max_lz) ? data->max_lz : remain;
+
+	lz_chain_update(data, chain, data->ipos);
+	cand = chain->head[lz_chain_hash(chain, m0)];
+
+	while (cand && depth) {
+		offset = cand - 1;
+		if (offset < data->low) break;	/* Older than the window */
+		cand = chain->prev[offset];
+		depth--;
+		m2 = data->in + offset;
+
+		/* Only a longer match is interesting; reject quickly */
+		if (best_lz && (*(m2 + best_lz) != *(m0 + best_lz))) continue;
+		if (*(m2 + min_lz_match - 1) != *(m0 + min_lz_match - 1)) continue;
+
+		length = lz_match_length(m0, m2, max_len);
+		if ((length < min_lz_match) || (length <= best_lz)) continue;
+		/* LZ can't use 4-bit offsets after 0x0f bytes */
+		if ((lz_value(data, offset) > P_SHORT_MAX)
+				&& (length < (min_lz_match + data->long_lz))) continue;
+
+		DLOG("LZ match: 0x%x : 0x%x (h)\n", offset, length);
+		best_lz_start = offset;
+		best_lz = length;
+		if (data->options & O_FAST_LZ) break;	/* Accept first LZ match */
+		if (length == max_len) break;
+		if (data->nice && (length >= data->nice)) break;
+	}
+
+	if (best_lz) return lzjody_write_lz(data, best_lz_start, best_lz);
 	return 0;
 }
 
@@ -325,18 +929,19 @@ static inline int lzjody_find_lz(struct comp_data_t * const restrict data,
 	int done = 0;	/* Used to terminate matching */
 	unsigned int best_lz = 0;
 	int best_lz_start = 0;
+	const uint16_t *list;	/* Jump list for the current byte value */
 	unsigned int total_scans;
 	unsigned int offset;
 	unsigned int min_lz_match = MIN_LZ_MATCH;
-	int err;
 
 	/* If literal count > short form constraints, avoid data expansion */
-	if (data->literals > P_SHORT_MAX) min_lz_match++;
+	if (data->literals > P_SHORT_MAX) min_lz_match += data->big_lit;
 
 	if (data->ipos >= (data->length - min_lz_match)) return 0;
 
 	m0 = data->in + data->ipos;
-	total_scans = idx->bytecnt[*m0];
+	list = idx->pos + idx->start[*m0];
+	total_scans = (unsigned int)(idx->start[*m0 + 1] - idx->start[*m0]);
 
 	/* If the byte value does not exist anywhere, give up */
 	if (!total_scans) return 0;
@@ -348,7 +953,7 @@ static inline int lzjody_find_lz(struct comp_data_t * const restrict data,
 		/* Get offset of next byte */
 		length = 0;
 		m1 = m0;
-		offset = idx->byte[*m1][scan];
+		offset = *(list + scan);
 
 		/* Don't use offsets higher than input position */
 		if (offset >= data->ipos) {
@@ -372,31 +977,18 @@ static inline int lzjody_find_lz(struct comp_data_t * const restrict data,
 		/* Try to reject the match quickly */
 		if (*(m1 + min_lz_match - 1) != *(m2 + min_lz_match - 1)) goto end_lz_matches;
 
-		while (*m1 == *m2) {
-/*			DLOG("LZ: m1 0x%lx == m2 0x%lx (remain %x)\n",
-					(long)((uintptr_t)m1 - (uintptr_t)(data->in)),
-					(long)((uintptr_t)m2 - (uintptr_t)(data->in)),
-					remain
-					); */
-			length++;
-			m1++; m2++;
-			remain--;
-			if (!remain) {
-				DLOG("LZ: hit end of data\n");
-				done = 1;
-				break;
-			}
-			if (length >= MAX_LZ_MATCH) {
-				DLOG("LZ: maximum length reached\n");
-				done = 1;
-				break;
-			}
+		if (remain > data->max_lz) remain = data->max_lz;
+		length = lz_match_length(m1, m2, remain);
+		if (length == remain) {
+			DLOG("LZ: hit end of data or maximum length\n");
+			done = 1;
 		}
 end_lz_jump_match:
 		/* If this run was the longest match, record it */
 		if ((length >= min_lz_match) && (length > best_lz)) {
 			/* LZ can't use 4-bit offsets after 0x0f bytes */
-			if ((length == min_lz_match) && (offset > 0x0f)) {
+			if ((lz_value(data, offset) > P_SHORT_MAX)
+					&& (length < (min_lz_match + data->long_lz))) {
 				scan++;
 				continue;
 			}
@@ -405,7 +997,7 @@ end_lz_jump_match:
 			best_lz = length;
 			if (data->options & O_FAST_LZ) break;	/* Accept first LZ match */
 			if (done) break;
-			if (length >= MAX_LZ_MATCH) break;
+			if (length >= data->max_lz) break;
 		}
 		scan++;
 	}
@@ -424,32 +1016,18 @@ lz_linear_match:
 		/* Try to reject the match quickly */
 		if (*(m1 + min_lz_match - 1) != *(m2 + min_lz_match - 1)) goto end_lz_matches;
 
-		if (remain) {
-			while (*m1 == *m2) {
-/*			DLOG("LZ: m1 0x%lx == m2 0x%lx (remain %x)\n",
-					(long)((uintptr_t)m1 - (uintptr_t)(data->in)),
-					(long)((uintptr_t)m2 - (uintptr_t)(data->in)),
-					remain); */
-				length++;
-				m1++; m2++;
-				remain--;
-				if (!remain) {
-					DLOG("LZ: hit end of data\n");
-					done = 1;
-					goto end_lz_linear_match;
-				}
-				if (length >= MAX_LZ_MATCH) {
-					DLOG("LZ: maximum length reached\n");
-					done = 1;
-					goto end_lz_linear_match;
-				}
-			}
+		if (remain > data->max_lz) remain = data->max_lz;
+		length = lz_match_length(m1, m2, remain);
+		if (length == remain) {
+			DLOG("LZ: hit end of data or maximum length\n");
+			done = 1;
 		}
 end_lz_linear_match:
 		/* If this run was the longest match, record it */
 		if ((length >= min_lz_match) && (length > best_lz)) {
 			/* LZ can't use 4-bit offsets after 0x0f bytes */
-			if ((length == min_lz_match) && (scan > 0x0f)) {
+			if ((lz_value(data, scan) > P_SHORT_MAX)
+					&& (length < (min_lz_match + data->long_lz))) {
 				scan++;
 				continue;
 			}
@@ -458,33 +1036,14 @@ end_lz_linear_match:
 			best_lz = length;
 			if (data->options & O_FAST_LZ) break;	/* Accept first LZ match */
 			if (done) break;
-			if (length >= MAX_LZ_MATCH) break;
+			if (length >= data->max_lz) break;
 		}
 		scan++;
 	}
 
 end_lz_matches:
 	/* Write out the best LZ match, if any */
-	if (best_lz) {
-		DLOG("LZ compressed %x:%x bytes\n", best_lz_start, best_lz);
-		err = lzjody_flush_literals(data);
-		if (err < 0) return err;
-		if (best_lz < 256) {
-			err = lzjody_write_control(data, P_LZ, best_lz_start);
-			if (err < 0) return err;
-		} else {
-			err = lzjody_write_control(data, (P_LZ | P_LZL), best_lz_start);
-			if (err < 0) return err;
-			*(data->out + data->opos) = best_lz >> 8;
-			data->opos++;
-		}
-		/* Write LZ match length low byte */
-		*(data->out + data->opos) = (unsigned char)(best_lz & 0xff);
-		data->opos++;
-		/* Skip matched input */
-		data->ipos += best_lz;
-		return 1;
-	}
+	if (best_lz) return lzjody_write_lz(data, best_lz_start, best_lz);
 	return 0;
 
 err_remain_underflow:
@@ -498,66 +1057,31 @@ static inline int lzjody_find_rle(struct comp_data_t * const restrict data)
 	const unsigned char c = *(data->in + data->ipos);
 	unsigned int length = 0;
 	unsigned int big_literals = 0;
-	int err;
 
 	/* If literal count > short form constraints, avoid data expansion */
-	if (data->literals > P_SHORT_MAX) big_literals = 1;
-	while (((length + data->ipos) < data->length) && (*(data->in + data->ipos + length) == c)) {
-		length++;
-	}
-	if (length >= (MIN_RLE_LENGTH + big_literals)) {
-		DLOG("RLE: 0x%02x of 0x%02x at i %x, o %x\n",
-				length, c, data->ipos, data->opos);
-		err = lzjody_flush_literals(data);
-		if (err < 0) return err;
-		err = lzjody_write_control(data, P_RLE, length);
-		if (err < 0) return err;
-		/* Write repeated byte */
-		*(data->out + data->opos) = c;
-		data->opos++;
-		/* Skip matched input */
-		data->ipos += length;
-		return 1;
-	}
+	if (data->literals > P_SHORT_MAX) big_literals = data->big_lit;
+	length = rle_length(data->in + data->ipos, c, data->length - data->ipos);
+	if (length >= (MIN_RLE_LENGTH + big_literals)) return lzjody_write_rle(data, length);
 	return 0;
 }
 
 /* Find sequential 32-bit values for compression */
 static inline int lzjody_find_seq32(struct comp_data_t * const restrict data)
 {
-	uint32_t num32;
-	uint32_t *m32 = (uint32_t *)((uintptr_t)data->in + (uintptr_t)data->ipos);
-	const uint32_t num_orig32 = *m32;
 	unsigned int seqcnt;
 	unsigned int big_literals = 0;
-	int err;
+
+	/* Never read past the end of the input block */
+	if ((data->ipos + 3) >= data->length) return 0;
 
 	/* If literal count > short form constraints, avoid data expansion */
-	if (data->literals > P_SHORT_MAX) big_literals = 1;
-
-	/* 32-bit sequences */
-	seqcnt = 0;
-	num32 = *m32;
-	/* Loop bounds check compensates for bit width of data elements */
-	while (*m32 == num32) {
-		if ((data->ipos + seqcnt + 3) >= data->length) break;
-		seqcnt += 4;
-		num32++;
-		m32++;
-	}
-	seqcnt >>= 2;
-
-	if (seqcnt >= (MIN_SEQ32_LENGTH + big_literals)) {
-		DLOG("Seq(32): start 0x%x, 0x%x items\n", num_orig32, seqcnt);
-		err = lzjody_flush_literals(data);
-		if (err < 0) return err;
-		err = lzjody_write_control(data, P_SEQ32, seqcnt);
-		if (err < 0) return err;
-		*(uint32_t *)((uintptr_t)data->out + (uintptr_t)data->opos) = num_orig32;
-		data->opos += sizeof(uint32_t);
-		data->ipos += (seqcnt << 2);
-		return 1;
-	}
+	if (data->literals > P_SHORT_MAX) big_literals = data->big_lit;
+
+	/* 32-bit sequences; the limit compensates for bit width of data elements */
+	seqcnt = seq32_length(data->in + data->ipos, (data->length - data->ipos) >> 2);
+
+	if (seqcnt >= (MIN_SEQ32_LENGTH + big_literals))
+		return lzjody_write_seq(data, P_SEQ32, seqcnt);
 
 	return 0;
 }
@@ -565,37 +1089,20 @@ static inline int lzjody_find_seq32(struct comp_data_t * const restrict data)
 /* Find sequential 16-bit values for compression */
 static inline int lzjody_find_seq16(struct comp_data_t * const restrict data)
 {
-	uint16_t num16;
-	uint16_t *m16 = (uint16_t *)((uintptr_t)data->in + (uintptr_t)data->ipos);
-	const uint16_t num_orig16 = *m16;
 	unsigned int seqcnt;
 	unsigned int big_literals = 0;
-	int err;
+
+	/* Never read past the end of the input block */
+	if ((data->ipos + 1) >= data->length) return 0;
 
 	/* If literal count > short form constraints, avoid data expansion */
-	if (data->literals > P_SHORT_MAX) big_literals = 1;
+	if (data->literals > P_SHORT_MAX) big_literals = data->big_lit;
 
-	seqcnt = 0;
-	num16 = *m16;
-	/* Loop bounds check compensates for bit width of data elements */
-	while (*m16 == num16) {
-		if ((data->ipos + (seqcnt << 1) + 1) >= data->length) break;
-		seqcnt++;
-		num16++;
-		m16++;
-	}
+	/* The limit compensates for bit width of data elements */
+	seqcnt = seq16_length(data->in + data->ipos, (data->length - data->ipos) >> 1);
 
-	if (seqcnt >= (MIN_SEQ16_LENGTH + big_literals)) {
-		DLOG("Seq(16): start 0x%x, 0x%x items\n", num_orig16, seqcnt);
-		err = lzjody_flush_literals(data);
-		if (err < 0) return err;
-		err = lzjody_write_control(data, P_SEQ16, seqcnt);
-		if (err < 0) return err;
-		*(uint16_t *)((uintptr_t)data->out + (uintptr_t)data->opos) = num_orig16;
-		data->opos += sizeof(uint16_t);
-		data->ipos += (seqcnt << 1);
-		return 1;
-	}
+	if (seqcnt >= (MIN_SEQ16_LENGTH + big_literals))
+		return lzjody_write_seq(data, P_SEQ16, seqcnt);
 
 	return 0;
 }
@@ -603,146 +1110,1355 @@ static inline int lzjody_find_seq16(struct comp_data_t * const restrict data)
 /* Find sequential 8-bit values for compression */
 static inline int lzjody_find_seq8(struct comp_data_t * const restrict data)
 {
-	uint8_t num8;
-	uint8_t *m8 = (uint8_t *)((uintptr_t)data->in + (uintptr_t)data->ipos);
-	const uint8_t num_orig8 = *m8;
 	unsigned int seqcnt;
 	unsigned int big_literals = 0;
-	int err;
 
 	/* If literal count > short form constraints, avoid data expansion */
-	if (data->literals > P_SHORT_MAX) big_literals = 1;
+	if (data->literals > P_SHORT_MAX) big_literals = data->big_lit;
 
-	seqcnt = 0;
-	num8 = *m8;
-	while (*m8 == num8) {
-		if ((data->ipos + seqcnt) >= data->length) break;
-		seqcnt++;
-		num8++;
-		m8++;
-	}
+	seqcnt = seq8_length(data->in + data->ipos, data->length - data->ipos);
 
-	if (seqcnt >= (MIN_SEQ8_LENGTH + big_literals)) {
-		DLOG("Seq(8): start 0x%x, 0x%x items\n", num_orig8, seqcnt);
-		err = lzjody_flush_literals(data);
-		if (err < 0) return err;
-		err = lzjody_write_control(data, P_SEQ8, seqcnt);
-		if (err < 0) return err;
-		*(uint8_t *)((uintptr_t)data->out + (uintptr_t)data->opos) = num_orig8;
-		data->opos += sizeof(uint8_t);
-		data->ipos += seqcnt;
-		return 1;
-	}
+	if (seqcnt >= (MIN_SEQ8_LENGTH + big_literals))
+		return lzjody_write_seq(data, P_SEQ8, seqcnt);
 	return 0;
 }
 
-/* Lempel-Ziv compressor by Jody Bruchon (LZJODY)
- * Compresses "blk" data and puts result in "out"
- * out must be at least 2 bytes larger than blk in case
- * the data is not compressible at all.
- * Returns the size of "out" data or returns -1 if the
- * compressed data is not smaller than the original data.
- */
-extern int lzjody_compress(const unsigned char * const blk_in,
-		unsigned char * const blk_out,
-		const unsigned int options,
-		const unsigned int length)
+/* Bytes lzjody_write_control() writes for a type and value */
+static inline unsigned int control_cost(const struct comp_data_t * const restrict data,
+		const unsigned char type, const unsigned int value)
 {
-	int err;
-
-	/* Initialize compression data structure */
-	static struct comp_data_t data;
-	static struct lz_index_t idx;
+	if ((type & P_MASK) == P_EXT) {
+		if (value > P_SHORT_XMAX) return data->wide ? 4 : 3;
+		return 2;
+	}
+	if (value > P_SHORT_MAX) return data->wide ? 3 : 2;
+	return 1;
+}
 
-	DLOG("Comp: blk len 0x%x\n", length);
+/* Output bytes needed to encode 'm' at input position 'pos' */
+static inline unsigned int parse_cost(const struct comp_data_t * const restrict data,
+		const unsigned int pos, const struct parse_t * const restrict m)
+{
+	if (m->type == P_LZ)
+		return control_cost(data, P_LZ, data->wide ? (pos - m->value) : m->value)
+			+ ((m->length > 255) ? 2 : 1);
+	if (m->type == P_RLE) return control_cost(data, P_RLE, m->length) + 1;
+	return control_cost(data, m->type, m->value) + seq_width(m->type);
+}
+
+/* Write an encoding chosen by the lazy or optimal parser at ipos */
+static int parse_write(struct comp_data_t * const restrict data,
+		const struct parse_t * const restrict m)
+{
+	if (m->type == P_LZ) return lzjody_write_lz(data, m->value, m->length);
+	if (m->type == P_RLE) return lzjody_write_rle(data, m->length);
+	return lzjody_write_seq(data, m->type, m->value);
+}
+
+/* Find every RLE, sequence and LZ encoding possible at 'pos'
+ * LZ matches come last, in order of increasing length */
+static unsigned int parse_matches(struct comp_data_t * const restrict data,
+		const unsigned int pos, struct parse_t * const restrict cand)
+{
+	struct lz_chain_t * const chain = data->chain;
+	const unsigned char * const m0 = data->in + pos;
+	const unsigned int remain = data->length - pos;
+	const unsigned int probe = compress_probe(m0, remain);
+	const unsigned char *m2;
+	unsigned int depth = data->ctx->chain_depth;
+	unsigned int best = MIN_LZ_MATCH - 1;
+	unsigned int max_len;
+	unsigned int n = 0;
+	unsigned int length, count, offset, next;
+
+	if (probe & PROBE_RLE) {
+		length = rle_length(m0, *m0, remain);
+		if (length >= MIN_RLE_LENGTH) {
+			cand[n].length = length;
+			cand[n].value = length;
+			cand[n].type = P_RLE;
+			n++;
+		}
+	}
+	if (probe & PROBE_SEQ8) {
+		count = seq8_length(m0, remain);
+		if (count >= MIN_SEQ8_LENGTH) {
+			cand[n].length = count;
+			cand[n].value = count;
+			cand[n].type = P_SEQ8;
+			n++;
+		}
+	}
+	if ((probe & PROBE_SEQ16) && (remain >= 2)) {
+		count = seq16_length(m0, remain >> 1);
+		if (count >= MIN_SEQ16_LENGTH) {
+			cand[n].length = count << 1;
+			cand[n].value = count;
+			cand[n].type = P_SEQ16;
+			n++;
+		}
+	}
+	if ((probe & PROBE_SEQ32) && (remain >= 4)) {
+		count = seq32_length(m0, remain >> 2);
+		if (count >= MIN_SEQ32_LENGTH) {
+			cand[n].length = count << 2;
+			cand[n].value = count;
+			cand[n].type = P_SEQ32;
+			n++;
+		}
+	}
+
+	if (remain <= MIN_LZ_MATCH) return n;
+	if (depth == 0) depth = LZ_CHAIN_DEPTH;
+	max_len = (remain > data->max_lz) ? data->max_lz : remain;
+	lz_chain_update(data, chain, pos);
+	next = chain->head[lz_chain_hash(chain, m0)];
+
+	while (next && depth && (n < PARSE_MAX_CAND)) {
+		offset = next - 1;
+		if (offset < data->low) break;	/* Older than the window */
+		next = chain->prev[offset];
+		depth--;
+		m2 = data->in + offset;
+
+		/* Only a longer match is interesting */
+		if (*(m2 + best) != *(m0 + best)) continue;
+		length = lz_match_length(m0, m2, max_len);
+		if (length <= best) continue;
+		cand[n].length = length;
+		cand[n].value = offset;
+		cand[n].type = P_LZ;
+		n++;
+		best = length;
+		if (length == max_len) break;
+		if (data->nice && (length >= data->nice)) break;
+	}
+	return n;
+}
+
+/* Find the encoding at 'pos' that saves the most output bytes
+ * Returns the saving, or 0 with best->length = 0 if nothing helps */
+static int parse_best(struct comp_data_t * const restrict data,
+		const unsigned int pos, struct parse_t * const restrict best)
+{
+	struct parse_t cand[PARSE_MAX_CAND];
+	const unsigned int n = parse_matches(data, pos, cand);
+	int gain;
+	int best_gain = 0;
+
+	best->length = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		gain = (int)cand[i].length - (int)parse_cost(data, pos, cand + i);
+		if (gain > best_gain) {
+			best_gain = gain;
+			*best = cand[i];
+		}
+	}
+	return best_gain;
+}
+
+/* Lazy parsing: take the encoding that saves the most at each
+ * position, unless waiting one byte gives a better one */
+static int compress_scan_lazy(struct comp_data_t * const restrict data)
+{
+	struct parse_t cur, next;
+	int gain = 0;
+	int next_gain;
+	int have = 0;
+	int err;
+
+	while (data->ipos < data->length) {
+		if (!have) gain = parse_best(data, data->ipos, &cur);
+		have = 0;
+
+		/* Splitting a long literal run costs another literal header */
+		if (cur.length && (gain > ((data->literals > P_SHORT_MAX) ? (int)data->big_lit : 0))) {
+			if ((!data->nice || (cur.length < data->nice))
+					&& ((data->ipos + 1) < data->length)) {
+				next_gain = parse_best(data, data->ipos + 1, &next);
+				/* A literal here may also start a new literal run */
+				if (next_gain > (gain + (data->literals ? 0 : 1))) {
+					if (data->literals == 0) data->literal_start = data->ipos;
+					data->literals++;
+					data->ipos++;
+					cur = next;
+					gain = next_gain;
+					have = 1;
+					continue;
+				}
+			}
+			err = parse_write(data, &cur);
+			if (err < 0) return err;
+			continue;
+		}
+
+		/* Nothing compressed; add to literal bytes */
+		if (data->literals == 0) data->literal_start = data->ipos;
+		data->literals++;
+		data->ipos++;
+	}
+	return 0;
+}
+
+/* Fastest level: one hash table entry per 4-byte hash and only RLE and
+ * LZ are tried. Each miss is added to the literals and the scan steps
+ * further ahead the longer a literal run gets, so incompressible data
+ * is passed over quickly. */
+static int compress_scan_fast(struct comp_data_t * const restrict data)
+{
+	uint32_t * const tab = data->ctx->fast_tab;
+	const unsigned char *p;
+	unsigned int misses = 0;
+	unsigned int step, length, cand, min_len, max_len, h;
+	int err;
+
+	memset(tab, 0, sizeof(uint32_t) * FAST_HASH_SIZE);
+	while ((data->ipos + 4) <= data->length) {
+		p = data->in + data->ipos;
+		/* If literal count > short form constraints, avoid data expansion */
+		min_len = (data->literals > P_SHORT_MAX) ? data->big_lit : 0;
+
+		if ((*p == *(p + 1)) && (*p == *(p + 2))) {
+			length = rle_length(p, *p, data->length - data->ipos);
+			if (length >= (MIN_RLE_LENGTH + min_len)) {
+				err = lzjody_write_rle(data, length);
+				if (err < 0) return err;
+				misses = 0;
+				continue;
+			}
+		}
+
+		h = lz_hash4(p, FAST_HASH_BITS);
+		cand = tab[h];
+		tab[h] = data->ipos + 1;
+		if (cand && ((cand - 1) >= data->low)
+				&& (memcmp(p, data->in + cand - 1, 4) == 0)) {
+			cand--;
+			max_len = data->length - data->ipos;
+			if (max_len > data->max_lz) max_len = data->max_lz;
+			length = lz_match_length(p, data->in + cand, max_len);
+			min_len += MIN_LZ_MATCH;
+			/* LZ can't use 4-bit offsets after 0x0f bytes */
+			if (lz_value(data, cand) > P_SHORT_MAX) min_len += data->long_lz;
+			if (length >= min_len) {
+				err = lzjody_write_lz(data, cand, length);
+				if (err < 0) return err;
+				/* Remember a position near the end of the match */
+				if ((data->ipos + 2) <= data->length)
+					tab[lz_hash4(data->in + data->ipos - 2, FAST_HASH_BITS)] = data->ipos - 1;
+				misses = 0;
+				continue;
+			}
+		}
+
+		/* Nothing compressed; add to literal bytes */
+		step = 1 + (misses >> FAST_SKIP_SHIFT);
+		misses++;
+		if (step > (data->length - data->ipos)) step = data->length - data->ipos;
+		if (data->literals == 0) data->literal_start = data->ipos;
+		data->literals += step;
+		data->ipos += step;
+	}
+
+	/* The last few bytes are always literals */
+	if (data->ipos < data->length) {
+		if (data->literals == 0) data->literal_start = data->ipos;
+		data->literals += data->length - data->ipos;
+		data->ipos = data->length;
+	}
+	return 0;
+}
+
+/* Optimal parsing: find the cheapest series of literal, RLE, sequence
+ * and LZ commands for the block using the real control byte sizes,
+ * then write it out. Each position keeps the cheapest way to reach it
+ * that ends with a literal run and the cheapest that ends with a command,
+ * since the cost of the next literal depends on which one it follows.
+ * Anything at least 'nice' bytes long is taken without trying the
+ * positions inside it, which keeps long matches from making this
+ * quadratic. */
+static int compress_parse_optimal(struct comp_data_t * const restrict data)
+{
+	struct opt_node_t * const node = data->ctx->opt;
+	struct parse_t cand[PARSE_MAX_CAND];
+	struct parse_t m;
+	const unsigned int start = data->ipos;
+	const unsigned int n = data->length - start;
+	const unsigned int nice = data->nice ? data->nice : data->max_lz;
+	unsigned int count, longest, lits, base, price, step, low, prev_lz;
+	unsigned int i, j, k, len;
+	int lit;
+	int err;
+
+	for (i = 0; i <= n; i++) {
+		node[i].price = UINT32_MAX;
+		node[i].lprice = UINT32_MAX;
+	}
+	node[0].price = 0;
+
+	for (i = 0; i < n; i++) {
+		/* Start a literal run or add to the one ending here */
+		lits = 1;
+		price = UINT32_MAX;
+		if (node[i].price != UINT32_MAX)
+			price = node[i].price + 1 + control_cost(data, P_LIT, 1);
+		if (node[i].lprice != UINT32_MAX) {
+			base = node[i].lprice + 1 + control_cost(data, P_LIT, node[i].lits + 1)
+				- control_cost(data, P_LIT, node[i].lits);
+			if (base <= price) {
+				price = base;
+				lits = node[i].lits + 1;
+			}
+		}
+		if (price < node[i + 1].lprice) {
+			node[i + 1].lprice = price;
+			node[i + 1].lits = lits;
+		}
+
+		/* Try every length of every encoding found here */
+		base = (node[i].lprice < node[i].price) ? node[i].lprice : node[i].price;
+		count = parse_matches(data, start + i, cand);
+		longest = 0;
+		prev_lz = MIN_LZ_MATCH - 1;
+		for (k = 0; k < count; k++) {
+			m = cand[k];
+			if (m.type == P_LZ) {
+				step = 1;
+				low = prev_lz + 1;
+				prev_lz = m.length;
+			} else if (m.type == P_RLE) {
+				step = 1;
+				low = MIN_RLE_LENGTH;
+			} else {
+				step = seq_width(m.type);
+				low = step * ((m.type == P_SEQ32) ? MIN_SEQ32_LENGTH
+						: ((m.type == P_SEQ16) ? MIN_SEQ16_LENGTH : MIN_SEQ8_LENGTH));
+			}
+			if (m.length > longest) longest = m.length;
+			if (m.length >= nice) low = m.length;
+			for (len = m.length; len >= low; len -= step) {
+				m.length = len;
+				if (m.type != P_LZ) m.value = len / step;
+				price = base + parse_cost(data, start + i, &m);
+				if (price < node[i + len].price) {
+					node[i + len].price = price;
+					node[i + len].length = len;
+					node[i + len].value = m.value;
+					node[i + len].type = m.type;
+				}
+			}
+		}
+		if (longest >= nice) i += longest - 1;
+	}
+
+	/* Never do worse than storing the whole block as literals */
+	price = (node[n].lprice < node[n].price) ? node[n].lprice : node[n].price;
+	if (price >= (n + control_cost(data, P_LIT, n))) {
+		data->literal_start = start;
+		data->literals = n;
+		data->ipos = data->length;
+		return 0;
+	}
+
+	/* Walk the cheapest path back, linking each step forwards */
+	j = n;
+	lit = (node[n].lprice < node[n].price);
+	while (j > 0) {
+		i = j - (lit ? node[j].lits : node[j].length);
+		node[i].next = j;
+		node[i].lit = (unsigned char)lit;
+		lit = (node[i].lprice < node[i].price);
+		j = i;
+	}
+
+	for (i = 0; i < n; i = j) {
+		j = node[i].next;
+		if (node[i].lit) {
+			if (data->literals == 0) data->literal_start = data->ipos;
+			data->literals += j - i;
+			data->ipos += j - i;
+			continue;
+		}
+		m.length = node[j].length;
+		m.value = node[j].value;
+		m.type = node[j].type;
+		err = parse_write(data, &m);
+		if (err < 0) return err;
+	}
+	return 0;
+}
+
+/* Point a context at its built-in 4 KiB block buffers */
+static void lzjody_ctx_use_4k(struct lzjody_ctx * const ctx)
+{
+	ctx->bsize = LZJODY_BSIZE;
+	ctx->wide = 0;
+	ctx->chain.head = ctx->head_4k;
+	ctx->chain.prev = ctx->prev_4k;
+	ctx->chain2.head = NULL;
+	ctx->chain2.prev = NULL;
+	ctx->lit_in = ctx->lit_in_4k;
+	ctx->lit_out = ctx->lit_out_4k;
+	ctx->bp_temp = ctx->bp_temp_4k;
+	return;
+}
+
+/* Apply default settings to a new context */
+static void lzjody_ctx_defaults(struct lzjody_ctx * const ctx)
+{
+	lzjody_ctx_set_level(ctx, LZJODY_DEFAULT_LEVEL);
+	ctx->large = NULL;
+	lzjody_ctx_use_4k(ctx);
+	lzjody_ctx_reset(ctx);
+	return;
+}
+
+/* Allocate a compression/decompression context
+ * Each thread calling the library needs its own context */
+extern struct lzjody_ctx *lzjody_ctx_create(void)
+{
+	struct lzjody_ctx *ctx;
+
+	ctx = (struct lzjody_ctx *)calloc(1, sizeof(struct lzjody_ctx));
+	if (!ctx) goto error_oom;
+	lzjody_ctx_defaults(ctx);
+	return ctx;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory allocating context\n");
+	return NULL;
+}
+
+/* Clear all per-block state in a context; settings are kept
+ * In streaming mode this also drops the window, making a reset point */
+extern void lzjody_ctx_reset(struct lzjody_ctx * const ctx)
+{
+	if (!ctx) return;
+	ctx->data.ctx = ctx;
+	ctx->data.ipos = 0;
+	ctx->data.opos = 0;
+	ctx->data.literals = 0;
+	ctx->data.length = 0;
+	ctx->data.chain = NULL;
+	ctx->d2.ctx = ctx;
+	ctx->d2.literals = 0;
+	ctx->win_pos = 0;
+	ctx->block_count = 0;
+	ctx->dd_base = ctx->dd_seq;
+	for (int i = 0; i <= 256; i++) {
+		ctx->idx.start[i] = 0;
+		ctx->idx2.start[i] = 0;
+	}
+	return;
+}
+
+/* Set the maximum number of hash chain entries examined per position
+ * A depth of 0 selects the older per-byte jump list match finder */
+extern void lzjody_ctx_set_chain_depth(struct lzjody_ctx * const ctx,
+		const unsigned int depth)
+{
+	if (!ctx) return;
+	ctx->chain_depth = depth;
+	return;
+}
+
+/* Set the compression level from LZJODY_MIN_LEVEL to LZJODY_MAX_LEVEL
+ * This also sets the hash chain depth, so set a custom depth after it */
+extern int lzjody_ctx_set_level(struct lzjody_ctx * const ctx, const int level)
+{
+	if (!ctx) return -1;
+	if ((level < LZJODY_MIN_LEVEL) || (level > LZJODY_MAX_LEVEL)) goto error_level;
+	ctx->level = level;
+	ctx->chain_depth = levels[level].depth;
+	ctx->nice = levels[level].nice;
+	ctx->parse = levels[level].parse;
+	ctx->planes = levels[level].planes;
+	return 0;
+
+error_level:
+	fprintf(stderr, "liblzjody: error: compression level %d is not %d to %d\n",
+			level, LZJODY_MIN_LEVEL, LZJODY_MAX_LEVEL);
+	return -1;
+}
+
+extern int lzjody_ctx_level(const struct lzjody_ctx * const ctx)
+{
+	return ctx->level;
+}
+
+/* Set the block size: LZJODY_BSIZE, or a power of two from
+ * LZJODY_MIN_LBSIZE to LZJODY_MAX_LBSIZE for the large block format.
+ * Large blocks need about 12 bytes of context memory per block byte. */
+extern int lzjody_ctx_set_block_size(struct lzjody_ctx * const ctx,
+		const unsigned int bsize)
+{
+	unsigned char *p;
+	size_t chains;
+
+	if (!ctx) return -1;
+	if (bsize == ctx->bsize) return 0;
+	if (bsize != LZJODY_BSIZE) {
+		if ((bsize < LZJODY_MIN_LBSIZE) || (bsize > LZJODY_MAX_LBSIZE)
+				|| (bsize & (bsize - 1)))
+			goto error_bsize;
+	}
+	if ((ctx->dict_len + bsize) > LZJODY_MAX_LBSIZE) goto error_bsize;
+	lzjody_ctx_set_window(ctx, 0, 0);
+	free(ctx->large);
+	ctx->large = NULL;
+	lzjody_ctx_use_4k(ctx);
+	if (bsize == LZJODY_BSIZE) goto set_dict;
+
+	/* Two sets of chains, then the byte plane buffers */
+	chains = (LZ_HASH_SIZE_WIDE + (size_t)bsize) * sizeof(uint32_t);
+	p = (unsigned char *)malloc((chains * 2) + ((size_t)bsize * 3) + 8);
+	if (!p) goto error_oom;
+	ctx->large = p;
+	ctx->chain.head = (uint32_t *)(void *)p;
+	ctx->chain.prev = ctx->chain.head + LZ_HASH_SIZE_WIDE;
+	ctx->chain2.head = (uint32_t *)(void *)(p + chains);
+	ctx->chain2.prev = ctx->chain2.head + LZ_HASH_SIZE_WIDE;
+	ctx->lit_in = p + (chains * 2);
+	ctx->bp_temp = ctx->lit_in + bsize;
+	ctx->lit_out = ctx->bp_temp + bsize;
+	ctx->bsize = bsize;
+	ctx->wide = 1;
+set_dict:
+	/* Make room for the new block size after the dictionary */
+	if (ctx->dict_len && (lzjody_ctx_set_dict(ctx, ctx->dict, ctx->dict_len) < 0))
+		return -1;
+	/* The dedup cache holds whole blocks */
+	if (ctx->dd_blocks) return lzjody_ctx_set_dedup(ctx, ctx->dd_blocks);
+	return 0;
+
+error_bsize:
+	fprintf(stderr, "liblzjody: error: invalid block size %u\n", bsize);
+	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for %u byte blocks\n", bsize);
+	return -1;
+}
+
+extern unsigned int lzjody_ctx_block_size(const struct lzjody_ctx * const ctx)
+{
+	return ctx->bsize;
+}
+
+/* Let LZ matches reach up to 'window' bytes back into earlier blocks
+ * (streaming mode). History is dropped every 'reset' blocks so that the
+ * stream can be decoded starting at any multiple of 'reset' blocks.
+ * The window must be 1 to 15 blocks long, no more than 1 MiB including
+ * the current block, and only works with large blocks; 'reset' must be
+ * a power of two up to 32768. A window of 0 makes blocks independent.
+ * The window holds decompressor output too, so a context used with a
+ * window must only compress or only decompress. */
+extern int lzjody_ctx_set_window(struct lzjody_ctx * const ctx,
+		const unsigned int window, const unsigned int reset)
+{
+	unsigned char *p;
+	unsigned int cap;
+
+	if (!ctx) return -1;
+	if (window && ctx->dict_len) goto error_dict;
+	if (ctx->window) {
+		free(ctx->window);
+		ctx->window = NULL;
+		ctx->chain.head = (uint32_t *)ctx->large;
+		ctx->chain.prev = ctx->chain.head + LZ_HASH_SIZE_WIDE;
+	}
+	ctx->win = NULL;
+	ctx->win_size = 0;
+	ctx->win_cap = 0;
+	ctx->reset_blocks = 0;
+	lzjody_ctx_reset(ctx);
+	/* Reset points also empty the dedup cache, with or without a window */
+	if (window == 0) {
+		if ((reset > MAX_RESET_BLOCKS) || (reset & (reset - 1))) goto error_reset;
+		ctx->reset_blocks = reset;
+		return 0;
+	}
 
-	data.in = blk_in;
-	data.out = blk_out;
-	data.ipos = 0;
-	data.opos = 2;
-	data.literals = 0;
-	data.literal_start = 0;
-	data.length = length;
-	data.options = options;
+	if (ctx->bsize == LZJODY_BSIZE) goto error_window;
+	if ((window % ctx->bsize) || ((window / ctx->bsize) > 15)
+			|| ((window + ctx->bsize) > LZJODY_MAX_LBSIZE))
+		goto error_window;
+	if ((reset == 0) || (reset > MAX_RESET_BLOCKS) || (reset & (reset - 1)))
+		goto error_reset;
+
+	/* Hash chain links cover the whole window buffer; a block is
+	 * compressed in place right after its history. The history only
+	 * moves once the buffer fills, so each byte is moved about once.
+	 * The hash grows with the window to keep the chains short. */
+	ctx->win_bits = LZ_HASH_BITS_WIDE;
+	while ((1U << ctx->win_bits) < (window + ctx->bsize)) ctx->win_bits++;
+	cap = (window * 2) + ctx->bsize;
+	p = (unsigned char *)malloc((((size_t)cap + (1U << ctx->win_bits))
+				* sizeof(uint32_t)) + cap);
+	if (!p) goto error_oom;
+	ctx->window = p;
+	ctx->chain.head = (uint32_t *)(void *)p;
+	ctx->chain.prev = ctx->chain.head + (1U << ctx->win_bits);
+	ctx->win = (unsigned char *)(ctx->chain.prev + cap);
+	ctx->win_cap = cap;
+	ctx->win_size = window;
+	ctx->reset_blocks = reset;
+	return 0;
+
+error_window:
+	fprintf(stderr, "liblzjody: error: invalid window size %u for %u byte blocks\n",
+			window, ctx->bsize);
+	return -1;
+error_dict:
+	fprintf(stderr, "liblzjody: error: a window cannot be used with a dictionary\n");
+	return -1;
+error_reset:
+	fprintf(stderr, "liblzjody: error: invalid reset interval %u\n", reset);
+	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a %u byte window\n", window);
+	return -1;
+}
+
+extern unsigned int lzjody_ctx_window_size(const struct lzjody_ctx * const ctx)
+{
+	return ctx->win_size;
+}
+
+extern unsigned int lzjody_ctx_reset_interval(const struct lzjody_ctx * const ctx)
+{
+	if (!ctx->win_size && !ctx->dd_blocks) return 0;
+	return ctx->reset_blocks ? ctx->reset_blocks : MAX_RESET_BLOCKS;
+}
+
+/* Enable whole-block dedup: a block identical to one of the last
+ * 'blocks' blocks is written as a reference to it. References never
+ * reach back past a reset point, so threaded jobs stay independent.
+ * 'blocks' is a power of two up to 32768 and the cache may hold at
+ * most LZJODY_MAX_DEDUP bytes; 0 turns dedup off. Dedup streams have
+ * a stream header even with 4 KiB blocks. */
+extern int lzjody_ctx_set_dedup(struct lzjody_ctx * const ctx,
+		const unsigned int blocks)
+{
+	unsigned char *p = NULL;
+	size_t tab = 0;
+	size_t slots = 0;
+	unsigned int bits = 1;
+
+	if (!ctx) return -1;
+	if (blocks) {
+		if ((blocks > MAX_RESET_BLOCKS) || (blocks & (blocks - 1))
+				|| (((uint64_t)blocks * ctx->bsize) > LZJODY_MAX_DEDUP))
+			goto error_blocks;
+		/* Keep the hash table at most half full */
+		while ((1U << bits) < (blocks * 2)) bits++;
+		tab = sizeof(uint32_t) << bits;
+		slots = sizeof(struct dedup_slot_t) * blocks;
+		p = (unsigned char *)malloc(tab + slots + ((size_t)blocks * ctx->bsize));
+		if (!p) goto error_oom;
+		memset(p, 0, tab);
+	}
+	free(ctx->dd_buf);
+	ctx->dd_buf = p;
+	ctx->dd_blocks = blocks;
+	ctx->dd_bits = bits;
+	ctx->dd_tab = (uint32_t *)(void *)p;
+	ctx->dd_slot = blocks ? (struct dedup_slot_t *)(void *)(p + tab) : NULL;
+	ctx->dd_ring = blocks ? (p + tab + slots) : NULL;
+	ctx->dd_seq = 0;
+	ctx->dd_base = 0;
+	return 0;
+
+error_blocks:
+	fprintf(stderr, "liblzjody: error: invalid dedup cache of %u blocks of %u bytes\n",
+			blocks, ctx->bsize);
+	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a %u block dedup cache\n", blocks);
+	return -1;
+}
+
+extern unsigned int lzjody_ctx_dedup(const struct lzjody_ctx * const ctx)
+{
+	return ctx->dd_blocks;
+}
+
+/* Mark the stream as seekable: the header says that it ends with a
+ * block index (see lzjody_index_create()), so it always has a header */
+extern void lzjody_ctx_set_seekable(struct lzjody_ctx * const ctx, const int seekable)
+{
+	if (ctx) ctx->seekable = !!seekable;
+	return;
+}
+
+extern int lzjody_ctx_seekable(const struct lzjody_ctx * const ctx)
+{
+	return ctx->seekable;
+}
+
+/* Dictionary ID: 32-bit FNV-1a hash of the dictionary, never zero */
+extern unsigned int lzjody_dict_id(const unsigned char * const dict,
+		const unsigned int length)
+{
+	uint32_t h = 2166136261U;
 
-	if (options & O_NOPREFIX) data.opos = 0;
+	for (unsigned int i = 0; i < length; i++) {
+		h ^= *(dict + i);
+		h *= 16777619U;
+	}
+	return h ? h : 1;
+}
+
+/* Load a preset dictionary. Every block is compressed as if it came
+ * right after the dictionary, so LZ matches can copy from it, and the
+ * same dictionary is needed to decompress. Dictionaries use the large
+ * block encoding even for 4 KiB blocks; the dictionary plus one block
+ * may be at most 1 MiB. A NULL dictionary or zero length removes it. */
+extern int lzjody_ctx_set_dict(struct lzjody_ctx * const ctx,
+		const unsigned char * const dict, const unsigned int length)
+{
+	struct lz_chain_t * const chain = &(ctx->dchain);
+	unsigned char *p = NULL;
+	unsigned char *d = NULL;
+	unsigned int bits = LZ_HASH_BITS;
+	unsigned int cap = 0;
+	unsigned int pos;
+	unsigned int h;
+
+	if (!ctx) return -1;
+	if (!dict && length) goto error_size;
+	if (length && ctx->win_size) goto error_window;
+	if ((length + ctx->bsize) > LZJODY_MAX_LBSIZE) goto error_size;
+	if (length) {
+		/* The old dictionary may be passed when the block size changes */
+		cap = length + ctx->bsize;
+		while ((1U << bits) < cap) bits++;
+		p = (unsigned char *)malloc((((size_t)cap + (1U << bits))
+					* sizeof(uint32_t)) + cap);
+		if (!p) goto error_oom;
+		d = p + (((size_t)cap + (1U << bits)) * sizeof(uint32_t));
+		memcpy(d, dict, length);
+	}
+	free(ctx->dict_buf);
+	ctx->dict_buf = p;
+	ctx->dict = d;
+	ctx->dict_len = length;
+	ctx->dict_id = length ? lzjody_dict_id(d, length) : 0;
+	ctx->wide = (ctx->bsize > LZJODY_BSIZE) || length;
+	if (!length) return 0;
+
+	/* Hash the positions that lie wholly inside the dictionary */
+	chain->head = (uint32_t *)(void *)p;
+	chain->prev = chain->head + (1U << bits);
+	lz_chain_reset(chain, bits, 4);
+	for (pos = 0; (pos + 4) <= length; pos++) {
+		h = lz_chain_hash(chain, d + pos);
+		chain->prev[pos] = chain->head[h];
+		chain->head[h] = pos + 1;
+	}
+	chain->hashed = pos;
+	ctx->dict_hashed = pos;
+	return 0;
+
+error_size:
+	fprintf(stderr, "liblzjody: error: invalid dictionary size %u for %u byte blocks\n",
+			length, ctx->bsize);
+	return -1;
+error_window:
+	fprintf(stderr, "liblzjody: error: a dictionary cannot be used with a window\n");
+	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a %u byte dictionary\n", length);
+	return -1;
+}
+
+extern const unsigned char *lzjody_ctx_dict(const struct lzjody_ctx * const ctx,
+		unsigned int * const length)
+{
+	*length = ctx->dict_len;
+	return ctx->dict;
+}
+
+/* Put the dictionary chains back the way they were after hashing the
+ * dictionary alone; each prev[] link holds the head it replaced, so
+ * undoing the last block's positions newest first restores them */
+static void lzjody_dict_restore(struct lzjody_ctx * const ctx)
+{
+	struct lz_chain_t * const chain = &(ctx->dchain);
+	unsigned int pos = chain->hashed;
+
+	while (pos > ctx->dict_hashed) {
+		pos--;
+		chain->head[lz_chain_hash(chain, ctx->dict + pos)] = chain->prev[pos];
+	}
+	chain->hashed = ctx->dict_hashed;
+	return;
+}
+
+/* Block prefix size and worst-case compressed block size for a context */
+extern unsigned int lzjody_ctx_prefix_size(const struct lzjody_ctx * const ctx)
+{
+	return ctx->wide ? 4 : 2;
+}
+
+extern unsigned int lzjody_ctx_bound(const struct lzjody_ctx * const ctx)
+{
+	return ctx->bsize + (ctx->wide ? 8 : 4);
+}
+
+/* Make room in the window for the next block. All history is dropped at
+ * reset points; 'chains' also rebases the compressor's hash chains. */
+static void lzjody_window_next(struct lzjody_ctx * const ctx, const int chains)
+{
+	struct lz_chain_t * const chain = &(ctx->chain);
+	unsigned int shift;
+	unsigned int i;
+
+	if (ctx->block_count == ctx->reset_blocks) ctx->block_count = 0;
+	if (ctx->block_count == 0) {
+		ctx->win_pos = 0;
+		if (chains) lz_chain_reset(chain, ctx->win_bits, 4);
+	} else if ((ctx->win_pos + ctx->bsize) > ctx->win_cap) {
+		shift = ctx->win_pos - ctx->win_size;
+		memmove(ctx->win, ctx->win + shift, ctx->win_size);
+		ctx->win_pos = ctx->win_size;
+		if (chains) {
+			/* Positions are stored plus one; zero ends a chain */
+			memmove(chain->prev, chain->prev + shift,
+					ctx->win_size * sizeof(uint32_t));
+			for (i = 0; i < (1U << chain->hash_bits); i++)
+				chain->head[i] = (chain->head[i] > shift) ? (chain->head[i] - shift) : 0;
+			for (i = 0; i < ctx->win_size; i++)
+				chain->prev[i] = (chain->prev[i] > shift) ? (chain->prev[i] - shift) : 0;
+			chain->hashed -= shift;
+		}
+	}
+	ctx->block_count++;
+	return;
+}
+
+/* Dedup references stop at reset points; a context without a reset
+ * interval still gets one every MAX_RESET_BLOCKS blocks so that it
+ * fits in the stream header */
+static inline unsigned int dedup_reset(const struct lzjody_ctx * const ctx)
+{
+	return ctx->reset_blocks ? ctx->reset_blocks : MAX_RESET_BLOCKS;
+}
+
+/* Whole-block dedup hash: a multiply and xor per 8-byte word */
+static uint64_t dedup_hash(const unsigned char * const p, const unsigned int length)
+{
+	uint64_t h = length;
+	uint64_t w;
+	unsigned int i;
+
+	for (i = 0; (i + 8) <= length; i += 8) {
+		memcpy(&w, p + i, sizeof(uint64_t));
+		h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 32;
+	}
+	w = 0;
+	memcpy(&w, p + i, length - i);
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	return h ^ (h >> 29);
+}
+
+/* Start the next block; the dedup cache is emptied at reset points */
+static inline void lzjody_dedup_next(struct lzjody_ctx * const ctx)
+{
+	if ((ctx->dd_seq - ctx->dd_base) == dedup_reset(ctx)) ctx->dd_base = ctx->dd_seq;
+	return;
+}
+
+/* Find an earlier block identical to p; returns how many blocks back
+ * it is or 0. A matching hash is always verified against the data. */
+static unsigned int lzjody_dedup_find(const struct lzjody_ctx * const ctx,
+		const unsigned char * const p, const unsigned int length,
+		const uint64_t hash)
+{
+	const uint32_t e = *(ctx->dd_tab + (hash >> (64 - ctx->dd_bits)));
+	const struct dedup_slot_t *slot;
+
+	if (e == 0) return 0;
+	slot = ctx->dd_slot + (e - 1);
+	if ((slot->seq < ctx->dd_base) || (slot->hash != hash) || (slot->length != length))
+		return 0;
+	if (memcmp(ctx->dd_ring + ((size_t)(e - 1) * ctx->bsize), p, length) != 0)
+		return 0;
+	return (unsigned int)(ctx->dd_seq - slot->seq);
+}
+
+/* Add a block to the dedup cache; only the compressor needs it
+ * indexed by its hash */
+static void lzjody_dedup_add(struct lzjody_ctx * const ctx,
+		const unsigned char * const p, const unsigned int length,
+		const uint64_t hash, const int index)
+{
+	const unsigned int i = (unsigned int)(ctx->dd_seq & (ctx->dd_blocks - 1));
+	struct dedup_slot_t * const slot = ctx->dd_slot + i;
+
+	memcpy(ctx->dd_ring + ((size_t)i * ctx->bsize), p, length);
+	slot->hash = hash;
+	slot->seq = ctx->dd_seq;
+	slot->length = length;
+	if (index) *(ctx->dd_tab + (hash >> (64 - ctx->dd_bits))) = i + 1;
+	ctx->dd_seq++;
+	return;
+}
+
+/* Copy the block a dedup reference points to */
+static int lzjody_dedup_copy(const struct lzjody_ctx * const ctx,
+		const unsigned char * const in, unsigned char * const out,
+		const unsigned int size)
+{
+	const struct dedup_slot_t *slot;
+	unsigned int dist = 0;
+	unsigned int i;
+
+	if (ctx->dd_blocks == 0) goto error_nodedup;
+	if (size != 2) goto error_ref;
+	dist = ((unsigned int)*in << 8) | *(in + 1);
+	if ((dist == 0) || (dist > ctx->dd_blocks) || (dist > (ctx->dd_seq - ctx->dd_base)))
+		goto error_ref;
+	i = (unsigned int)((ctx->dd_seq - dist) & (ctx->dd_blocks - 1));
+	slot = ctx->dd_slot + i;
+	memcpy(out, ctx->dd_ring + ((size_t)i * ctx->bsize), slot->length);
+	return (int)slot->length;
+
+error_nodedup:
+	fprintf(stderr, "liblzjody: data error: block reference in a stream without dedup\n");
+	return -1;
+error_ref:
+	fprintf(stderr, "liblzjody: data error: bad block reference %u\n", dist);
+	return -1;
+}
+
+extern void lzjody_ctx_free(struct lzjody_ctx * const ctx)
+{
+	if (ctx) {
+		free(ctx->dict_buf);
+		free(ctx->dd_buf);
+		free(ctx->window);
+		free(ctx->large);
+		free(ctx->opt);
+	}
+	free(ctx);
+	return;
+}
+
+/* Write a large block stream header for a context's settings
+ * Returns the header size, or 0 for 4 KiB blocks without a dictionary,
+ * dedup or index which have none */
+extern int lzjody_header_write(const struct lzjody_ctx * const ctx,
+		unsigned char * const out)
+{
+	unsigned int shift = 0;
+
+	if (!ctx->wide && !ctx->dd_blocks && !ctx->seekable) return 0;
+	while ((1U << shift) < ctx->bsize) shift++;
+	*out = LZJODY_MAGIC;
+	*(out + 1) = 'L';
+	*(out + 2) = 'Z';
+	*(out + 3) = 'J';
+	*(out + 6) = (unsigned char)shift;
+	/* Flags */
+	*(out + 5) = ctx->seekable ? HDR_INDEX : 0;
+	if (ctx->dd_blocks) {
+		shift = 0;
+		while ((1U << shift) < ctx->dd_blocks) shift++;
+		*(out + 5) |= (unsigned char)(HDR_DEDUP | shift);
+	}
+	/* Only streams with flags need version 2 */
+	*(out + 4) = *(out + 5) ? LZJODY_FORMAT_VER : 1;
+	/* Window size in blocks, log2 of the reset interval above it */
+	*(out + 7) = 0;
+	if (ctx->win_size || ctx->dd_blocks) {
+		shift = 0;
+		while ((1U << shift) < dedup_reset(ctx)) shift++;
+		*(out + 7) = (unsigned char)((shift << 4) | (ctx->win_size / ctx->bsize));
+	}
+	/* Dictionary ID, or zero */
+	*(out + 8) = (unsigned char)(ctx->dict_id >> 24);
+	*(out + 9) = (unsigned char)(ctx->dict_id >> 16);
+	*(out + 10) = (unsigned char)(ctx->dict_id >> 8);
+	*(out + 11) = (unsigned char)ctx->dict_id;
+	return LZJODY_HEADER_SIZE;
+}
+
+/* Check a large block stream header and configure a context for it
+ * A stream made with a dictionary needs the same dictionary loaded
+ * into the context before the header is read */
+extern int lzjody_header_read(struct lzjody_ctx * const ctx,
+		const unsigned char * const in)
+{
+	unsigned int id;
+
+	if ((*in != LZJODY_MAGIC) || (*(in + 1) != 'L')
+			|| (*(in + 2) != 'Z') || (*(in + 3) != 'J'))
+		goto error_magic;
+	if ((*(in + 4) == 0) || (*(in + 4) > LZJODY_FORMAT_VER)) goto error_version;
+	if (*(in + 6) > 20) goto error_magic;
+	/* Version 1 has no flags; the low 4 bits belong to HDR_DEDUP */
+	if (*(in + 5) && ((*(in + 4) == 1) || (*(in + 5) & 0x30)
+				|| ((*(in + 5) & 0x0f) && !(*(in + 5) & HDR_DEDUP))))
+		goto error_magic;
+	id = ((unsigned int)*(in + 8) << 24) | ((unsigned int)*(in + 9) << 16)
+		| ((unsigned int)*(in + 10) << 8) | *(in + 11);
+	if (id != ctx->dict_id) goto error_dict;
+	/* Only dictionary, dedup and indexed streams use the header with
+	 * 4 KiB blocks */
+	if ((*(in + 6) < 16) && ((*(in + 6) != 12) || !(id || *(in + 5))))
+		goto error_magic;
+	ctx->seekable = !!(*(in + 5) & HDR_INDEX);
+	if (lzjody_ctx_set_block_size(ctx, 1U << *(in + 6)) < 0) return -1;
+	if (lzjody_ctx_set_window(ctx, (*(in + 7) & 0x0fU) << *(in + 6),
+				1U << (*(in + 7) >> 4)) < 0)
+		return -1;
+	return lzjody_ctx_set_dedup(ctx, (*(in + 5) & HDR_DEDUP) ? (1U << (*(in + 5) & 0x0f)) : 0);
+
+error_magic:
+	fprintf(stderr, "liblzjody: error: not an lzjody stream header\n");
+	return -1;
+error_version:
+	fprintf(stderr, "liblzjody: error: unsupported stream format version %u\n",
+			*(in + 4));
+	return -1;
+error_dict:
+	if (id) fprintf(stderr, "liblzjody: error: stream needs dictionary %08x\n", id);
+	else fprintf(stderr, "liblzjody: error: stream was not made with a dictionary\n");
+	return -1;
+}
+
+/* Decode a block prefix (LZJODY_PREFIX_SIZE bytes) */
+extern unsigned int lzjody_prefix_read(const struct lzjody_ctx * const ctx,
+		const unsigned char * const in, unsigned int * const flags)
+{
+	*flags = *in & 0xe0;
+	if (!ctx->wide) return ((unsigned int)(*in & 0x1f) << 8) | *(in + 1);
+	return ((unsigned int)(*in & 0x1f) << 24) | ((unsigned int)*(in + 1) << 16)
+		| ((unsigned int)*(in + 2) << 8) | *(in + 3);
+}
+
+/* Cheap check for blocks that look random byte by byte, such as
+ * encrypted or already compressed data. 16 bytes out of every 1/64 of
+ * the block are counted; random data spreads them evenly over all byte
+ * values, which makes the sum of the squared counts about
+ * n + n(n-1)/256 for n samples; text, code and tables are far more
+ * lopsided than that. Repeated strings can't be seen this way, so such
+ * blocks still get a quick single-probe LZ scan. */
+static int looks_random(const unsigned char * const p, const unsigned int length)
+{
+	uint32_t count[256];
+	uint64_t sum = 0;
+	uint64_t expect;
+	unsigned int step = (length >> 6) & ~15U;
+	unsigned int n = 0;
+
+	if (length < RANDOM_MIN_LENGTH) return 0;
+	memset(count, 0, sizeof(count));
+	for (unsigned int pos = 0; (pos + 16) <= length; pos += step) {
+		for (unsigned int i = pos; i < (pos + 16); i++) {
+			/* (c + 1)^2 - c^2 = 2c + 1 */
+			sum += ((uint64_t)count[*(p + i)] << 1) + 1;
+			count[*(p + i)]++;
+		}
+		n += 16;
+	}
+	expect = n + (((uint64_t)n * (n - 1)) >> 8);
+	return sum < (expect + (expect >> 3));
+}
+
+/* Write a block as it is, after a block prefix with O_NOCOMPRESS set
+ * The 4 KiB block format also puts the data length before the data */
+static int lzjody_store(const struct lzjody_ctx * const ctx,
+		const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int length)
+{
+	if (ctx->wide) {
+		*blk_out = (unsigned char)(((length >> 24) & 0x1f) | O_NOCOMPRESS);
+		*(blk_out + 1) = (unsigned char)(length >> 16);
+		*(blk_out + 2) = (unsigned char)(length >> 8);
+		*(blk_out + 3) = (unsigned char)length;
+		memcpy(blk_out + 4, blk_in, length);
+		return (int)length + 4;
+	}
+	*blk_out = (unsigned char)((((length + 2) >> 8) & 0x1f) | O_NOCOMPRESS);
+	*(blk_out + 1) = (unsigned char)(length + 2);
+	*(blk_out + 2) = (unsigned char)((length >> 8) & 0x1f);
+	*(blk_out + 3) = (unsigned char)length;
+	memcpy(blk_out + 4, blk_in, length);
+	return (int)length + 4;
+}
+
+/* Write a dedup reference to the block 'ref' blocks back */
+static int lzjody_write_ref(const struct lzjody_ctx * const ctx,
+		unsigned char * const blk_out, const unsigned int ref)
+{
+	unsigned char *p = blk_out;
+
+	*p++ = O_REPEAT;
+	if (ctx->wide) {
+		*p++ = 0;
+		*p++ = 0;
+	}
+	*p++ = 2;
+	*p++ = (unsigned char)(ref >> 8);
+	*p++ = (unsigned char)ref;
+	return (int)(p - blk_out);
+}
+
+/* Lempel-Ziv compressor by Jody Bruchon (LZJODY)
+ * Compresses "blk" data and puts result in "out"
+ * out must have room for lzjody_ctx_bound() bytes. A block that
+ * does not compress is stored as it is with O_NOCOMPRESS set in
+ * its prefix. Returns the size of "out" data or -1 on error.
+ */
+extern int lzjody_compress_ctx(struct lzjody_ctx * const ctx,
+		const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length)
+{
+	struct comp_data_t * const data = &(ctx->data);
+	int fast = (ctx->parse == PARSE_FAST);	/* Use compress_scan_fast() */
+	unsigned char flags = 0;	/* Block prefix flags */
+	const int dedup = ctx->dd_blocks && !(options & O_NOPREFIX);
+	uint64_t hash = 0;	/* dedup_hash() of the block */
+	unsigned int ref = 0;	/* Blocks back to an identical block */
+	int err;
+
+	DLOG("Comp: blk len 0x%x\n", length);
+
+	data->ctx = ctx;
+	data->in = blk_in;
+	data->out = blk_out;
+	data->ipos = 0;
+	data->opos = 2;
+	data->literals = 0;
+	data->literal_start = 0;
+	data->length = length;
+	data->options = options;
+	/* Fast levels write literal runs as they are unless asked not to */
+	if (!ctx->planes && !(options & O_ALL_PLANES)) data->options |= O_REALFLUSH;
+	data->wide = ctx->wide;
+	data->big_lit = ctx->wide ? 2 : 1;
+	data->long_lz = ctx->wide ? 2 : 1;
+	data->max_lz = ctx->wide ? MAX_LZ_MATCH_WIDE : MAX_LZ_MATCH;
+	data->low = 0;
+	data->nice = ctx->nice;
+
+	if (ctx->wide) data->opos = 4;
+	if (options & O_NOPREFIX) data->opos = 0;
 
 	/* Perform sanity checks on data length */
 	if (length == 0) goto error_zero_length;
-	if (length > LZJODY_BSIZE) goto error_large_length;
+	if (length > ctx->bsize) goto error_large_length;
+
+	/* Streaming mode compresses the block in place after its history */
+	if (ctx->win_size) {
+		lzjody_window_next(ctx, 1);
+		memcpy(ctx->win + ctx->win_pos, blk_in, length);
+		data->in = ctx->win;
+		data->ipos = ctx->win_pos;
+		data->literal_start = ctx->win_pos;
+		data->length = ctx->win_pos + length;
+		if (ctx->win_pos > ctx->win_size) data->low = ctx->win_pos - ctx->win_size;
+	} else if (ctx->dict_len) {
+		/* Dictionary mode compresses the block right after the dictionary */
+		lzjody_dict_restore(ctx);
+		memcpy(ctx->dict + ctx->dict_len, blk_in, length);
+		data->in = ctx->dict;
+		data->ipos = ctx->dict_len;
+		data->literal_start = ctx->dict_len;
+		data->length = ctx->dict_len + length;
+	}
+
+	/* All-zero blocks (common in disk images) skip the scan and are
+	 * flagged so decompressors can tell them apart without decoding */
+	if (dedup) lzjody_dedup_next(ctx);
+	if (!(options & O_NOPREFIX) && (length >= MIN_RLE_LENGTH) && (*blk_in == 0)
+			&& (rle_length(blk_in, 0, length) == length)) {
+		err = lzjody_write_rle(data, length);
+		if (err < 0) return err;
+		flags = O_ZEROBLOCK;
+		goto compress_short;
+	}
+
+	/* Repeats of recent blocks become references to them */
+	if (dedup) {
+		hash = dedup_hash(blk_in, length);
+		ref = lzjody_dedup_find(ctx, blk_in, length, hash);
+		if (ref) goto compress_short;
+	}
+
+	/* Data that looks random only gets the single-probe scan, which
+	 * still finds repeated strings; it is usually stored in the end */
+	if (!fast && looks_random(blk_in, length)) {
+		fast = 1;
+		data->options |= O_REALFLUSH;
+	}
 
 	/* Nothing under 3 bytes long will compress */
 	if (length < 3) {
-		data.literals = length;
+		data->literals = length;
 		goto compress_short;
 	}
 
-	/* Load arrays for match speedup */
-	err = index_bytes(&data, &idx);
-	if (err < 0) return err;
+	/* Load arrays for match speedup; window chains span blocks */
+	if (fast) {
+		data->chain = NULL;	/* Uses its own single-probe table */
+	} else if (ctx->win_size) {
+		data->chain = &(ctx->chain);
+	} else if (ctx->dict_len) {
+		data->chain = &(ctx->dchain);
+	} else if (ctx->wide) {
+		data->chain = &(ctx->chain);
+		lz_chain_reset(data->chain, LZ_HASH_BITS_WIDE, MIN_LZ_MATCH);
+	} else if (ctx->chain_depth || (ctx->parse != PARSE_GREEDY)) {
+		data->chain = &(ctx->chain);
+		lz_chain_reset(data->chain, LZ_HASH_BITS, MIN_LZ_MATCH);
+	} else {
+		data->chain = NULL;
+		err = index_bytes(data, &(ctx->idx));
+		if (err < 0) return err;
+	}
 
 	/* Scan through entire block looking for compressible items */
-	err = compress_scan(&data, &idx);
+	if (fast) {
+		err = compress_scan_fast(data);
+	} else if (ctx->parse == PARSE_OPTIMAL) {
+		if (ctx->opt_cap <= ctx->bsize) {
+			free(ctx->opt);
+			ctx->opt_cap = 0;
+			ctx->opt = (struct opt_node_t *)malloc((ctx->bsize + 1) * sizeof(struct opt_node_t));
+			if (!ctx->opt) goto error_oom;
+			ctx->opt_cap = ctx->bsize + 1;
+		}
+		err = compress_parse_optimal(data);
+	} else if (ctx->parse == PARSE_LAZY) {
+		err = compress_scan_lazy(data);
+	} else {
+		err = compress_scan(data, &(ctx->idx));
+	}
 	if (err < 0) return err;
 
 compress_short:
 	/* Flush any remaining literals */
-	err = lzjody_flush_literals(&data);
+	err = lzjody_flush_literals(data);
 	if (err < 0) return err;
 
+	/* The whole block becomes history for the next one */
+	if (ctx->win_size) {
+		if (data->length > ctx->chain.hash_bytes)
+			lz_chain_update(data, &(ctx->chain), data->length);
+		ctx->win_pos = data->length;
+	}
+
+	/* Every block goes in the dedup cache, as the decompressor's does */
+	if (dedup) lzjody_dedup_add(ctx, blk_in, length, hash, (flags == 0));
+	if (ref) return lzjody_write_ref(ctx, blk_out, ref);
+
+	/* Blocks that don't compress are stored as they are */
+	if (!(options & O_NOPREFIX) && (data->opos >= (length + 4)))
+		return lzjody_store(ctx, blk_in, blk_out, length);
+
 	/* Write the total length to the data block unless asked not to */
-	if (!(options & O_NOPREFIX)) {
-/* This uncompressed block part isn't working yet */
-#if 0
-		if (data.opos >= length) {
-			/* Flag incompressible data for possible faster decompression */
-			*(unsigned char *)(data.out) =
-				(unsigned char)((((data.opos - 2) & 0x1f00) >> 8) | O_NOCOMPRESS);
-			DLOG("### Incompressible: %x -> %x\n",
-				(unsigned char)(((data.opos - 2) & 0x1f00) >> 8),
-				(unsigned char)(((data.opos - 2) & 0x1f00) >> 8) | O_NOCOMPRESS);
-		} else {
-#endif
-			*(unsigned char *)(data.out) = (unsigned char)(((data.opos - 2) & 0x1f00) >> 8);
-//		}
-		*(unsigned char *)(data.out + 1) = (unsigned char)(data.opos - 2);
+	if (!(options & O_NOPREFIX) && ctx->wide) {
+		*(data->out) = (unsigned char)((((data->opos - 4) >> 24) & 0x1f) | flags);
+		*(data->out + 1) = (unsigned char)((data->opos - 4) >> 16);
+		*(data->out + 2) = (unsigned char)((data->opos - 4) >> 8);
+		*(data->out + 3) = (unsigned char)(data->opos - 4);
+	} else if (!(options & O_NOPREFIX)) {
+		*(data->out) = (unsigned char)((((data->opos - 2) & 0x1f00) >> 8) | flags);
+		*(data->out + 1) = (unsigned char)(data->opos - 2);
 	}
 
-	DLOG("compressed length: %x\n\n", data.opos);
-	return data.opos;
+	DLOG("compressed length: %x\n\n", data->opos);
+	return data->opos;
 
 error_large_length:
 	fprintf(stderr, "liblzjody: error: block length %d larger than maximum of %d\n",
-			length, LZJODY_BSIZE);
+			length, ctx->bsize);
 	return -1;
 error_zero_length:
 	fprintf(stderr, "liblzjody: error: cannot compress a zero-length block\n");
 	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for the optimal parser\n");
+	return -1;
 }
 
-/* LZJODY decompressor */
-extern int lzjody_decompress(const unsigned char * const in,
+/* Compress using a shared internal context (not thread-safe) */
+extern int lzjody_compress(const unsigned char * const blk_in,
+		unsigned char * const blk_out,
+		const unsigned int options,
+		const unsigned int length)
+{
+	static struct lzjody_ctx ctx;
+	static int ctx_ready = 0;
+
+	if (!ctx_ready) {
+		lzjody_ctx_defaults(&ctx);
+		ctx_ready = 1;
+	}
+	return lzjody_compress_ctx(&ctx, blk_in, blk_out, options, length);
+}
+
+/* Copy an LZ match of 'length' bytes from 'dist' bytes before dst
+ * Non-overlapping matches are a single bulk copy. Overlapping matches
+ * repeat the 'dist' bytes before dst: a distance of 1 is a fill and
+ * anything else is expanded by doubling bulk copies of the pattern. */
+static inline void lz_copy(unsigned char * const restrict dst,
+		const unsigned int dist, const unsigned int length)
+{
+	const unsigned char * const src = dst - dist;
+	unsigned int done;
+	unsigned int chunk;
+
+	if (dist >= length) {
+		memcpy(dst, src, length);
+		return;
+	}
+	if (dist == 1) {
+		memset(dst, *src, length);
+		return;
+	}
+	/* Each copy doubles the span of repeated pattern to copy from */
+	done = 0;
+	chunk = dist;
+	while (done < length) {
+		if (chunk > (length - done)) chunk = length - done;
+		memcpy(dst + done, src, chunk);
+		done += chunk;
+		chunk = dist + done;
+		chunk -= chunk % dist;
+	}
+	return;
+}
+
+/* LZJODY decompressor
+ * bp_temp is byte plane scratch space; nested byte plane commands
+ * are never generated by the compressor, so those pass NULL.
+ * limit is the most output allowed (the block size for a whole block),
+ * wide selects the large block encoding and hist is the number of bytes
+ * of window history before out that LZ commands may copy from */
+static int lzjody_decompress_block(const unsigned char * const in,
 		unsigned char * const out,
 		const unsigned int size,
-		const unsigned int options)
+		const unsigned int options,
+		unsigned char * const bp_temp,
+		const unsigned int limit,
+		const unsigned int wide,
+		const unsigned int hist)
 {
 	unsigned int mode;
-	register unsigned int ipos = 0;
-	register unsigned int opos = 0;
+	unsigned int ipos = 0;
+	unsigned int opos = 0;
 	unsigned int offset;
-	register unsigned int length = 0;
+	unsigned int length = 0;
 	unsigned int sl;	/* short/long */
 	unsigned int control = 0;
 	unsigned char c;
-	const unsigned char *mem1;
-	unsigned char *mem2;
-	/* FIXME: volatile to prevent vectorization (-fno-tree-loop-vectorize)
-	 * Should probably find another way to prevent unaligned vector access */
-	union {
-		uint32_t *m32;
-		volatile uint16_t *m16;
-		uint8_t *m8;
-	} mem;
 	union {
 		uint32_t num32;
 		uint16_t num16;
@@ -751,11 +2467,35 @@ extern int lzjody_decompress(const unsigned char * const in,
 	unsigned int seqbits = 0;
 	unsigned char *bp_out;
 	unsigned int bp_length;
-	unsigned char bp_temp[LZJODY_BSIZE];
 	int err;
 
 	/* Cannot decompress a zero-length block */
 	if (size == 0) return -1;
+	/* Block references need the dedup cache of a context */
+	if (options & O_REPEAT) goto error_repeat;
+
+	/* Stored blocks hold their data as it is; 4 KiB blocks put the
+	 * data length in two bytes before it, which must fill the record */
+	if (options & O_NOCOMPRESS) {
+		length = size;
+		if (!wide) {
+			if (size < 2) goto error_truncated;
+			length = ((unsigned int)(*in & 0x1f) << 8) | *(in + 1);
+			ipos = 2;
+			if ((length + 2) != size) goto error_truncated;
+		}
+		if (length > limit) goto error_stored;
+		memcpy(out, in + ipos, length);
+		return (int)length;
+	}
+
+	/* Zero blocks are one RLE command; make sure the flag is true */
+	if (options & O_ZEROBLOCK) {
+		err = lzjody_decompress_block(in, out, size, 0, NULL, limit, wide, 0);
+		if (err < 0) return err;
+		if (rle_length(out, 0, (unsigned int)err) != (unsigned int)err) goto error_zeroblock;
+		return err;
+	}
 
 	while (ipos < size) {
 		c = *(in + ipos);
@@ -763,6 +2503,8 @@ extern int lzjody_decompress(const unsigned char * const in,
 		mode = c & P_MASK;
 		sl = c & P_SHORT;
 		ipos++;
+		/* Every command has at least one more byte */
+		if (ipos >= size) goto error_truncated;
 		/* Extended commands don't advance input here */
 		if (mode == 0) {
 			/* Change mode to the extended command instead */
@@ -772,12 +2514,20 @@ extern int lzjody_decompress(const unsigned char * const in,
 			if (mode & (P_SMASK | P_PLANE)) {
 				length = *(in + ipos);
 #ifdef DEBUG
-				if (mode & P_SMASK) { DLOG("Seq length: %x\n", length); }
-				if (mode & P_PLANE) { DLOG("Byte plane length: %x\n", length); }
+				if (plane_count(mode)) { DLOG("Byte plane length: %x\n", length); }
+				else { DLOG("Seq length: %x\n", length); }
 #endif /* DLOG */
 				ipos++;
 				/* Long form has a high byte */
-				if (!sl) {
+				if (!sl && wide) {
+					/* Large blocks have a 24-bit value */
+					if ((ipos + 2) > size) goto error_truncated;
+					length = (length << 16) | ((unsigned int)*(in + ipos) << 8)
+						| *(in + ipos + 1);
+					ipos += 2;
+					if (length > limit) goto error_length;
+				} else if (!sl) {
+					if (ipos >= size) goto error_truncated;
 					length <<= 8;
 					length += (uint16_t)*(in + ipos);
 					DLOG("length modifier: 0x%x (0x%x)\n",
@@ -785,15 +2535,23 @@ extern int lzjody_decompress(const unsigned char * const in,
 						(uint16_t)*(in + ipos) << 8);
 					ipos++;
 				}
-				if (length > LZJODY_BSIZE) goto error_length;
+				if (!wide && (length > LZJODY_BSIZE)) goto error_length;
 			}
 		}
 		/* Handle short/long standard commands */
 		else if (sl) {
 			control = c & P_SHORT_MAX;
 			DLOG("Short control: 0x%x\n", control);
+		} else if (wide) {
+			/* 20-bit value; bit 0x10 is bit 20 except for LZ */
+			if ((ipos + 2) > size) goto error_truncated;
+			if (mode == P_LZ) control = (unsigned int)(c & P_SHORT_MAX) << 16;
+			else control = (unsigned int)(c & (P_LZL | P_SHORT_MAX)) << 16;
+			control |= ((unsigned int)*(in + ipos) << 8) | *(in + ipos + 1);
+			DLOG("Long control: 0x%x\n", control);
+			ipos += 2;
 		} else {
-			if (c & (P_RLE | P_LZL)) 
+			if (c & (P_RLE | P_LZL))
 				control = (unsigned int)(c & (P_LZL | P_SHORT_MAX)) << 8;
 			else control = (unsigned int)(c & P_SHORT_MAX) << 8;
 			control += *(in + ipos);
@@ -804,28 +2562,38 @@ extern int lzjody_decompress(const unsigned char * const in,
 		/* Based on the command, select a decompressor */
 		switch (mode) {
 			case P_PLANE:
+			case P_PLANE2:
+			case P_PLANE8:
+			case P_PLANE16:
 				/* Byte plane transformation handler */
 				DLOG("%04x:%04x:  Byte plane c_len 0x%x\n", ipos, opos, length);
+				if (bp_temp == NULL) goto error_bp_nested;
+				if ((ipos + length) > size) goto error_truncated;
 				bp_out = out + opos;
-				bp_length = lzjody_decompress((in + ipos), bp_out, length, 0);
+				err = lzjody_decompress_block((in + ipos), bp_out, length,
+						0, NULL, limit - opos, wide, 0);
+				if (err < 0) return err;
+				bp_length = (unsigned int)err;
+				if ((opos + bp_length) > limit) goto error_bp_length;
 
-				err = byteplane_transform(bp_out, bp_temp, bp_length, -4);
+				err = byteplane_transform(bp_out, bp_temp, (int)bp_length,
+						-plane_count(mode));
 				if (err < 0) return err;
 
 				DLOG("Byte plane transform len 0x%x done\n", bp_length);
+				memcpy(bp_out, bp_temp, bp_length);
 				ipos += length;
 				opos += bp_length;
-				if (opos > LZJODY_BSIZE) goto error_bp_length;
-				length = 0;
-				/* memcpy sucks, we can do it ourselves */
-				while(length < bp_length) {
-					*(bp_out + length) = *(bp_temp + length);
-					length++;
-				}
 				break;
+
 			case P_LZ:
-				/* LZ (dictionary-based) compression */
-				offset = control & 0xfff;
+				/* LZ (dictionary-based) compression
+				 * 4 KiB blocks store an absolute offset and large
+				 * blocks the distance back, which may reach into
+				 * the window history before out */
+				if (wide && ((control == 0) || (control > (opos + hist))))
+					goto error_lz_distance;
+				if ((ipos + ((c & P_LZL) ? 2 : 1)) > size) goto error_truncated;
 				length = *(in + ipos);
 				ipos++;
 				if (c & P_LZL) {
@@ -833,108 +2601,78 @@ extern int lzjody_decompress(const unsigned char * const in,
 					length += *(in + ipos);
 					ipos++;
 				}
-				DLOG("%04x:%04x: LZ block (%x:%x)\n",
-						ipos, opos, offset, length);
-				/* memcpy/memmove do not handle the overlap
-				 * correctly when it happens, so we copy the
-				 * data manually.
-				 */
-				if (offset >= opos) goto error_lz_offset;
-				mem1 = out + offset;
-				mem2 = out + opos;
-				opos += length;
-				if (opos > LZJODY_BSIZE) goto error_lz_length;
-				while (length != 0) {
-					*mem2 = *mem1;
-					mem1++; mem2++;
-					length--;
+				if (!wide) {
+					offset = control & 0xfff;
+					if (offset >= opos) goto error_lz_offset;
+					control = opos - offset;
 				}
+				DLOG("%04x:%04x: LZ block (-%x:%x)\n",
+						ipos, opos, control, length);
+				if ((opos + length) > limit) goto error_lz_length;
+				lz_copy(out + opos, control, length);
+				opos += length;
 				break;
 
 			case P_RLE:
 				/* Run-length encoding */
 				length = control;
+				if (ipos >= size) goto error_truncated;
 				c = *(in + ipos);
 				ipos++;
 				DLOG("%04x:%04x: RLE run 0x%x\n", ipos, opos, length);
-				if (opos + length > LZJODY_BSIZE) goto error_rle_length;
-				while (length > 0) {
-					*(out + opos) = c;
-					opos++;
-					length--;
-				}
+				if (opos + length > limit) goto error_rle_length;
+				memset(out + opos, c, length);
+				opos += length;
 				break;
 
 			case P_LIT:
 				/* Literal byte sequence */
 				DLOG("%04x:%04x: 0x%x literal bytes\n", ipos, opos, control);
 				length = control;
-				mem1 = (const unsigned char *)(in + ipos);
-				mem2 = (unsigned char *)(out + opos);
-				while (length != 0) {
-					*mem2 = *mem1;
-					mem1++; mem2++;
-					length--;
-				}
-				ipos += control;
-				opos += control;
-				if (opos > LZJODY_BSIZE) goto error_lit_length;
+				if ((ipos + length) > size) goto error_truncated;
+				if ((opos + length) > limit) goto error_lit_length;
+				memcpy(out + opos, in + ipos, length);
+				ipos += length;
+				opos += length;
 				break;
 
 			case P_SEQ32:
 				seqbits = 32;
 				/* Sequential increment compression (32-bit) */
 				DLOG("%04x:%04x: Seq(32) 0x%x\n", ipos, opos, length);
+				if ((ipos + sizeof(uint32_t)) > size) goto error_truncated;
+				if ((opos + (length << 2)) > limit) goto error_seq;
 				/* Get sequence start number */
-				num.num32 = *(uint32_t *)((uintptr_t)in + (uintptr_t)ipos);
+				memcpy(&num.num32, in + ipos, sizeof(uint32_t));
 				ipos += sizeof(uint32_t);
-				/* Get sequence start position */
-				mem.m32 = (uint32_t *)((uintptr_t)out + (uintptr_t)opos);
+				lzjody_kern.seq32_fill(out + opos, num.num32, length);
 				opos += (length << 2);
-				if (opos > LZJODY_BSIZE) goto error_seq;
-				DLOG("opos = 0x%x, length = 0x%x\n", opos, length);
-				while (length > 0) {
-					*mem.m32 = num.num32;
-					mem.m32++; num.num32++;
-					length--;
-				}
 				break;
 
 			case P_SEQ16:
 				seqbits = 16;
 				/* Sequential increment compression (16-bit) */
 				DLOG("%04x:%04x: Seq(16) 0x%x\n", ipos, opos, length);
+				if ((ipos + sizeof(uint16_t)) > size) goto error_truncated;
+				if ((opos + (length << 1)) > limit) goto error_seq;
 				/* Get sequence start number */
-				num.num16 = *(uint16_t *)((uintptr_t)in + (uintptr_t)ipos);
+				memcpy(&num.num16, in + ipos, sizeof(uint16_t));
 				ipos += sizeof(uint16_t);
-				/* Get sequence start position */
-				mem.m16 = (uint16_t *)((uintptr_t)out + (uintptr_t)opos);
-				DLOG("opos = 0x%x, length = 0x%x\n", opos, length);
+				lzjody_kern.seq16_fill(out + opos, num.num16, length);
 				opos += (length << 1);
-				if (opos > LZJODY_BSIZE) goto error_seq;
-				while (length > 0) {
-					*mem.m16 = num.num16;
-					mem.m16++; num.num16++;
-					length--;
-				}
 				break;
 
 			case P_SEQ8:
 				seqbits = 8;
 				/* Sequential increment compression (8-bit) */
 				DLOG("%04x:%04x: Seq(8) 0x%x\n", ipos, opos, length);
+				if (ipos >= size) goto error_truncated;
+				if ((opos + length) > limit) goto error_seq;
 				/* Get sequence start number */
-				num.num8 = *(uint8_t *)((uintptr_t)in + (uintptr_t)ipos);
+				num.num8 = *(in + ipos);
 				ipos += sizeof(uint8_t);
-				/* Get sequence start position */
-				mem.m8 = (uint8_t *)((uintptr_t)out + (uintptr_t)opos);
+				lzjody_kern.seq8_fill(out + opos, num.num8, length);
 				opos += length;
-				if (opos > LZJODY_BSIZE) goto error_seq;
-				while (length > 0) {
-					*mem.m8 = num.num8;
-					mem.m8++; num.num8++;
-					length--;
-				}
 				break;
 
 			default:
@@ -942,27 +2680,48 @@ extern int lzjody_decompress(const unsigned char * const in,
 		}
 	}
 
-	if (opos > LZJODY_BSIZE) goto error_opos;
-	return opos;
+	if (opos > limit) goto error_opos;
+	return (int)opos;
 
 error_opos:
-	fprintf(stderr, "liblzjody: error: output pos %d higher than maximum %d)\n", opos, LZJODY_BSIZE);
+	fprintf(stderr, "liblzjody: error: output pos %d higher than maximum %d)\n", opos, limit);
+	return -1;
+error_truncated:
+	fprintf(stderr, "liblzjody: data error: command at 0x%x runs past end of block (0x%x)\n",
+			ipos, size);
+	return -1;
+error_stored:
+	fprintf(stderr, "liblzjody: data error: stored block length 0x%x > 0x%x\n",
+			length, limit);
+	return -1;
+error_repeat:
+	fprintf(stderr, "liblzjody: data error: block reference without a dedup cache\n");
+	return -1;
+error_zeroblock:
+	fprintf(stderr, "liblzjody: data error: zero block flag on nonzero data\n");
 	return -1;
 error_bp_length:
 	fprintf(stderr, "liblzjody: error: byte plane length overflows output pos (%d > %d)\n",
-			opos, LZJODY_BSIZE);
+			opos + bp_length, limit);
+	return -1;
+error_bp_nested:
+	fprintf(stderr, "liblzjody: data error: nested byte plane transform at 0x%x\n", ipos);
 	return -1;
 error_rle_length:
 	fprintf(stderr, "liblzjody: error: RLE length overflows output pos (%d > %d)\n",
-			opos + length, LZJODY_BSIZE);
+			opos + length, limit);
 	return -1;
 error_lit_length:
 	fprintf(stderr, "liblzjody: error: literal length overflows output pos (%d > %d)\n",
-			opos, LZJODY_BSIZE);
+			opos + length, limit);
 	return -1;
 error_lz_length:
 	fprintf(stderr, "liblzjody: error: LZ length overflows output pos (%d > %d)\n",
-			opos, LZJODY_BSIZE);
+			opos + length, limit);
+	return -1;
+error_lz_distance:
+	fprintf(stderr, "liblzjody: data error: LZ distance 0x%x invalid at output pos 0x%x)\n",
+			control, opos);
 	return -1;
 error_lz_offset:
 	fprintf(stderr, "liblzjody: data error: LZ offset 0x%x >= output pos 0x%x)\n", offset, opos);
@@ -972,10 +2731,51 @@ error_seq:
 	return -1;
 error_length:
 	fprintf(stderr, "liblzjody: data error: length 0x%x greater than maximum 0x%x @ 0x%x\n",
-			length, LZJODY_BSIZE, ipos - 1);
+			length, wide ? limit : LZJODY_BSIZE, ipos - 1);
 	return -1;
 error_mode:
 	fprintf(stderr, "liblzjody: error: invalid decompressor mode 0x%x at 0x%x\n", mode, ipos);
 	return -1;
 }
 
+/* Decompress using the byte plane scratch space in a context */
+extern int lzjody_decompress_ctx(struct lzjody_ctx * const ctx,
+		const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int options)
+{
+	unsigned char *dst = out;	/* Where the block is decoded */
+	unsigned int hist = 0;	/* History before dst for LZ copies */
+	int err;
+
+	/* Dictionary mode decodes after the dictionary and streaming mode
+	 * after the window history, then copy out */
+	if (ctx->dict_len) {
+		dst = ctx->dict + ctx->dict_len;
+		hist = ctx->dict_len;
+	} else if (ctx->win_size) {
+		lzjody_window_next(ctx, 0);
+		dst = ctx->win + ctx->win_pos;
+		hist = ctx->win_pos;
+	}
+	if (ctx->dd_blocks) lzjody_dedup_next(ctx);
+	if (options & O_REPEAT) err = lzjody_dedup_copy(ctx, in, dst, size);
+	else err = lzjody_decompress_block(in, dst, size, options, ctx->bp_temp,
+			ctx->bsize, ctx->wide, hist);
+	if (err < 0) return err;
+	if (dst != out) memcpy(out, dst, (size_t)err);
+	if (ctx->win_size) ctx->win_pos += (unsigned int)err;
+	if (ctx->dd_blocks) lzjody_dedup_add(ctx, out, (unsigned int)err, 0, 0);
+	return err;
+}
+
+extern int lzjody_decompress(const unsigned char * const in,
+		unsigned char * const out,
+		const unsigned int size,
+		const unsigned int options)
+{
+	unsigned char bp_temp[LZJODY_BSIZE];
+
+	return lzjody_decompress_block(in, out, size, options, bp_temp, LZJODY_BSIZE, 0, 0);
+}
@@ -8,6 +8,10 @@
 #ifndef LZJODY_H
 #define LZJODY_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,19 +22,193 @@ extern "C" {
 /* Maximum amount of data the algorithm can process at a time */
 #define LZJODY_BSIZE 4096
 
+/* Large block format: power-of-two block sizes in this range can be set
+ * with lzjody_ctx_set_block_size(). Large blocks use wider encodings,
+ * 4-byte block prefixes and a versioned stream header. */
+#define LZJODY_MIN_LBSIZE 0x10000
+#define LZJODY_MAX_LBSIZE 0x100000
+
+/* Compressed block prefix size and worst-case compressed block size
+ * (streams with a dictionary use the large block sizes; see
+ * lzjody_ctx_prefix_size() and lzjody_ctx_bound()) */
+#define LZJODY_PREFIX_SIZE(bsize) ((bsize) > LZJODY_BSIZE ? 4 : 2)
+#define LZJODY_BOUND(bsize) ((bsize) + ((bsize) > LZJODY_BSIZE ? 8 : 4))
+
+/* Stream header for the large block format; 4 KiB block streams have
+ * no header and a block prefix can never start with LZJODY_MAGIC.
+ * The header also records the streaming mode window, the dedup cache
+ * and the ID of the preset dictionary, if any. Streams with dedup
+ * references are format version 2 so older versions refuse them. */
+#define LZJODY_MAGIC 0x1f
+#define LZJODY_HEADER_SIZE 12
+#define LZJODY_FORMAT_VER 2
+
+/* Seekable streams end with an index and a footer of this size */
+#define LZJODY_FOOTER_SIZE 24
+
+/* Uncompressed bytes per index entry chosen by lzjody_index_default_bits() */
+#define LZJODY_INDEX_BYTES 0x10000
+
+/* Default decoded block cache size of a reader (lzjody_reader_open()) */
+#define LZJODY_READER_CACHE 0x800000
+
+/* Largest whole-block dedup cache (see lzjody_ctx_set_dedup()) */
+#define LZJODY_MAX_DEDUP 0x10000000
+
+/* Compression levels for lzjody_ctx_set_level(): 0 is a single-probe
+ * mode for latency-sensitive uses, 1-3 are greedy with deeper match
+ * searches, 4-6 add lazy matching and 7-9 parse each block optimally.
+ * Higher levels only make compression slower. */
+#define LZJODY_MIN_LEVEL 0
+#define LZJODY_MAX_LEVEL 9
+#define LZJODY_DEFAULT_LEVEL 3
+
 /* Options for the compressor */
 #define O_FAST_LZ 0x01	/* Stop at first LZ match (faster but not recommended) */
+#define O_ALL_PLANES 0x02	/* Also try 2/8/16 byte planes (newer decompressors only) */
 #define O_NOPREFIX 0x40	/* Don't prefix lzjody_compress() data with the compressed length */
 #define O_REALFLUSH 0x80	/* Make lzjody_flush_literals() flush without question */
 
 /* Decompressor options (some copied from data block header) */
 #define O_NOCOMPRESS 0x80	/* Incompressible block packing flag */
+#define O_ZEROBLOCK 0x40	/* All-zero block flag (a single RLE of zeros) */
+#define O_REPEAT 0x20	/* Reference to an earlier identical block (dedup) */
+
+/* Opaque compression/decompression state
+ * A context may only be used by one thread at a time; the *_ctx()
+ * functions are reentrant when every thread has its own context. */
+struct lzjody_ctx;
+
+extern struct lzjody_ctx *lzjody_ctx_create(void);
+extern void lzjody_ctx_reset(struct lzjody_ctx * const);
+extern void lzjody_ctx_free(struct lzjody_ctx * const);
+extern void lzjody_ctx_set_chain_depth(struct lzjody_ctx * const,
+		const unsigned int);
+extern int lzjody_ctx_set_level(struct lzjody_ctx * const, const int);
+extern int lzjody_ctx_level(const struct lzjody_ctx * const);
+extern int lzjody_ctx_set_block_size(struct lzjody_ctx * const,
+		const unsigned int);
+extern unsigned int lzjody_ctx_block_size(const struct lzjody_ctx * const);
+extern int lzjody_ctx_set_window(struct lzjody_ctx * const,
+		const unsigned int, const unsigned int);
+extern unsigned int lzjody_ctx_window_size(const struct lzjody_ctx * const);
+extern unsigned int lzjody_ctx_reset_interval(const struct lzjody_ctx * const);
+extern int lzjody_ctx_set_dedup(struct lzjody_ctx * const, const unsigned int);
+extern unsigned int lzjody_ctx_dedup(const struct lzjody_ctx * const);
+extern void lzjody_ctx_set_seekable(struct lzjody_ctx * const, const int);
+extern int lzjody_ctx_seekable(const struct lzjody_ctx * const);
+extern unsigned int lzjody_ctx_prefix_size(const struct lzjody_ctx * const);
+extern unsigned int lzjody_ctx_bound(const struct lzjody_ctx * const);
 
+/* Preset dictionaries
+ * lzjody_train_dict() builds a dictionary of up to 'size' bytes from
+ * sample data split into 4 KiB pages and returns its length. */
+extern int lzjody_ctx_set_dict(struct lzjody_ctx * const,
+		const unsigned char * const, const unsigned int);
+extern const unsigned char *lzjody_ctx_dict(const struct lzjody_ctx * const,
+		unsigned int * const);
+extern unsigned int lzjody_dict_id(const unsigned char * const, const unsigned int);
+extern int lzjody_train_dict(const unsigned char * const, const unsigned int,
+		unsigned char * const, const unsigned int);
+extern int lzjody_compress_ctx(struct lzjody_ctx * const,
+		const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int);
+extern int lzjody_decompress_ctx(struct lzjody_ctx * const,
+		const unsigned char * const, unsigned char * const,
+		const unsigned int, const unsigned int);
+
+/* Large block stream header and block prefix handling
+ * lzjody_header_read() sets the context's block size from the header.
+ * lzjody_prefix_read() returns the compressed length from a block
+ * prefix and stores the block flags (O_NOCOMPRESS etc.) in *flags. */
+extern int lzjody_header_write(const struct lzjody_ctx * const,
+		unsigned char * const);
+extern int lzjody_header_read(struct lzjody_ctx * const,
+		const unsigned char * const);
+extern unsigned int lzjody_prefix_read(const struct lzjody_ctx * const,
+		const unsigned char * const, unsigned int * const);
+
+/* Block index for seekable streams (lzjody_ctx_set_seekable())
+ * The writer adds every block record and writes the index after the
+ * last block. A reader loads the footer and the index it points to,
+ * then lzjody_index_find() maps an uncompressed offset to the group of
+ * blocks to read and the block in it to decode. lzjody_index_check()
+ * checks the index and footer of a stream read from front to back. */
+struct lzjody_index;
+
+extern struct lzjody_index *lzjody_index_create(const struct lzjody_ctx * const,
+		const unsigned int, const uint64_t);
+extern void lzjody_index_free(struct lzjody_index * const);
+extern int lzjody_index_add(struct lzjody_index * const,
+		const unsigned char * const, const size_t, const uint64_t);
+extern size_t lzjody_index_size(const struct lzjody_index * const);
+extern size_t lzjody_index_write(const struct lzjody_index * const,
+		unsigned char * const);
+extern struct lzjody_index *lzjody_index_open(const struct lzjody_ctx * const,
+		const unsigned char * const, const uint64_t,
+		uint64_t * const, size_t * const);
+extern int lzjody_index_read(struct lzjody_index * const,
+		const unsigned char * const);
+extern int lzjody_index_find(const struct lzjody_index * const, const uint64_t,
+		uint64_t * const, size_t * const, uint64_t * const);
+extern unsigned int lzjody_index_group_blocks(const struct lzjody_index * const);
+extern unsigned int lzjody_index_default_bits(const struct lzjody_ctx * const);
+extern uint64_t lzjody_index_data_size(const struct lzjody_index * const);
+extern int lzjody_index_check(const struct lzjody_ctx * const,
+		const unsigned char * const, const uint64_t, const uint64_t);
+
+/* Random access reads from a seekable stream file
+ * lzjody_pread() works like pread() on the uncompressed data. Only the
+ * blocks a read covers are decoded, and decoded blocks are kept in an
+ * LRU cache of 'cache_size' bytes. One reader may be used by several
+ * threads at once, except in a library built without threads
+ * (NO_THREADS), which has no locking. */
+struct lzjody_reader;
+
+extern struct lzjody_reader *lzjody_reader_open(const int,
+		const unsigned char * const, const unsigned int, size_t);
+extern void lzjody_reader_close(struct lzjody_reader * const);
+extern uint64_t lzjody_reader_size(const struct lzjody_reader * const);
+extern ssize_t lzjody_pread(struct lzjody_reader * const, void * const,
+		size_t, const uint64_t);
+
+/* Streaming compression and decompression
+ * Streams take input in pieces of any size, split it into blocks and
+ * write the same format as the lzjody utility into the caller's output
+ * buffer as room allows. Each call advances *in_pos and *out_pos by
+ * what it used and returns 0 once all input is taken, 1 if the output
+ * filled up first (call again with more room) or -1 on error. After
+ * the last input, call lzjody_cstream_end() until it returns 0, or
+ * lzjody_dstream_end() to check that the stream was complete. A
+ * stream uses the context it is given until it is freed. */
+struct lzjody_cstream;
+struct lzjody_dstream;
+
+extern struct lzjody_cstream *lzjody_cstream_create(struct lzjody_ctx * const,
+		const unsigned int);
+extern void lzjody_cstream_free(struct lzjody_cstream * const);
+extern int lzjody_cstream_compress(struct lzjody_cstream * const,
+		const unsigned char * const, const size_t, size_t * const,
+		unsigned char * const, const size_t, size_t * const);
+extern int lzjody_cstream_end(struct lzjody_cstream * const,
+		unsigned char * const, const size_t, size_t * const);
+extern struct lzjody_dstream *lzjody_dstream_create(struct lzjody_ctx * const);
+extern void lzjody_dstream_free(struct lzjody_dstream * const);
+extern int lzjody_dstream_decompress(struct lzjody_dstream * const,
+		const unsigned char * const, const size_t, size_t * const,
+		unsigned char * const, const size_t, size_t * const);
+extern int lzjody_dstream_end(const struct lzjody_dstream * const);
+
+/* Original interface; lzjody_compress() uses shared internal state */
 extern int lzjody_compress(const unsigned char * const, unsigned char * const,
 		const unsigned int, const unsigned int);
 extern int lzjody_decompress(const unsigned char * const, unsigned char * const,
 		const unsigned int, const unsigned int);
 
+/* Name of the CPU kernel tier in use ("scalar", "sse2", "avx2", "avx512")
+ * The tier is picked at load time; set LZJODY_CPU to force a lower one. */
+extern const char *lzjody_cpu_tier(void);
+
 #ifdef __cplusplus
 }
 #endif
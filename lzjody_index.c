@@ -0,0 +1,305 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * Block index for seekable streams
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See lzjody.c for license information.
+ *
+ * A seekable stream ends with an end marker (a block prefix with a
+ * length of zero), the index and a footer. The index holds the stream
+ * offset of the first block of every group of 2^group_bits blocks as
+ * big-endian 64-bit values. The footer is the big-endian 64-bit offset
+ * of the index, the big-endian 64-bit uncompressed size, the group
+ * size as a base 2 logarithm, three zero bytes and "LZJI". A reader
+ * loads the footer and index once; after that, finding the block that
+ * holds any uncompressed offset is one array lookup.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lzjody.h"
+
+#define INDEX_MAX_GROUP_BITS 30
+
+struct lzjody_index {
+	uint64_t *entry;	/* Stream offset of the first block of each group */
+	uint64_t count;	/* Entries in use */
+	uint64_t cap;	/* Entries allocated */
+	uint64_t blocks;	/* Blocks added so far */
+	uint64_t pos;	/* Offset of the next block, or of the index once read */
+	uint64_t size;	/* Uncompressed stream size */
+	unsigned int bsize;	/* Block size */
+	unsigned int psize;	/* Block prefix size */
+	unsigned int group_bits;	/* log2 of the blocks per entry */
+	const struct lzjody_ctx *ctx;	/* For reading block prefixes */
+};
+
+static inline void put_be64(unsigned char * const p, const uint64_t v)
+{
+	for (int i = 0; i < 8; i++) *(p + i) = (unsigned char)(v >> (56 - (i * 8)));
+	return;
+}
+
+static inline uint64_t get_be64(const unsigned char * const p)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < 8; i++) v = (v << 8) | *(p + i);
+	return v;
+}
+
+/* Start an index for a stream compressed with ctx
+ * 'start' is the stream offset of the first block (the header size).
+ * Groups must begin at reset points when blocks depend on the window
+ * of earlier ones, so with a window a group is at least the reset
+ * interval. Dedup references are resolved one block at a time by the
+ * reader and need no such alignment. */
+extern struct lzjody_index *lzjody_index_create(const struct lzjody_ctx * const ctx,
+		const unsigned int group_bits, const uint64_t start)
+{
+	struct lzjody_index *idx;
+	const unsigned int reset = lzjody_ctx_window_size(ctx) ? lzjody_ctx_reset_interval(ctx) : 0;
+
+	if (group_bits > INDEX_MAX_GROUP_BITS) goto error_group;
+	if (reset && ((1U << group_bits) < reset)) goto error_group;
+	idx = (struct lzjody_index *)calloc(1, sizeof(struct lzjody_index));
+	if (!idx) goto error_oom;
+	idx->pos = start;
+	idx->bsize = lzjody_ctx_block_size(ctx);
+	idx->psize = lzjody_ctx_prefix_size(ctx);
+	idx->group_bits = group_bits;
+	idx->ctx = ctx;
+	return idx;
+
+error_group:
+	fprintf(stderr, "liblzjody: error: invalid index group of 2^%u blocks\n", group_bits);
+	return NULL;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for an index\n");
+	return NULL;
+}
+
+extern void lzjody_index_free(struct lzjody_index * const idx)
+{
+	if (idx) free(idx->entry);
+	free(idx);
+	return;
+}
+
+/* Add whole compressed block records (as written to the stream) that
+ * hold 'u_length' bytes of uncompressed data */
+extern int lzjody_index_add(struct lzjody_index * const idx,
+		const unsigned char * const blocks, const size_t length,
+		const uint64_t u_length)
+{
+	const uint64_t mask = (1ULL << idx->group_bits) - 1;
+	uint64_t *p;
+	unsigned int flags;
+	size_t rec;	/* Size of one block record */
+	size_t i = 0;
+
+	while (i < length) {
+		if ((i + idx->psize) > length) goto error_record;
+		if ((idx->blocks & mask) == 0) {
+			if (idx->count == idx->cap) {
+				idx->cap = idx->cap ? (idx->cap * 2) : 1024;
+				p = (uint64_t *)realloc(idx->entry, idx->cap * sizeof(uint64_t));
+				if (!p) goto error_oom;
+				idx->entry = p;
+			}
+			*(idx->entry + idx->count) = idx->pos;
+			idx->count++;
+		}
+		rec = idx->psize + lzjody_prefix_read(idx->ctx, blocks + i, &flags);
+		i += rec;
+		idx->pos += rec;
+		idx->blocks++;
+	}
+	if (i != length) goto error_record;
+	idx->size += u_length;
+	return 0;
+
+error_record:
+	fprintf(stderr, "liblzjody: error: partial block record added to the index\n");
+	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for an index\n");
+	return -1;
+}
+
+/* Bytes lzjody_index_write() writes: end marker, index and footer */
+extern size_t lzjody_index_size(const struct lzjody_index * const idx)
+{
+	return idx->psize + (size_t)(idx->count * 8) + LZJODY_FOOTER_SIZE;
+}
+
+/* Write the end marker, index and footer after the last block */
+extern size_t lzjody_index_write(const struct lzjody_index * const idx,
+		unsigned char * const out)
+{
+	unsigned char *p = out;
+
+	memset(p, 0, idx->psize);
+	p += idx->psize;
+	for (uint64_t i = 0; i < idx->count; i++, p += 8)
+		put_be64(p, *(idx->entry + i));
+	put_be64(p, idx->pos + idx->psize);
+	put_be64(p + 8, idx->size);
+	*(p + 16) = (unsigned char)idx->group_bits;
+	memset(p + 17, 0, 3);
+	memcpy(p + 20, "LZJI", 4);
+	p += LZJODY_FOOTER_SIZE;
+	return (size_t)(p - out);
+}
+
+/* Read the footer at the end of a seekable stream of 'file_size' bytes
+ * ctx must already be set up by lzjody_header_read(). Stores where the
+ * index is and how long it is; load it with lzjody_index_read(). */
+extern struct lzjody_index *lzjody_index_open(const struct lzjody_ctx * const ctx,
+		const unsigned char * const footer, const uint64_t file_size,
+		uint64_t * const pos, size_t * const length)
+{
+	struct lzjody_index *idx;
+	uint64_t blocks;
+	uint64_t count;
+	unsigned int group_bits;
+
+	if (!lzjody_ctx_seekable(ctx)) goto error_seekable;
+	if (memcmp(footer + 20, "LZJI", 4) != 0) goto error_footer;
+	group_bits = *(footer + 16);
+	if (group_bits > INDEX_MAX_GROUP_BITS) goto error_footer;
+	idx = lzjody_index_create(ctx, group_bits, 0);
+	if (!idx) return NULL;
+	idx->pos = get_be64(footer);
+	idx->size = get_be64(footer + 8);
+	blocks = (idx->size + idx->bsize - 1) / idx->bsize;
+	count = (blocks + (1ULL << group_bits) - 1) >> group_bits;
+	/* The index must fill the space between the blocks and the footer */
+	if ((file_size < LZJODY_FOOTER_SIZE) || (idx->pos > (file_size - LZJODY_FOOTER_SIZE))
+			|| (((file_size - LZJODY_FOOTER_SIZE - idx->pos) / 8) != count)
+			|| (((file_size - LZJODY_FOOTER_SIZE - idx->pos) % 8) != 0))
+		goto error_index;
+	idx->count = count;
+	idx->cap = count;
+	idx->blocks = blocks;
+	*pos = idx->pos;
+	*length = (size_t)(count * 8);
+	return idx;
+
+error_seekable:
+	fprintf(stderr, "liblzjody: error: stream has no index\n");
+	return NULL;
+error_footer:
+	fprintf(stderr, "liblzjody: data error: bad index footer\n");
+	return NULL;
+error_index:
+	fprintf(stderr, "liblzjody: data error: index does not match the stream\n");
+	lzjody_index_free(idx);
+	return NULL;
+}
+
+/* Load the index read from the position lzjody_index_open() gave */
+extern int lzjody_index_read(struct lzjody_index * const idx,
+		const unsigned char * const in)
+{
+	uint64_t prev = 0;
+	uint64_t v;
+
+	if (idx->count == 0) return 0;
+	idx->entry = (uint64_t *)malloc(idx->count * sizeof(uint64_t));
+	if (!idx->entry) goto error_oom;
+	/* Groups are in stream order and end before the end marker */
+	for (uint64_t i = 0; i < idx->count; i++) {
+		v = get_be64(in + (i * 8));
+		if ((v < prev) || ((v + idx->psize) >= idx->pos)) goto error_index;
+		*(idx->entry + i) = v;
+		prev = v + idx->psize;
+	}
+	return 0;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for an index\n");
+	return -1;
+error_index:
+	fprintf(stderr, "liblzjody: data error: bad index entry\n");
+	return -1;
+}
+
+/* Find the block that holds uncompressed 'offset'
+ * Stores the stream offset and length of its group of blocks and the
+ * uncompressed offset where the group starts. Returns the number of
+ * the block within the group, or -1 if offset is past the end. Only
+ * that block (and the blocks its dedup references point to) needs
+ * decoding unless the stream has a window, in which case the group is
+ * decoded from its start. */
+extern int lzjody_index_find(const struct lzjody_index * const idx,
+		const uint64_t offset, uint64_t * const pos, size_t * const length,
+		uint64_t * const start)
+{
+	const uint64_t block = offset / idx->bsize;
+	const uint64_t group = block >> idx->group_bits;
+
+	if (offset >= idx->size) return -1;
+	*pos = *(idx->entry + group);
+	if ((group + 1) < idx->count) *length = (size_t)(*(idx->entry + group + 1) - *pos);
+	else *length = (size_t)(idx->pos - idx->psize - *pos);
+	*start = (group << idx->group_bits) * idx->bsize;
+	return (int)(block & ((1ULL << idx->group_bits) - 1));
+}
+
+/* Blocks in each group (the last one may be shorter) */
+extern unsigned int lzjody_index_group_blocks(const struct lzjody_index * const idx)
+{
+	return 1U << idx->group_bits;
+}
+
+/* Group size for an index of a stream compressed with ctx: about
+ * LZJODY_INDEX_BYTES of input per entry, but with a window never less
+ * than the reset interval because blocks that use the window can only
+ * be decoded from a reset point. Dedup alone keeps the small groups. */
+extern unsigned int lzjody_index_default_bits(const struct lzjody_ctx * const ctx)
+{
+	unsigned int blocks = LZJODY_INDEX_BYTES / lzjody_ctx_block_size(ctx);
+	unsigned int bits = 0;
+
+	if (lzjody_ctx_window_size(ctx) && (blocks < lzjody_ctx_reset_interval(ctx)))
+		blocks = lzjody_ctx_reset_interval(ctx);
+	while ((1U << bits) < blocks) bits++;
+	return bits;
+}
+
+/* Check what follows the end marker of a seekable stream read from
+ * front to back: 'start' is the stream offset just after the end
+ * marker, 'length' the bytes after it and 'footer' the last
+ * LZJODY_FOOTER_SIZE of them. Returns 0 if they are a whole index and
+ * footer that point back to 'start', otherwise -1. */
+extern int lzjody_index_check(const struct lzjody_ctx * const ctx,
+		const unsigned char * const footer, const uint64_t start,
+		const uint64_t length)
+{
+	struct lzjody_index *idx;
+	uint64_t pos;
+	size_t i_length;
+
+	if (length < LZJODY_FOOTER_SIZE) goto error_short;
+	idx = lzjody_index_open(ctx, footer, start + length, &pos, &i_length);
+	if (!idx) return -1;
+	lzjody_index_free(idx);
+	if (pos != start) goto error_index;
+	return 0;
+
+error_short:
+	fprintf(stderr, "liblzjody: data error: seekable stream ends inside its index\n");
+	return -1;
+error_index:
+	fprintf(stderr, "liblzjody: data error: index does not match the stream\n");
+	return -1;
+}
+
+/* Uncompressed size of an indexed stream */
+extern uint64_t lzjody_index_data_size(const struct lzjody_index * const idx)
+{
+	return idx->size;
+}
@@ -0,0 +1,443 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * Asynchronous file I/O for the lzjody utility
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * An engine keeps several positional reads and writes in flight so the
+ * disk stays busy while blocks are compressed. Requests complete in any
+ * order; io_wait() returns the caller's tag of each one. Short transfers
+ * are continued inside the engine, so a request only completes once
+ * all of it is done, it hits end of file or it fails.
+ *
+ * io_uring is used through raw system calls so no extra library is
+ * needed. Where it is missing or disabled, a few helper threads doing
+ * blocking pread()/pwrite() take its place.
+ */
+
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "lzjody_io.h"
+
+#if defined __linux__ && defined __has_include
+ #if __has_include(<linux/io_uring.h>)
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+  #include <linux/io_uring.h>
+  #if defined __NR_io_uring_setup && defined __NR_io_uring_enter
+   #define HAVE_URING 1
+  #endif
+ #endif
+#endif
+
+/* Helper threads for IO_THREADS */
+#define IO_THREADS_MAX 4
+
+/* Request states */
+#define REQ_FREE 0
+#define REQ_QUEUED 1	/* Waiting for a helper thread */
+#define REQ_BUSY 2	/* Being transferred */
+#define REQ_DONE 3	/* Waiting for io_wait() */
+
+struct io_req {
+	void *tag;	/* Caller's handle */
+	unsigned char *buf;
+	size_t len;	/* Bytes to transfer */
+	size_t want;	/* Bytes needed for the request to succeed */
+	size_t done;	/* Bytes transferred so far */
+	uint64_t off;	/* File offset of buf */
+	int fd;
+	int write;
+	int state;
+	int used;	/* Handed out by io_submit(); only the caller touches it */
+	ssize_t res;	/* Result for io_wait() */
+	struct iovec iov;
+};
+
+#ifdef HAVE_URING
+struct uring {
+	int fd;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+};
+#endif
+
+struct io_engine {
+	int kind;
+	unsigned int depth;	/* Most requests in flight */
+	unsigned int inflight;	/* Requests not yet returned by io_wait() */
+	struct io_req *req;
+#ifdef HAVE_URING
+	struct uring ring;
+#endif
+	/* IO_THREADS */
+	pthread_t thread[IO_THREADS_MAX];
+	unsigned int nthreads;
+	int stop;
+	unsigned int *queue;	/* Requests for the helper threads, in order */
+	unsigned int q_head;
+	unsigned int q_tail;
+	unsigned int *cq;	/* Finished requests, in order */
+	unsigned int cq_head;
+	unsigned int cq_tail;
+	pthread_mutex_t mtx;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+};
+
+
+#ifdef HAVE_URING
+static int uring_init(struct uring * const r, const unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned char *sq;
+	unsigned char *cq;
+
+	memset(&p, 0, sizeof(p));
+	memset(r, 0, sizeof(struct uring));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0) return -1;
+	r->sq_map_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+	r->cq_map_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && (r->cq_map_size > r->sq_map_size))
+		r->sq_map_size = r->cq_map_size;
+	r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED) goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_map = r->sq_map;
+	} else {
+		r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED) goto error_sq;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto error_cq;
+
+	sq = (unsigned char *)r->sq_map;
+	cq = (unsigned char *)r->cq_map;
+	r->sq_head = (unsigned int *)(void *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(void *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)(void *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)(void *)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int *)(void *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(void *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)(void *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(void *)(cq + p.cq_off.cqes);
+	return 0;
+
+error_cq:
+	if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+error_sq:
+	munmap(r->sq_map, r->sq_map_size);
+error:
+	close(r->fd);
+	return -1;
+}
+
+static void uring_free(struct uring * const r)
+{
+	munmap(r->sqes, r->sqes_size);
+	if (r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+	munmap(r->sq_map, r->sq_map_size);
+	close(r->fd);
+	return;
+}
+
+/* Queue the rest of a request and tell the kernel about it
+ * Returns 0 once the kernel has taken the request. Without SQPOLL the
+ * kernel only takes entries in io_uring_enter(), so if that fails the
+ * entry is withdrawn and the request may be freed. */
+static int uring_submit(struct uring * const r, struct io_req * const q,
+		const unsigned int id)
+{
+	const unsigned int tail = *(r->sq_tail);
+	const unsigned int i = tail & *(r->sq_mask);
+	struct io_uring_sqe * const sqe = r->sqes + i;
+	int ret;
+
+	q->iov.iov_base = q->buf + q->done;
+	q->iov.iov_len = q->len - q->done;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = q->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = q->fd;
+	sqe->off = q->off + q->done;
+	sqe->addr = (uint64_t)(uintptr_t)&(q->iov);
+	sqe->len = 1;
+	sqe->user_data = id;
+	*(r->sq_array + i) = i;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	do ret = (int)syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0);
+	while (ret < 0 && errno == EINTR);
+	if (ret == 1) return 0;
+	/* An interrupted call may still have taken it */
+	if (__atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) == (tail + 1)) return 0;
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+	return -1;
+}
+
+/* Take the next completion, waiting for one if needed */
+static void uring_reap(struct uring * const r, unsigned int * const id,
+		ssize_t * const res)
+{
+	unsigned int head = *(r->cq_head);
+	struct io_uring_cqe *cqe;
+
+	while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+	cqe = r->cqes + (head & *(r->cq_mask));
+	*id = (unsigned int)cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+	return;
+}
+#endif /* HAVE_URING */
+
+
+/* Helper thread for IO_THREADS: run queued requests to completion */
+static void *io_thread(void *arg)
+{
+	struct io_engine * const e = arg;
+	struct io_req *q;
+	unsigned int id;
+	ssize_t i;
+
+	pthread_mutex_lock(&e->mtx);
+	while (1) {
+		while (!e->stop && e->q_head == e->q_tail)
+			pthread_cond_wait(&e->work_cond, &e->mtx);
+		if (e->q_head == e->q_tail) break;
+		id = *(e->queue + (e->q_head % e->depth));
+		e->q_head++;
+		q = e->req + id;
+		q->state = REQ_BUSY;
+		pthread_mutex_unlock(&e->mtx);
+
+		q->res = 0;
+		while (q->done < q->want) {
+			if (q->write) i = pwrite(q->fd, q->buf + q->done, q->len - q->done,
+					(off_t)(q->off + q->done));
+			else i = pread(q->fd, q->buf + q->done, q->len - q->done,
+					(off_t)(q->off + q->done));
+			if (i < 0 && errno == EINTR) continue;
+			if (i < 0) q->res = -errno;
+			if (i <= 0) break;
+			q->done += (size_t)i;
+		}
+
+		pthread_mutex_lock(&e->mtx);
+		q->state = REQ_DONE;
+		*(e->cq + (e->cq_tail % e->depth)) = id;
+		e->cq_tail++;
+		pthread_cond_signal(&e->done_cond);
+	}
+	pthread_mutex_unlock(&e->mtx);
+	return NULL;
+}
+
+/* Start an engine of the given kind; io_uring falls back to threads
+ * when the kernel does not allow it */
+extern struct io_engine *io_create(const int kind, const unsigned int depth)
+{
+	struct io_engine *e;
+	unsigned int i;
+
+	e = (struct io_engine *)calloc(1, sizeof(struct io_engine));
+	if (!e) return NULL;
+	e->depth = depth ? depth : IO_DEPTH;
+	e->req = (struct io_req *)calloc(e->depth, sizeof(struct io_req));
+	if (!e->req) goto error;
+#ifdef HAVE_URING
+	if ((kind == IO_URING) && (uring_init(&e->ring, e->depth) == 0)) {
+		e->kind = IO_URING;
+		return e;
+	}
+#else
+	(void)kind;
+#endif
+
+	e->kind = IO_THREADS;
+	e->queue = (unsigned int *)malloc(e->depth * sizeof(unsigned int));
+	e->cq = (unsigned int *)malloc(e->depth * sizeof(unsigned int));
+	if (!e->queue || !e->cq) goto error;
+	pthread_mutex_init(&e->mtx, NULL);
+	pthread_cond_init(&e->work_cond, NULL);
+	pthread_cond_init(&e->done_cond, NULL);
+	for (i = 0; (i < e->depth) && (i < IO_THREADS_MAX); i++) {
+		if (pthread_create(e->thread + i, NULL, io_thread, e) != 0) break;
+		e->nthreads++;
+	}
+	if (e->nthreads == 0) {
+		io_destroy(e);
+		return NULL;
+	}
+	return e;
+
+error:
+	free(e->queue);
+	free(e->cq);
+	free(e->req);
+	free(e);
+	return NULL;
+}
+
+/* Stop an engine; every request must have been waited for */
+extern void io_destroy(struct io_engine * const e)
+{
+	if (!e) return;
+#ifdef HAVE_URING
+	if (e->kind == IO_URING) uring_free(&e->ring);
+#endif
+	if (e->kind == IO_THREADS) {
+		pthread_mutex_lock(&e->mtx);
+		e->stop = 1;
+		pthread_cond_broadcast(&e->work_cond);
+		pthread_mutex_unlock(&e->mtx);
+		for (unsigned int i = 0; i < e->nthreads; i++) pthread_join(e->thread[i], NULL);
+		pthread_mutex_destroy(&e->mtx);
+		pthread_cond_destroy(&e->work_cond);
+		pthread_cond_destroy(&e->done_cond);
+	}
+	free(e->queue);
+	free(e->cq);
+	free(e->req);
+	free(e);
+	return;
+}
+
+extern int io_kind(const struct io_engine * const e)
+{
+	return e->kind;
+}
+
+extern unsigned int io_inflight(const struct io_engine * const e)
+{
+	return e->inflight;
+}
+
+static int io_submit(struct io_engine * const e, const int fd,
+		unsigned char * const buf, const size_t len, const size_t want,
+		const uint64_t off, const int write, void * const tag)
+{
+	struct io_req *q = NULL;
+	unsigned int id;
+
+	if (e->inflight == e->depth) return -1;
+	for (id = 0; id < e->depth; id++) {
+		q = e->req + id;
+		if (!q->used) break;
+	}
+	q->tag = tag;
+	q->buf = buf;
+	q->len = len;
+	q->want = want;
+	q->done = 0;
+	q->off = off;
+	q->fd = fd;
+	q->write = write;
+	q->res = 0;
+	q->used = 1;
+	e->inflight++;
+#ifdef HAVE_URING
+	if (e->kind == IO_URING) {
+		q->state = REQ_BUSY;
+		if (uring_submit(&e->ring, q, id) == 0) return 0;
+		q->state = REQ_FREE;
+		q->used = 0;
+		e->inflight--;
+		return -1;
+	}
+#endif
+	pthread_mutex_lock(&e->mtx);
+	q->state = REQ_QUEUED;
+	*(e->queue + (e->q_tail % e->depth)) = id;
+	e->q_tail++;
+	pthread_cond_signal(&e->work_cond);
+	pthread_mutex_unlock(&e->mtx);
+	return 0;
+}
+
+/* Start reading 'len' bytes at 'off' into 'buf'; the read succeeds if
+ * at least 'want' bytes arrive. For O_DIRECT, 'len' is rounded up to
+ * IO_ALIGN while 'want' is what is left of the file. */
+extern int io_read(struct io_engine * const e, const int fd, void * const buf,
+		const size_t len, const size_t want, const uint64_t off, void * const tag)
+{
+	return io_submit(e, fd, (unsigned char *)buf, len, want, off, 0, tag);
+}
+
+/* Start writing 'len' bytes from 'buf' at 'off' */
+extern int io_write(struct io_engine * const e, const int fd, const void * const buf,
+		const size_t len, const uint64_t off, void * const tag)
+{
+	/* The buffer is only read from */
+	return io_submit(e, fd, (unsigned char *)(uintptr_t)buf, len, len, off, 1, tag);
+}
+
+/* Wait for any request to finish. Stores its tag and the bytes moved,
+ * or a negative errno. Returns -1 if nothing is in flight. */
+extern int io_wait(struct io_engine * const e, void ** const tag, ssize_t * const res)
+{
+	struct io_req *q;
+	unsigned int id;
+	ssize_t i;
+
+	if (e->inflight == 0) return -1;
+#ifdef HAVE_URING
+	if (e->kind == IO_URING) {
+		while (1) {
+			uring_reap(&e->ring, &id, &i);
+			q = e->req + id;
+			if (i > 0) q->done += (size_t)i;
+			if (i < 0) q->res = i;
+			/* Continue short transfers that are not at end of file */
+			if ((i > 0) && (q->done < q->want)) {
+				if (uring_submit(&e->ring, q, id) == 0) continue;
+				q->res = -EIO;
+			}
+			break;
+		}
+		q->state = REQ_DONE;
+	} else
+#endif
+	{
+		pthread_mutex_lock(&e->mtx);
+		while (e->cq_head == e->cq_tail) pthread_cond_wait(&e->done_cond, &e->mtx);
+		id = *(e->cq + (e->cq_head % e->depth));
+		e->cq_head++;
+		pthread_mutex_unlock(&e->mtx);
+		q = e->req + id;
+	}
+	*tag = q->tag;
+	*res = q->res ? q->res : (ssize_t)q->done;
+	if ((q->res == 0) && (q->done < q->want) && q->write) *res = -EIO;
+	q->state = REQ_FREE;
+	q->used = 0;
+	e->inflight--;
+	return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * Asynchronous file I/O for the lzjody utility
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ */
+
+#ifndef LZJODY_IO_H
+#define LZJODY_IO_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* I/O engines */
+#define IO_NONE 0	/* Plain stdio in the reader and writer threads */
+#define IO_URING 1	/* Linux io_uring */
+#define IO_THREADS 2	/* Blocking pread()/pwrite() in helper threads */
+
+/* Alignment of O_DIRECT buffers, offsets and lengths */
+#define IO_ALIGN 4096
+
+/* Default number of requests an engine keeps in flight */
+#define IO_DEPTH 8
+
+struct io_engine;
+
+extern struct io_engine *io_create(const int kind, const unsigned int depth);
+extern void io_destroy(struct io_engine * const);
+extern int io_kind(const struct io_engine * const);
+extern unsigned int io_inflight(const struct io_engine * const);
+extern int io_read(struct io_engine * const, const int, void * const,
+		const size_t, const size_t, const uint64_t, void * const);
+extern int io_write(struct io_engine * const, const int, const void * const,
+		const size_t, const uint64_t, void * const);
+extern int io_wait(struct io_engine * const, void ** const, ssize_t * const);
+
+#endif	/* LZJODY_IO_H */
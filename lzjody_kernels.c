@@ -0,0 +1,950 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * CPU-specific hot loop kernels
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * Released under The MIT License
+ *
+ * Every kernel has a portable scalar version. On x86 there are also
+ * SSE2, AVX2 and AVX-512 versions which are built with per-function
+ * target attributes, so one binary carries all of them; the best one
+ * the CPU supports is picked once at load time. Set LZJODY_CPU to
+ * "scalar", "sse2", "avx2" or "avx512" to force a lower tier.
+ *
+ * All tiers produce identical results. Wider versions hand their tails
+ * to the next narrower version, down to a bytewise loop.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lzjody.h"
+#include "lzjody_kernels.h"
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+ #define KERNELS_X86 1
+ #include <immintrin.h>
+ #define TARGET(x) __attribute__((target(x)))
+ #define AVX512 "avx512f,avx512bw"
+ /* Narrower tiers are inlined into the wider ones that finish their
+  * tails so the whole kernel uses one (VEX or legacy SSE) encoding;
+  * calling legacy SSE code with dirty AVX state stalls the CPU */
+ #define TAIL_INLINE inline __attribute__((always_inline))
+#endif
+
+/* Debugging stuff */
+#ifndef DLOG
+ #ifdef DEBUG
+  #define DLOG(...) fprintf(stderr, __VA_ARGS__)
+ #else
+  #define DLOG(...)
+ #endif
+#endif
+
+/* Ascending lane values for building sequence vectors */
+static const uint8_t ramp8[64] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+	32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
+	48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63
+};
+static const uint16_t ramp16[32] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+	16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31
+};
+static const uint32_t ramp32[16] = {
+	 0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+
+/*** Scalar kernels ***/
+
+#if defined __GNUC__ && defined __BYTE_ORDER__
+/* Index of the first nonzero byte in memory order of a 64-bit word */
+static inline unsigned int first_byte_set(const uint64_t w)
+{
+ #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return (unsigned int)__builtin_ctzll(w) >> 3;
+ #else
+	return (unsigned int)__builtin_clzll(w) >> 3;
+ #endif
+}
+ #define WORD_SCAN 1
+#endif
+
+static unsigned int match_length_scalar(const unsigned char * const restrict a,
+		const unsigned char * const restrict b, const unsigned int max)
+{
+	unsigned int len = 0;
+
+#ifdef WORD_SCAN
+	while ((len + 8) <= max) {
+		uint64_t wa, wb;
+
+		memcpy(&wa, a + len, sizeof(uint64_t));
+		memcpy(&wb, b + len, sizeof(uint64_t));
+		wa ^= wb;
+		if (wa) return len + first_byte_set(wa);
+		len += 8;
+	}
+#endif
+	while ((len < max) && (*(a + len) == *(b + len))) len++;
+	return len;
+}
+
+static unsigned int rle_length_scalar(const unsigned char * const restrict p,
+		const unsigned char c, const unsigned int max)
+{
+	unsigned int len = 0;
+
+#ifdef WORD_SCAN
+	const uint64_t pattern = 0x0101010101010101ULL * c;
+
+	while ((len + 8) <= max) {
+		uint64_t w;
+
+		memcpy(&w, p + len, sizeof(uint64_t));
+		w ^= pattern;
+		if (w) return len + first_byte_set(w);
+		len += 8;
+	}
+#endif
+	while ((len < max) && (*(p + len) == c)) len++;
+	return len;
+}
+
+static unsigned int seq8_length_scalar(const unsigned char * const restrict p,
+		uint8_t num, const unsigned int max)
+{
+	unsigned int len = 0;
+
+	while ((len < max) && (*(p + len) == num)) {
+		len++;
+		num++;
+	}
+	return len;
+}
+
+static unsigned int seq16_length_scalar(const unsigned char * const restrict p,
+		uint16_t num, const unsigned int max)
+{
+	uint16_t v16;
+	unsigned int cnt = 0;
+
+	while (cnt < max) {
+		memcpy(&v16, p + (cnt << 1), sizeof(uint16_t));
+		if (v16 != num) break;
+		cnt++;
+		num++;
+	}
+	return cnt;
+}
+
+static unsigned int seq32_length_scalar(const unsigned char * const restrict p,
+		uint32_t num, const unsigned int max)
+{
+	uint32_t v32;
+	unsigned int cnt = 0;
+
+	while (cnt < max) {
+		memcpy(&v32, p + (cnt << 2), sizeof(uint32_t));
+		if (v32 != num) break;
+		cnt++;
+		num++;
+	}
+	return cnt;
+}
+
+static void seq8_fill_scalar(unsigned char * const restrict p,
+		uint8_t num, const unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		*(p + i) = num;
+		num++;
+	}
+	return;
+}
+
+static void seq16_fill_scalar(unsigned char * const restrict p,
+		uint16_t num, const unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(p + (i << 1), &num, sizeof(uint16_t));
+		num++;
+	}
+	return;
+}
+
+static void seq32_fill_scalar(unsigned char * const restrict p,
+		uint32_t num, const unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(p + (i << 2), &num, sizeof(uint32_t));
+		num++;
+	}
+	return;
+}
+
+/* 4-plane split: plane k holds every fourth byte starting at byte k,
+ * and planes 0 to (length % 4 - 1) are one byte longer than the rest.
+ * BP4_PLANES declares the plane 1-3 offsets within the planar data. */
+#define BP4_PLANES \
+	const unsigned int quads = length >> 2; \
+	const unsigned int rem = length & 3; \
+	const unsigned int p1 = quads + (rem > 0); \
+	const unsigned int p2 = p1 + quads + (rem > 1); \
+	const unsigned int p3 = p2 + quads + (rem > 2)
+
+/* Split quads i and up plus the remainder bytes */
+static inline void bp4_split_tail(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length,
+		unsigned int i)
+{
+	BP4_PLANES;
+
+	for (; i < quads; i++) {
+		*(out + i) = *(in + (i << 2));
+		*(out + p1 + i) = *(in + (i << 2) + 1);
+		*(out + p2 + i) = *(in + (i << 2) + 2);
+		*(out + p3 + i) = *(in + (i << 2) + 3);
+	}
+	if (rem > 0) *(out + quads) = *(in + (quads << 2));
+	if (rem > 1) *(out + p1 + quads) = *(in + (quads << 2) + 1);
+	if (rem > 2) *(out + p2 + quads) = *(in + (quads << 2) + 2);
+	return;
+}
+
+/* Merge quads i and up plus the remainder bytes */
+static inline void bp4_merge_tail(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length,
+		unsigned int i)
+{
+	BP4_PLANES;
+
+	for (; i < quads; i++) {
+		*(out + (i << 2)) = *(in + i);
+		*(out + (i << 2) + 1) = *(in + p1 + i);
+		*(out + (i << 2) + 2) = *(in + p2 + i);
+		*(out + (i << 2) + 3) = *(in + p3 + i);
+	}
+	if (rem > 0) *(out + (quads << 2)) = *(in + quads);
+	if (rem > 1) *(out + (quads << 2) + 1) = *(in + p1 + quads);
+	if (rem > 2) *(out + (quads << 2) + 2) = *(in + p2 + quads);
+	return;
+}
+
+static void bp4_split_scalar(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length)
+{
+	bp4_split_tail(in, out, length, 0);
+	return;
+}
+
+static void bp4_merge_scalar(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length)
+{
+	bp4_merge_tail(in, out, length, 0);
+	return;
+}
+
+
+#ifdef KERNELS_X86
+/*** SSE2 kernels: 16 bytes per step ***/
+
+TARGET("sse2")
+static TAIL_INLINE unsigned int match_length_sse2(const unsigned char * const restrict a,
+		const unsigned char * const restrict b, const unsigned int max)
+{
+	unsigned int len = 0;
+
+	while ((len + 16) <= max) {
+		const __m128i va = _mm_loadu_si128((const __m128i *)(const void *)(a + len));
+		const __m128i vb = _mm_loadu_si128((const __m128i *)(const void *)(b + len));
+		const unsigned int diff = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffffU;
+
+		if (diff) return len + (unsigned int)__builtin_ctz(diff);
+		len += 16;
+	}
+	return len + match_length_scalar(a + len, b + len, max - len);
+}
+
+TARGET("sse2")
+static TAIL_INLINE unsigned int rle_length_sse2(const unsigned char * const restrict p,
+		const unsigned char c, const unsigned int max)
+{
+	const __m128i vc = _mm_set1_epi8((char)c);
+	unsigned int len = 0;
+
+	while ((len + 16) <= max) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + len));
+		const unsigned int diff = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) ^ 0xffffU;
+
+		if (diff) return len + (unsigned int)__builtin_ctz(diff);
+		len += 16;
+	}
+	return len + rle_length_scalar(p + len, c, max - len);
+}
+
+TARGET("sse2")
+static TAIL_INLINE unsigned int seq8_length_sse2(const unsigned char * const restrict p,
+		const uint8_t num, const unsigned int max)
+{
+	__m128i ramp = _mm_add_epi8(_mm_set1_epi8((char)num),
+			_mm_loadu_si128((const __m128i *)(const void *)ramp8));
+	const __m128i step = _mm_set1_epi8(16);
+	unsigned int len = 0;
+
+	while ((len + 16) <= max) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + len));
+		const unsigned int diff = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ramp)) ^ 0xffffU;
+
+		if (diff) return len + (unsigned int)__builtin_ctz(diff);
+		ramp = _mm_add_epi8(ramp, step);
+		len += 16;
+	}
+	return len + seq8_length_scalar(p + len, (uint8_t)(num + len), max - len);
+}
+
+TARGET("sse2")
+static TAIL_INLINE unsigned int seq16_length_sse2(const unsigned char * const restrict p,
+		const uint16_t num, const unsigned int max)
+{
+	__m128i ramp = _mm_add_epi16(_mm_set1_epi16((short)num),
+			_mm_loadu_si128((const __m128i *)(const void *)ramp16));
+	const __m128i step = _mm_set1_epi16(8);
+	unsigned int cnt = 0;
+
+	while ((cnt + 8) <= max) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + (cnt << 1)));
+		const unsigned int diff = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi16(v, ramp)) ^ 0xffffU;
+
+		if (diff) return cnt + ((unsigned int)__builtin_ctz(diff) >> 1);
+		ramp = _mm_add_epi16(ramp, step);
+		cnt += 8;
+	}
+	return cnt + seq16_length_scalar(p + (cnt << 1), (uint16_t)(num + cnt), max - cnt);
+}
+
+TARGET("sse2")
+static TAIL_INLINE unsigned int seq32_length_sse2(const unsigned char * const restrict p,
+		const uint32_t num, const unsigned int max)
+{
+	__m128i ramp = _mm_add_epi32(_mm_set1_epi32((int)num),
+			_mm_loadu_si128((const __m128i *)(const void *)ramp32));
+	const __m128i step = _mm_set1_epi32(4);
+	unsigned int cnt = 0;
+
+	while ((cnt + 4) <= max) {
+		const __m128i v = _mm_loadu_si128((const __m128i *)(const void *)(p + (cnt << 2)));
+		const unsigned int diff = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi32(v, ramp)) ^ 0xffffU;
+
+		if (diff) return cnt + ((unsigned int)__builtin_ctz(diff) >> 2);
+		ramp = _mm_add_epi32(ramp, step);
+		cnt += 4;
+	}
+	return cnt + seq32_length_scalar(p + (cnt << 2), num + cnt, max - cnt);
+}
+
+TARGET("sse2")
+static TAIL_INLINE void seq8_fill_sse2(unsigned char * const restrict p,
+		const uint8_t num, const unsigned int count)
+{
+	__m128i ramp = _mm_add_epi8(_mm_set1_epi8((char)num),
+			_mm_loadu_si128((const __m128i *)(const void *)ramp8));
+	const __m128i step = _mm_set1_epi8(16);
+	unsigned int i;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		_mm_storeu_si128((__m128i *)(void *)(p + i), ramp);
+		ramp = _mm_add_epi8(ramp, step);
+	}
+	seq8_fill_scalar(p + i, (uint8_t)(num + i), count - i);
+	return;
+}
+
+TARGET("sse2")
+static TAIL_INLINE void seq16_fill_sse2(unsigned char * const restrict p,
+		const uint16_t num, const unsigned int count)
+{
+	__m128i ramp = _mm_add_epi16(_mm_set1_epi16((short)num),
+			_mm_loadu_si128((const __m128i *)(const void *)ramp16));
+	const __m128i step = _mm_set1_epi16(8);
+	unsigned int i;
+
+	for (i = 0; (i + 8) <= count; i += 8) {
+		_mm_storeu_si128((__m128i *)(void *)(p + (i << 1)), ramp);
+		ramp = _mm_add_epi16(ramp, step);
+	}
+	seq16_fill_scalar(p + (i << 1), (uint16_t)(num + i), count - i);
+	return;
+}
+
+TARGET("sse2")
+static TAIL_INLINE void seq32_fill_sse2(unsigned char * const restrict p,
+		const uint32_t num, const unsigned int count)
+{
+	__m128i ramp = _mm_add_epi32(_mm_set1_epi32((int)num),
+			_mm_loadu_si128((const __m128i *)(const void *)ramp32));
+	const __m128i step = _mm_set1_epi32(4);
+	unsigned int i;
+
+	for (i = 0; (i + 4) <= count; i += 4) {
+		_mm_storeu_si128((__m128i *)(void *)(p + (i << 2)), ramp);
+		ramp = _mm_add_epi32(ramp, step);
+	}
+	seq32_fill_scalar(p + (i << 2), num + i, count - i);
+	return;
+}
+
+/* 4-plane split of 16 quads at a time: two rounds of separating
+ * even and odd bytes by masking/shifting 16-bit lanes and packing */
+TARGET("sse2")
+static void bp4_split_sse2(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length)
+{
+	BP4_PLANES;
+	const __m128i lo = _mm_set1_epi16(0x00ff);
+	unsigned int i;
+
+	for (i = 0; (i + 16) <= quads; i += 16) {
+		const __m128i *src = (const __m128i *)(const void *)(in + (i << 2));
+		const __m128i v0 = _mm_loadu_si128(src);
+		const __m128i v1 = _mm_loadu_si128(src + 1);
+		const __m128i v2 = _mm_loadu_si128(src + 2);
+		const __m128i v3 = _mm_loadu_si128(src + 3);
+		/* Planes 0/2 and planes 1/3 interleaved */
+		const __m128i e01 = _mm_packus_epi16(_mm_and_si128(v0, lo), _mm_and_si128(v1, lo));
+		const __m128i e23 = _mm_packus_epi16(_mm_and_si128(v2, lo), _mm_and_si128(v3, lo));
+		const __m128i o01 = _mm_packus_epi16(_mm_srli_epi16(v0, 8), _mm_srli_epi16(v1, 8));
+		const __m128i o23 = _mm_packus_epi16(_mm_srli_epi16(v2, 8), _mm_srli_epi16(v3, 8));
+
+		_mm_storeu_si128((__m128i *)(void *)(out + i),
+				_mm_packus_epi16(_mm_and_si128(e01, lo), _mm_and_si128(e23, lo)));
+		_mm_storeu_si128((__m128i *)(void *)(out + p1 + i),
+				_mm_packus_epi16(_mm_and_si128(o01, lo), _mm_and_si128(o23, lo)));
+		_mm_storeu_si128((__m128i *)(void *)(out + p2 + i),
+				_mm_packus_epi16(_mm_srli_epi16(e01, 8), _mm_srli_epi16(e23, 8)));
+		_mm_storeu_si128((__m128i *)(void *)(out + p3 + i),
+				_mm_packus_epi16(_mm_srli_epi16(o01, 8), _mm_srli_epi16(o23, 8)));
+	}
+	bp4_split_tail(in, out, length, i);
+	return;
+}
+
+/* 4-plane merge of 16 quads at a time: a 4x16 byte transpose done with
+ * 8-bit then 16-bit unpacks */
+TARGET("sse2")
+static void bp4_merge_sse2(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length)
+{
+	BP4_PLANES;
+	unsigned int i;
+
+	for (i = 0; (i + 16) <= quads; i += 16) {
+		const __m128i v0 = _mm_loadu_si128((const __m128i *)(const void *)(in + i));
+		const __m128i v1 = _mm_loadu_si128((const __m128i *)(const void *)(in + p1 + i));
+		const __m128i v2 = _mm_loadu_si128((const __m128i *)(const void *)(in + p2 + i));
+		const __m128i v3 = _mm_loadu_si128((const __m128i *)(const void *)(in + p3 + i));
+		const __m128i t01l = _mm_unpacklo_epi8(v0, v1);
+		const __m128i t01h = _mm_unpackhi_epi8(v0, v1);
+		const __m128i t23l = _mm_unpacklo_epi8(v2, v3);
+		const __m128i t23h = _mm_unpackhi_epi8(v2, v3);
+		__m128i *dst = (__m128i *)(void *)(out + (i << 2));
+
+		_mm_storeu_si128(dst, _mm_unpacklo_epi16(t01l, t23l));
+		_mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(t01l, t23l));
+		_mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(t01h, t23h));
+		_mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(t01h, t23h));
+	}
+	bp4_merge_tail(in, out, length, i);
+	return;
+}
+
+
+/*** AVX2 kernels: 32 bytes per step ***/
+
+TARGET("avx2")
+static TAIL_INLINE unsigned int match_length_avx2(const unsigned char * const restrict a,
+		const unsigned char * const restrict b, const unsigned int max)
+{
+	unsigned int len = 0;
+
+	while ((len + 32) <= max) {
+		const __m256i va = _mm256_loadu_si256((const __m256i *)(const void *)(a + len));
+		const __m256i vb = _mm256_loadu_si256((const __m256i *)(const void *)(b + len));
+		const uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+		if (diff) return len + (unsigned int)__builtin_ctz(diff);
+		len += 32;
+	}
+	return len + match_length_sse2(a + len, b + len, max - len);
+}
+
+TARGET("avx2")
+static TAIL_INLINE unsigned int rle_length_avx2(const unsigned char * const restrict p,
+		const unsigned char c, const unsigned int max)
+{
+	const __m256i vc = _mm256_set1_epi8((char)c);
+	unsigned int len = 0;
+
+	while ((len + 32) <= max) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(p + len));
+		const uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, vc));
+
+		if (diff) return len + (unsigned int)__builtin_ctz(diff);
+		len += 32;
+	}
+	return len + rle_length_sse2(p + len, c, max - len);
+}
+
+TARGET("avx2")
+static TAIL_INLINE unsigned int seq8_length_avx2(const unsigned char * const restrict p,
+		const uint8_t num, const unsigned int max)
+{
+	__m256i ramp = _mm256_add_epi8(_mm256_set1_epi8((char)num),
+			_mm256_loadu_si256((const __m256i *)(const void *)ramp8));
+	const __m256i step = _mm256_set1_epi8(32);
+	unsigned int len = 0;
+
+	while ((len + 32) <= max) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(p + len));
+		const uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ramp));
+
+		if (diff) return len + (unsigned int)__builtin_ctz(diff);
+		ramp = _mm256_add_epi8(ramp, step);
+		len += 32;
+	}
+	return len + seq8_length_sse2(p + len, (uint8_t)(num + len), max - len);
+}
+
+TARGET("avx2")
+static TAIL_INLINE unsigned int seq16_length_avx2(const unsigned char * const restrict p,
+		const uint16_t num, const unsigned int max)
+{
+	__m256i ramp = _mm256_add_epi16(_mm256_set1_epi16((short)num),
+			_mm256_loadu_si256((const __m256i *)(const void *)ramp16));
+	const __m256i step = _mm256_set1_epi16(16);
+	unsigned int cnt = 0;
+
+	while ((cnt + 16) <= max) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(p + (cnt << 1)));
+		const uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, ramp));
+
+		if (diff) return cnt + ((unsigned int)__builtin_ctz(diff) >> 1);
+		ramp = _mm256_add_epi16(ramp, step);
+		cnt += 16;
+	}
+	return cnt + seq16_length_sse2(p + (cnt << 1), (uint16_t)(num + cnt), max - cnt);
+}
+
+TARGET("avx2")
+static TAIL_INLINE unsigned int seq32_length_avx2(const unsigned char * const restrict p,
+		const uint32_t num, const unsigned int max)
+{
+	__m256i ramp = _mm256_add_epi32(_mm256_set1_epi32((int)num),
+			_mm256_loadu_si256((const __m256i *)(const void *)ramp32));
+	const __m256i step = _mm256_set1_epi32(8);
+	unsigned int cnt = 0;
+
+	while ((cnt + 8) <= max) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)(p + (cnt << 2)));
+		const uint32_t diff = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, ramp));
+
+		if (diff) return cnt + ((unsigned int)__builtin_ctz(diff) >> 2);
+		ramp = _mm256_add_epi32(ramp, step);
+		cnt += 8;
+	}
+	return cnt + seq32_length_sse2(p + (cnt << 2), num + cnt, max - cnt);
+}
+
+TARGET("avx2")
+static TAIL_INLINE void seq8_fill_avx2(unsigned char * const restrict p,
+		const uint8_t num, const unsigned int count)
+{
+	__m256i ramp = _mm256_add_epi8(_mm256_set1_epi8((char)num),
+			_mm256_loadu_si256((const __m256i *)(const void *)ramp8));
+	const __m256i step = _mm256_set1_epi8(32);
+	unsigned int i;
+
+	for (i = 0; (i + 32) <= count; i += 32) {
+		_mm256_storeu_si256((__m256i *)(void *)(p + i), ramp);
+		ramp = _mm256_add_epi8(ramp, step);
+	}
+	seq8_fill_sse2(p + i, (uint8_t)(num + i), count - i);
+	return;
+}
+
+TARGET("avx2")
+static TAIL_INLINE void seq16_fill_avx2(unsigned char * const restrict p,
+		const uint16_t num, const unsigned int count)
+{
+	__m256i ramp = _mm256_add_epi16(_mm256_set1_epi16((short)num),
+			_mm256_loadu_si256((const __m256i *)(const void *)ramp16));
+	const __m256i step = _mm256_set1_epi16(16);
+	unsigned int i;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		_mm256_storeu_si256((__m256i *)(void *)(p + (i << 1)), ramp);
+		ramp = _mm256_add_epi16(ramp, step);
+	}
+	seq16_fill_sse2(p + (i << 1), (uint16_t)(num + i), count - i);
+	return;
+}
+
+TARGET("avx2")
+static TAIL_INLINE void seq32_fill_avx2(unsigned char * const restrict p,
+		const uint32_t num, const unsigned int count)
+{
+	__m256i ramp = _mm256_add_epi32(_mm256_set1_epi32((int)num),
+			_mm256_loadu_si256((const __m256i *)(const void *)ramp32));
+	const __m256i step = _mm256_set1_epi32(8);
+	unsigned int i;
+
+	for (i = 0; (i + 8) <= count; i += 8) {
+		_mm256_storeu_si256((__m256i *)(void *)(p + (i << 2)), ramp);
+		ramp = _mm256_add_epi32(ramp, step);
+	}
+	seq32_fill_sse2(p + (i << 2), num + i, count - i);
+	return;
+}
+
+/* 4-plane split of 32 quads at a time: a byte shuffle transposes each
+ * 4x4 block of bytes in place, a 32-bit 4x4 transpose gathers a plane
+ * in each register and a lane permute puts the quads back in order */
+TARGET("avx2")
+static void bp4_split_avx2(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length)
+{
+	BP4_PLANES;
+	const __m256i shuf = _mm256_setr_epi8(
+			0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+			0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	const __m256i perm = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	unsigned int i;
+
+	for (i = 0; (i + 32) <= quads; i += 32) {
+		const __m256i *src = (const __m256i *)(const void *)(in + (i << 2));
+		const __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256(src), shuf);
+		const __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256(src + 1), shuf);
+		const __m256i c = _mm256_shuffle_epi8(_mm256_loadu_si256(src + 2), shuf);
+		const __m256i d = _mm256_shuffle_epi8(_mm256_loadu_si256(src + 3), shuf);
+		const __m256i t0 = _mm256_unpacklo_epi32(a, b);
+		const __m256i t1 = _mm256_unpackhi_epi32(a, b);
+		const __m256i t2 = _mm256_unpacklo_epi32(c, d);
+		const __m256i t3 = _mm256_unpackhi_epi32(c, d);
+
+		_mm256_storeu_si256((__m256i *)(void *)(out + i),
+				_mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(t0, t2), perm));
+		_mm256_storeu_si256((__m256i *)(void *)(out + p1 + i),
+				_mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(t0, t2), perm));
+		_mm256_storeu_si256((__m256i *)(void *)(out + p2 + i),
+				_mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(t1, t3), perm));
+		_mm256_storeu_si256((__m256i *)(void *)(out + p3 + i),
+				_mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(t1, t3), perm));
+	}
+	bp4_split_tail(in, out, length, i);
+	return;
+}
+
+/* 4-plane merge of 32 quads at a time: in-lane 8-bit and 16-bit unpacks
+ * build 4-quad groups, then 128-bit lane swaps restore their order */
+TARGET("avx2")
+static void bp4_merge_avx2(const unsigned char * const restrict in,
+		unsigned char * const restrict out, const unsigned int length)
+{
+	BP4_PLANES;
+	unsigned int i;
+
+	for (i = 0; (i + 32) <= quads; i += 32) {
+		const __m256i v0 = _mm256_loadu_si256((const __m256i *)(const void *)(in + i));
+		const __m256i v1 = _mm256_loadu_si256((const __m256i *)(const void *)(in + p1 + i));
+		const __m256i v2 = _mm256_loadu_si256((const __m256i *)(const void *)(in + p2 + i));
+		const __m256i v3 = _mm256_loadu_si256((const __m256i *)(const void *)(in + p3 + i));
+		const __m256i t01l = _mm256_unpacklo_epi8(v0, v1);
+		const __m256i t01h = _mm256_unpackhi_epi8(v0, v1);
+		const __m256i t23l = _mm256_unpacklo_epi8(v2, v3);
+		const __m256i t23h = _mm256_unpackhi_epi8(v2, v3);
+		const __m256i q0 = _mm256_unpacklo_epi16(t01l, t23l);
+		const __m256i q1 = _mm256_unpackhi_epi16(t01l, t23l);
+		const __m256i q2 = _mm256_unpacklo_epi16(t01h, t23h);
+		const __m256i q3 = _mm256_unpackhi_epi16(t01h, t23h);
+		__m256i *dst = (__m256i *)(void *)(out + (i << 2));
+
+		_mm256_storeu_si256(dst, _mm256_permute2x128_si256(q0, q1, 0x20));
+		_mm256_storeu_si256(dst + 1, _mm256_permute2x128_si256(q2, q3, 0x20));
+		_mm256_storeu_si256(dst + 2, _mm256_permute2x128_si256(q0, q1, 0x31));
+		_mm256_storeu_si256(dst + 3, _mm256_permute2x128_si256(q2, q3, 0x31));
+	}
+	bp4_merge_tail(in, out, length, i);
+	return;
+}
+
+
+/*** AVX-512 kernels: 64 bytes per step, compares yield bit masks ***/
+
+TARGET(AVX512)
+static unsigned int match_length_avx512(const unsigned char * const restrict a,
+		const unsigned char * const restrict b, const unsigned int max)
+{
+	unsigned int len = 0;
+
+	while ((len + 64) <= max) {
+		const __m512i va = _mm512_loadu_si512((const void *)(a + len));
+		const __m512i vb = _mm512_loadu_si512((const void *)(b + len));
+		const uint64_t diff = ~(uint64_t)_mm512_cmpeq_epi8_mask(va, vb);
+
+		if (diff) return len + (unsigned int)__builtin_ctzll(diff);
+		len += 64;
+	}
+	return len + match_length_avx2(a + len, b + len, max - len);
+}
+
+TARGET(AVX512)
+static unsigned int rle_length_avx512(const unsigned char * const restrict p,
+		const unsigned char c, const unsigned int max)
+{
+	const __m512i vc = _mm512_set1_epi8((char)c);
+	unsigned int len = 0;
+
+	while ((len + 64) <= max) {
+		const __m512i v = _mm512_loadu_si512((const void *)(p + len));
+		const uint64_t diff = ~(uint64_t)_mm512_cmpeq_epi8_mask(v, vc);
+
+		if (diff) return len + (unsigned int)__builtin_ctzll(diff);
+		len += 64;
+	}
+	return len + rle_length_avx2(p + len, c, max - len);
+}
+
+TARGET(AVX512)
+static unsigned int seq8_length_avx512(const unsigned char * const restrict p,
+		const uint8_t num, const unsigned int max)
+{
+	__m512i ramp = _mm512_add_epi8(_mm512_set1_epi8((char)num),
+			_mm512_loadu_si512((const void *)ramp8));
+	const __m512i step = _mm512_set1_epi8(64);
+	unsigned int len = 0;
+
+	while ((len + 64) <= max) {
+		const __m512i v = _mm512_loadu_si512((const void *)(p + len));
+		const uint64_t diff = ~(uint64_t)_mm512_cmpeq_epi8_mask(v, ramp);
+
+		if (diff) return len + (unsigned int)__builtin_ctzll(diff);
+		ramp = _mm512_add_epi8(ramp, step);
+		len += 64;
+	}
+	return len + seq8_length_avx2(p + len, (uint8_t)(num + len), max - len);
+}
+
+TARGET(AVX512)
+static unsigned int seq16_length_avx512(const unsigned char * const restrict p,
+		const uint16_t num, const unsigned int max)
+{
+	__m512i ramp = _mm512_add_epi16(_mm512_set1_epi16((short)num),
+			_mm512_loadu_si512((const void *)ramp16));
+	const __m512i step = _mm512_set1_epi16(32);
+	unsigned int cnt = 0;
+
+	while ((cnt + 32) <= max) {
+		const __m512i v = _mm512_loadu_si512((const void *)(p + (cnt << 1)));
+		const uint32_t diff = ~(uint32_t)_mm512_cmpeq_epi16_mask(v, ramp);
+
+		if (diff) return cnt + (unsigned int)__builtin_ctz(diff);
+		ramp = _mm512_add_epi16(ramp, step);
+		cnt += 32;
+	}
+	return cnt + seq16_length_avx2(p + (cnt << 1), (uint16_t)(num + cnt), max - cnt);
+}
+
+TARGET(AVX512)
+static unsigned int seq32_length_avx512(const unsigned char * const restrict p,
+		const uint32_t num, const unsigned int max)
+{
+	__m512i ramp = _mm512_add_epi32(_mm512_set1_epi32((int)num),
+			_mm512_loadu_si512((const void *)ramp32));
+	const __m512i step = _mm512_set1_epi32(16);
+	unsigned int cnt = 0;
+
+	while ((cnt + 16) <= max) {
+		const __m512i v = _mm512_loadu_si512((const void *)(p + (cnt << 2)));
+		const unsigned int diff = (unsigned int)_mm512_cmpeq_epi32_mask(v, ramp) ^ 0xffffU;
+
+		if (diff) return cnt + (unsigned int)__builtin_ctz(diff);
+		ramp = _mm512_add_epi32(ramp, step);
+		cnt += 16;
+	}
+	return cnt + seq32_length_avx2(p + (cnt << 2), num + cnt, max - cnt);
+}
+
+TARGET(AVX512)
+static void seq8_fill_avx512(unsigned char * const restrict p,
+		const uint8_t num, const unsigned int count)
+{
+	__m512i ramp = _mm512_add_epi8(_mm512_set1_epi8((char)num),
+			_mm512_loadu_si512((const void *)ramp8));
+	const __m512i step = _mm512_set1_epi8(64);
+	unsigned int i;
+
+	for (i = 0; (i + 64) <= count; i += 64) {
+		_mm512_storeu_si512((void *)(p + i), ramp);
+		ramp = _mm512_add_epi8(ramp, step);
+	}
+	seq8_fill_avx2(p + i, (uint8_t)(num + i), count - i);
+	return;
+}
+
+TARGET(AVX512)
+static void seq16_fill_avx512(unsigned char * const restrict p,
+		const uint16_t num, const unsigned int count)
+{
+	__m512i ramp = _mm512_add_epi16(_mm512_set1_epi16((short)num),
+			_mm512_loadu_si512((const void *)ramp16));
+	const __m512i step = _mm512_set1_epi16(32);
+	unsigned int i;
+
+	for (i = 0; (i + 32) <= count; i += 32) {
+		_mm512_storeu_si512((void *)(p + (i << 1)), ramp);
+		ramp = _mm512_add_epi16(ramp, step);
+	}
+	seq16_fill_avx2(p + (i << 1), (uint16_t)(num + i), count - i);
+	return;
+}
+
+TARGET(AVX512)
+static void seq32_fill_avx512(unsigned char * const restrict p,
+		const uint32_t num, const unsigned int count)
+{
+	__m512i ramp = _mm512_add_epi32(_mm512_set1_epi32((int)num),
+			_mm512_loadu_si512((const void *)ramp32));
+	const __m512i step = _mm512_set1_epi32(16);
+	unsigned int i;
+
+	for (i = 0; (i + 16) <= count; i += 16) {
+		_mm512_storeu_si512((void *)(p + (i << 2)), ramp);
+		ramp = _mm512_add_epi32(ramp, step);
+	}
+	seq32_fill_avx2(p + (i << 2), num + i, count - i);
+	return;
+}
+#endif /* KERNELS_X86 */
+
+
+/*** Dispatch ***/
+
+static const struct lzjody_kernels kernels_scalar = {
+	"scalar",
+	match_length_scalar, rle_length_scalar,
+	seq8_length_scalar, seq16_length_scalar, seq32_length_scalar,
+	seq8_fill_scalar, seq16_fill_scalar, seq32_fill_scalar,
+	bp4_split_scalar, bp4_merge_scalar
+};
+
+#ifdef KERNELS_X86
+static const struct lzjody_kernels kernels_sse2 = {
+	"sse2",
+	match_length_sse2, rle_length_sse2,
+	seq8_length_sse2, seq16_length_sse2, seq32_length_sse2,
+	seq8_fill_sse2, seq16_fill_sse2, seq32_fill_sse2,
+	bp4_split_sse2, bp4_merge_sse2
+};
+
+static const struct lzjody_kernels kernels_avx2 = {
+	"avx2",
+	match_length_avx2, rle_length_avx2,
+	seq8_length_avx2, seq16_length_avx2, seq32_length_avx2,
+	seq8_fill_avx2, seq16_fill_avx2, seq32_fill_avx2,
+	bp4_split_avx2, bp4_merge_avx2
+};
+
+static const struct lzjody_kernels kernels_avx512 = {
+	"avx512",
+	match_length_avx512, rle_length_avx512,
+	seq8_length_avx512, seq16_length_avx512, seq32_length_avx512,
+	seq8_fill_avx512, seq16_fill_avx512, seq32_fill_avx512,
+	bp4_split_avx2, bp4_merge_avx2
+};
+#endif /* KERNELS_X86 */
+
+/* Indexed by LZJODY_TIER_* */
+static const struct lzjody_kernels * const kernel_tiers[] = {
+	&kernels_scalar,
+#ifdef KERNELS_X86
+	&kernels_sse2,
+	&kernels_avx2,
+	&kernels_avx512,
+#endif
+};
+
+/* Valid before lzjody_kernels_init() runs */
+struct lzjody_kernels lzjody_kern = {
+	"scalar",
+	match_length_scalar, rle_length_scalar,
+	seq8_length_scalar, seq16_length_scalar, seq32_length_scalar,
+	seq8_fill_scalar, seq16_fill_scalar, seq32_fill_scalar,
+	bp4_split_scalar, bp4_merge_scalar
+};
+
+/* Highest tier this CPU can run */
+static int cpu_best_tier(void)
+{
+#ifdef KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+		return LZJODY_TIER_AVX512;
+	if (__builtin_cpu_supports("avx2")) return LZJODY_TIER_AVX2;
+	if (__builtin_cpu_supports("sse2")) return LZJODY_TIER_SSE2;
+#endif
+	return LZJODY_TIER_SCALAR;
+}
+
+/* Pick kernels for this CPU; LZJODY_CPU may lower the tier */
+extern void lzjody_kernels_init(void)
+{
+	const char *env = getenv("LZJODY_CPU");
+	int tier = cpu_best_tier();
+	int want;
+
+	if (env != NULL && *env != '\0') {
+		if (!strcmp(env, "scalar")) want = LZJODY_TIER_SCALAR;
+		else if (!strcmp(env, "sse2")) want = LZJODY_TIER_SSE2;
+		else if (!strcmp(env, "avx2")) want = LZJODY_TIER_AVX2;
+		else if (!strcmp(env, "avx512")) want = LZJODY_TIER_AVX512;
+		else goto error_env;
+		if (want > tier) goto error_unsupported;
+		tier = want;
+	}
+set_tier:
+	lzjody_kern = *kernel_tiers[tier];
+	DLOG("liblzjody: using %s kernels\n", lzjody_kern.name);
+	return;
+
+error_env:
+	fprintf(stderr, "liblzjody: unknown LZJODY_CPU '%s', ignoring\n", env);
+	goto set_tier;
+error_unsupported:
+	fprintf(stderr, "liblzjody: LZJODY_CPU '%s' not supported by this CPU, using %s\n",
+			env, kernel_tiers[tier]->name);
+	goto set_tier;
+}
+
+#ifdef __GNUC__
+__attribute__((constructor))
+static void lzjody_kernels_load(void)
+{
+	lzjody_kernels_init();
+	return;
+}
+#endif
+
+/* Name of the kernel tier in use */
+extern const char *lzjody_cpu_tier(void)
+{
+	return lzjody_kern.name;
+}
@@ -0,0 +1,60 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * CPU-specific hot loop kernels
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See lzjody.c for license information.
+ */
+
+#ifndef LZJODY_KERNELS_H
+#define LZJODY_KERNELS_H
+
+#include <stdint.h>
+
+/* Kernel tiers, from slowest to fastest */
+#define LZJODY_TIER_SCALAR 0
+#define LZJODY_TIER_SSE2 1
+#define LZJODY_TIER_AVX2 2
+#define LZJODY_TIER_AVX512 3
+
+/* One implementation of every dispatched kernel
+ * The *_length() kernels never read past p + max (or max values);
+ * the sequence kernels take the value expected at p as 'num'. */
+struct lzjody_kernels {
+	const char *name;
+	unsigned int (*match_length)(const unsigned char * const restrict,
+			const unsigned char * const restrict, const unsigned int);
+	unsigned int (*rle_length)(const unsigned char * const restrict,
+			const unsigned char, const unsigned int);
+	unsigned int (*seq8_length)(const unsigned char * const restrict,
+			uint8_t, const unsigned int);
+	unsigned int (*seq16_length)(const unsigned char * const restrict,
+			uint16_t, const unsigned int);
+	unsigned int (*seq32_length)(const unsigned char * const restrict,
+			uint32_t, const unsigned int);
+	void (*seq8_fill)(unsigned char * const restrict,
+			uint8_t, const unsigned int);
+	void (*seq16_fill)(unsigned char * const restrict,
+			uint16_t, const unsigned int);
+	void (*seq32_fill)(unsigned char * const restrict,
+			uint32_t, const unsigned int);
+	void (*bp4_split)(const unsigned char * const restrict,
+			unsigned char * const restrict, const unsigned int);
+	void (*bp4_merge)(const unsigned char * const restrict,
+			unsigned char * const restrict, const unsigned int);
+};
+
+/* Kernel dispatch is internal to the library; only lzjody_cpu_tier()
+ * is part of the shared library interface */
+#if defined __GNUC__ && !defined _WIN32 && !defined __CYGWIN__
+ #define LZJODY_HIDDEN __attribute__((visibility("hidden")))
+#else
+ #define LZJODY_HIDDEN
+#endif
+
+/* The kernels picked for this CPU (or by LZJODY_CPU) at load time */
+extern LZJODY_HIDDEN struct lzjody_kernels lzjody_kern;
+
+extern LZJODY_HIDDEN void lzjody_kernels_init(void);
+
+#endif	/* LZJODY_KERNELS_H */
@@ -0,0 +1,515 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * Random access reader for seekable streams
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See lzjody.c for license information.
+ *
+ * lzjody_pread() reads uncompressed data from any offset of a seekable
+ * stream (see lzjody_index.c). Only the blocks a read covers are
+ * decoded, and decoded blocks are kept in an LRU cache so that reading
+ * the same region again (file system metadata, directory blocks) costs
+ * a copy instead of a decode. Dedup references are followed to the
+ * block they point to, so only streams with a window are decoded from
+ * the start of a group. With THREADED, a reader may be shared between threads:
+ * file reads use pread() and each thread decodes with its own context
+ * taken from a pool, so the lock is only held for cache lookups.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef THREADED
+#include <pthread.h>
+#endif
+#include "lzjody.h"
+
+#ifdef THREADED
+ #define READER_LOCK(r) pthread_mutex_lock(&(r)->mtx)
+ #define READER_UNLOCK(r) pthread_mutex_unlock(&(r)->mtx)
+#else
+ #define READER_LOCK(r)
+ #define READER_UNLOCK(r)
+#endif
+
+#define NO_SLOT -1
+
+/* One cached decoded block */
+struct cache_slot {
+	uint64_t block;	/* Block number */
+	unsigned int length;	/* Decoded length */
+	int32_t prev;	/* LRU list, most recently used first */
+	int32_t next;
+	int32_t hnext;	/* Hash chain */
+};
+
+/* Decoding state for one thread at a time */
+struct reader_dec {
+	struct lzjody_ctx *ctx;
+	unsigned char *buf;	/* Compressed group */
+	size_t cap;	/* Size of buf */
+	unsigned char *out;	/* Decoded block */
+	unsigned char *ref;	/* Group holding a referenced block */
+	size_t ref_cap;	/* Size of ref */
+	struct reader_dec *next;	/* Free list */
+};
+
+struct lzjody_reader {
+	int fd;
+	struct lzjody_ctx *ctx;	/* Stream settings; reads prefixes */
+	struct lzjody_index *idx;
+	unsigned char header[LZJODY_HEADER_SIZE];
+	unsigned int bsize;	/* Block size */
+	unsigned int psize;	/* Block prefix size */
+	int history;	/* Blocks need the ones before them (window) */
+	unsigned int reset;	/* Reset interval; dedup references stay within it */
+	struct reader_dec *dec;	/* Free decoder contexts */
+	/* Block cache */
+	struct cache_slot *slot;
+	unsigned char *data;	/* 'slots' blocks of decoded data */
+	int32_t *bucket;	/* Hash buckets of slot numbers */
+	uint32_t hmask;
+	int32_t slots;
+	int32_t used;	/* Slots filled so far */
+	int32_t head;	/* Most recently used slot */
+	int32_t tail;	/* Least recently used slot */
+#ifdef THREADED
+	pthread_mutex_t mtx;
+#endif
+};
+
+/* Read exactly 'length' bytes at 'pos' */
+static int read_at(const int fd, unsigned char *p, size_t length, uint64_t pos)
+{
+	ssize_t i;
+
+	while (length) {
+		i = pread(fd, p, length, (off_t)pos);
+		if (i < 0 && errno == EINTR) continue;
+		if (i <= 0) return -1;
+		p += i;
+		pos += (uint64_t)i;
+		length -= (size_t)i;
+	}
+	return 0;
+}
+
+static inline uint32_t block_hash(const struct lzjody_reader * const r,
+		const uint64_t block)
+{
+	return (uint32_t)((block * 0x9e3779b97f4a7c15ULL) >> 32) & r->hmask;
+}
+
+/* Unlink a slot from the LRU list */
+static void lru_unlink(struct lzjody_reader * const r, const int32_t s)
+{
+	struct cache_slot * const c = r->slot + s;
+
+	if (c->prev != NO_SLOT) (r->slot + c->prev)->next = c->next;
+	else r->head = c->next;
+	if (c->next != NO_SLOT) (r->slot + c->next)->prev = c->prev;
+	else r->tail = c->prev;
+	return;
+}
+
+/* Make a slot the most recently used */
+static void lru_push(struct lzjody_reader * const r, const int32_t s)
+{
+	struct cache_slot * const c = r->slot + s;
+
+	c->prev = NO_SLOT;
+	c->next = r->head;
+	if (r->head != NO_SLOT) (r->slot + r->head)->prev = s;
+	r->head = s;
+	if (r->tail == NO_SLOT) r->tail = s;
+	return;
+}
+
+static int32_t cache_find(const struct lzjody_reader * const r, const uint64_t block)
+{
+	int32_t s = *(r->bucket + block_hash(r, block));
+
+	while (s != NO_SLOT && (r->slot + s)->block != block) s = (r->slot + s)->hnext;
+	return s;
+}
+
+/* Copy part of a cached block out; returns the bytes copied or -1 if
+ * the block is not cached. Must be called with the lock held. */
+static int cache_get(struct lzjody_reader * const r, const uint64_t block,
+		unsigned char * const buf, const unsigned int skip,
+		const unsigned int length)
+{
+	const int32_t s = cache_find(r, block);
+	unsigned int n;
+
+	if (s == NO_SLOT) return -1;
+	n = (r->slot + s)->length;
+	n = (skip < n) ? n - skip : 0;
+	if (n > length) n = length;
+	memcpy(buf, r->data + ((size_t)s * r->bsize) + skip, n);
+	if (r->head != s) {
+		lru_unlink(r, s);
+		lru_push(r, s);
+	}
+	return (int)n;
+}
+
+/* Add a decoded block, evicting the least recently used one if the
+ * cache is full. Must be called with the lock held. */
+static void cache_put(struct lzjody_reader * const r, const uint64_t block,
+		const unsigned char * const data, const unsigned int length)
+{
+	struct cache_slot *c;
+	int32_t *p;
+	int32_t s;
+
+	if (r->slots == 0 || cache_find(r, block) != NO_SLOT) return;
+	if (r->used < r->slots) s = r->used++;
+	else {
+		s = r->tail;
+		lru_unlink(r, s);
+		p = r->bucket + block_hash(r, (r->slot + s)->block);
+		while (*p != s) p = &((r->slot + *p)->hnext);
+		*p = (r->slot + s)->hnext;
+	}
+	c = r->slot + s;
+	c->block = block;
+	c->length = length;
+	memcpy(r->data + ((size_t)s * r->bsize), data, length);
+	p = r->bucket + block_hash(r, block);
+	c->hnext = *p;
+	*p = s;
+	lru_push(r, s);
+	return;
+}
+
+static void dec_free(struct reader_dec * const d)
+{
+	if (!d) return;
+	lzjody_ctx_free(d->ctx);
+	free(d->buf);
+	free(d->out);
+	free(d->ref);
+	free(d);
+	return;
+}
+
+/* Take a decoder from the pool, or make one with the stream settings */
+static struct reader_dec *dec_get(struct lzjody_reader * const r)
+{
+	struct reader_dec *d;
+	const unsigned char *dict;
+	unsigned int dict_len;
+
+	READER_LOCK(r);
+	d = r->dec;
+	if (d) r->dec = d->next;
+	READER_UNLOCK(r);
+	if (d) return d;
+
+	d = (struct reader_dec *)calloc(1, sizeof(struct reader_dec));
+	if (!d) goto error_oom;
+	d->ctx = lzjody_ctx_create();
+	d->out = (unsigned char *)malloc(r->bsize);
+	if (!d->ctx || !d->out) goto error_oom;
+	dict = lzjody_ctx_dict(r->ctx, &dict_len);
+	if ((lzjody_ctx_set_dict(d->ctx, dict, dict_len) < 0)
+			|| (lzjody_header_read(d->ctx, r->header) < 0)) {
+		dec_free(d);
+		return NULL;
+	}
+	return d;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a reader context\n");
+	dec_free(d);
+	return NULL;
+}
+
+static void dec_put(struct lzjody_reader * const r, struct reader_dec * const d)
+{
+	READER_LOCK(r);
+	d->next = r->dec;
+	r->dec = d;
+	READER_UNLOCK(r);
+	return;
+}
+
+/* Open a seekable stream for random access reads
+ * The stream's dictionary must be given if it was made with one.
+ * 'cache_size' is the most decoded data to keep in bytes; 0 picks
+ * LZJODY_READER_CACHE. The file descriptor is not closed by
+ * lzjody_reader_close(). */
+extern struct lzjody_reader *lzjody_reader_open(const int fd,
+		const unsigned char * const dict, const unsigned int dict_len,
+		size_t cache_size)
+{
+	struct lzjody_reader *r;
+	unsigned char footer[LZJODY_FOOTER_SIZE];
+	unsigned char *buf = NULL;
+	struct stat st;
+	uint64_t pos;
+	size_t length;
+	uint32_t buckets = 1;
+
+	r = (struct lzjody_reader *)calloc(1, sizeof(struct lzjody_reader));
+	if (!r) goto error_oom;
+	r->fd = fd;
+	r->head = NO_SLOT;
+	r->tail = NO_SLOT;
+#ifdef THREADED
+	pthread_mutex_init(&r->mtx, NULL);
+#endif
+	r->ctx = lzjody_ctx_create();
+	if (!r->ctx) goto error_oom;
+	if (lzjody_ctx_set_dict(r->ctx, dict, dict_len) < 0) goto error;
+
+	/* Header, footer and index */
+	if ((fstat(fd, &st) != 0) || (st.st_size < (LZJODY_HEADER_SIZE + LZJODY_FOOTER_SIZE)))
+		goto error_stream;
+	if (read_at(fd, r->header, LZJODY_HEADER_SIZE, 0) < 0) goto error_read;
+	if (*(r->header) != LZJODY_MAGIC) goto error_stream;
+	if (lzjody_header_read(r->ctx, r->header) < 0) goto error;
+	if (read_at(fd, footer, LZJODY_FOOTER_SIZE,
+				(uint64_t)st.st_size - LZJODY_FOOTER_SIZE) < 0)
+		goto error_read;
+	r->idx = lzjody_index_open(r->ctx, footer, (uint64_t)st.st_size, &pos, &length);
+	if (!r->idx) goto error;
+	buf = (unsigned char *)malloc(length ? length : 1);
+	if (!buf) goto error_oom;
+	if (read_at(fd, buf, length, pos) < 0) goto error_read;
+	if (lzjody_index_read(r->idx, buf) < 0) goto error;
+	free(buf);
+	buf = NULL;
+	r->bsize = lzjody_ctx_block_size(r->ctx);
+	r->psize = lzjody_ctx_prefix_size(r->ctx);
+	r->history = lzjody_ctx_window_size(r->ctx) != 0;
+	r->reset = lzjody_ctx_reset_interval(r->ctx);
+
+	/* Block cache */
+	if (cache_size == 0) cache_size = LZJODY_READER_CACHE;
+	if ((cache_size / r->bsize) > INT32_MAX / 2) cache_size = (size_t)(INT32_MAX / 2) * r->bsize;
+	r->slots = (int32_t)(cache_size / r->bsize);
+	while (buckets < (uint32_t)r->slots) buckets <<= 1;
+	r->hmask = buckets - 1;
+	r->slot = (struct cache_slot *)malloc((size_t)r->slots * sizeof(struct cache_slot) + 1);
+	r->data = (unsigned char *)malloc((size_t)r->slots * r->bsize + 1);
+	r->bucket = (int32_t *)malloc(buckets * sizeof(int32_t));
+	if (!r->slot || !r->data || !r->bucket) goto error_oom;
+	for (uint32_t i = 0; i < buckets; i++) *(r->bucket + i) = NO_SLOT;
+	return r;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a reader\n");
+	goto error;
+error_read:
+	fprintf(stderr, "liblzjody: error: cannot read the stream\n");
+	goto error;
+error_stream:
+	fprintf(stderr, "liblzjody: error: not a seekable lzjody stream\n");
+error:
+	free(buf);
+	lzjody_reader_close(r);
+	return NULL;
+}
+
+extern void lzjody_reader_close(struct lzjody_reader * const r)
+{
+	struct reader_dec *d;
+
+	if (!r) return;
+	while ((d = r->dec)) {
+		r->dec = d->next;
+		dec_free(d);
+	}
+	lzjody_index_free(r->idx);
+	lzjody_ctx_free(r->ctx);
+	free(r->slot);
+	free(r->data);
+	free(r->bucket);
+#ifdef THREADED
+	pthread_mutex_destroy(&r->mtx);
+#endif
+	free(r);
+	return;
+}
+
+/* Uncompressed size of the stream */
+extern uint64_t lzjody_reader_size(const struct lzjody_reader * const r)
+{
+	return lzjody_index_data_size(r->idx);
+}
+
+/* Decode the block a dedup reference in 'block' points to into d->out
+ * for streams without a window. The block is found through the index
+ * and decoded on its own; a reference to a reference is followed.
+ * Returns the decoded length or -1 on error */
+static int read_ref(struct lzjody_reader * const r, struct reader_dec * const d,
+		uint64_t block, const unsigned char *in, unsigned int c_length)
+{
+	unsigned char *p;
+	uint64_t pos;
+	uint64_t start;
+	size_t length;
+	size_t i;
+	unsigned int dist;
+	unsigned int flags = O_REPEAT;
+	int first;
+	int n;
+
+	while (flags & O_REPEAT) {
+		if ((c_length != 2) || (r->reset == 0)) return -1;
+		dist = ((unsigned int)*in << 8) | *(in + 1);
+		if ((dist == 0) || (dist > lzjody_ctx_dedup(r->ctx)) || (dist > (block % r->reset)))
+			return -1;
+		block -= dist;
+		READER_LOCK(r);
+		n = cache_get(r, block, d->out, 0, r->bsize);
+		READER_UNLOCK(r);
+		if (n > 0) return n;
+
+		first = lzjody_index_find(r->idx, block * r->bsize, &pos, &length, &start);
+		if (first < 0) return -1;
+		if (length > d->ref_cap) {
+			p = (unsigned char *)realloc(d->ref, length);
+			if (!p) return -1;
+			d->ref = p;
+			d->ref_cap = length;
+		}
+		if (read_at(r->fd, d->ref, length, pos) < 0) return -1;
+		for (i = 0; ; i += r->psize + c_length, first--) {
+			if ((i + r->psize) > length) return -1;
+			c_length = lzjody_prefix_read(r->ctx, d->ref + i, &flags);
+			if ((c_length == 0) || (c_length > (length - i - r->psize))) return -1;
+			if (first == 0) break;
+		}
+		in = d->ref + i + r->psize;
+	}
+	n = lzjody_decompress_ctx(d->ctx, in, d->out, c_length, flags & 0xe0);
+	if ((n <= 0) || ((unsigned int)n > r->bsize)) return -1;
+	READER_LOCK(r);
+	cache_put(r, block, d->out, (unsigned int)n);
+	READER_UNLOCK(r);
+	return n;
+}
+
+/* Read the part of [off, end) that lies in the group of blocks holding
+ * 'off'. Cached blocks are copied; from the first one that is not, the
+ * group is read with one read and decoded as far as needed.
+ * Returns the bytes read or -1 on error */
+static ssize_t read_group(struct lzjody_reader * const r,
+		unsigned char * const buf, const uint64_t off, uint64_t end)
+{
+	struct reader_dec *d;
+	unsigned char *p;
+	uint64_t pos;
+	uint64_t start;	/* Uncompressed offset of the group */
+	uint64_t o = off;	/* Next offset to fill */
+	uint64_t block;
+	size_t length;
+	size_t i;
+	unsigned int flags;
+	unsigned int c_length = 0;
+	unsigned int skip;
+	unsigned int want;
+	int first;	/* Block of the group holding 'o' */
+	int n;
+
+	if (lzjody_index_find(r->idx, off, &pos, &length, &start) < 0) return 0;
+	pos = start + ((uint64_t)lzjody_index_group_blocks(r->idx) * r->bsize);
+	if (end > pos) end = pos;
+
+	READER_LOCK(r);
+	while (o < end) {
+		block = o / r->bsize;
+		skip = (unsigned int)(o - (block * r->bsize));
+		want = ((end - o) < (r->bsize - skip)) ? (unsigned int)(end - o) : r->bsize - skip;
+		n = cache_get(r, block, buf + (o - off), skip, want);
+		if (n <= 0) break;
+		o += (uint64_t)n;
+	}
+	READER_UNLOCK(r);
+	if (o >= end) return (ssize_t)(o - off);
+
+	first = lzjody_index_find(r->idx, o, &pos, &length, &start);
+	if (first < 0) return (ssize_t)(o - off);
+	d = dec_get(r);
+	if (!d) return -1;
+	if (length > d->cap) {
+		p = (unsigned char *)realloc(d->buf, length);
+		if (!p) goto error_oom;
+		d->buf = p;
+		d->cap = length;
+	}
+	if (read_at(r->fd, d->buf, length, pos) < 0) goto error_read;
+	lzjody_ctx_reset(d->ctx);
+	block = start / r->bsize;
+	for (i = 0; (i < length) && (o < end); i += r->psize + c_length, block++, first--) {
+		if ((i + r->psize) > length) goto error_stream;
+		c_length = lzjody_prefix_read(r->ctx, d->buf + i, &flags);
+		if ((c_length == 0) || (c_length > (length - i - r->psize))) goto error_stream;
+		/* Blocks before the read only matter as history */
+		if ((first > 0) && !r->history) continue;
+		if ((flags & O_REPEAT) && !r->history)
+			n = read_ref(r, d, block, d->buf + i + r->psize, c_length);
+		else n = lzjody_decompress_ctx(d->ctx, d->buf + i + r->psize, d->out,
+				c_length, flags & 0xe0);
+		if ((n <= 0) || ((unsigned int)n > r->bsize)) goto error_stream;
+		READER_LOCK(r);
+		cache_put(r, block, d->out, (unsigned int)n);
+		READER_UNLOCK(r);
+		if (first > 0) continue;
+		skip = (unsigned int)(o - (block * r->bsize));
+		if (skip >= (unsigned int)n) goto error_stream;
+		want = (unsigned int)n - skip;
+		if ((end - o) < want) want = (unsigned int)(end - o);
+		memcpy(buf + (o - off), d->out + skip, want);
+		o += want;
+	}
+	dec_put(r, d);
+	if (o < end) goto error_short;
+	return (ssize_t)(o - off);
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a reader\n");
+	dec_put(r, d);
+	return -1;
+error_read:
+	fprintf(stderr, "liblzjody: error: cannot read the stream\n");
+	dec_put(r, d);
+	return -1;
+error_stream:
+	dec_put(r, d);
+error_short:
+	fprintf(stderr, "liblzjody: data error: bad block near offset %ju\n", (uintmax_t)o);
+	return -1;
+}
+
+/* Read up to 'length' bytes of uncompressed data at 'offset', like
+ * pread(). Returns the bytes read, 0 at the end of the stream or -1 on
+ * error. Safe to call from several threads on the same reader when
+ * built with THREADED. */
+extern ssize_t lzjody_pread(struct lzjody_reader * const r, void * const buf,
+		size_t length, const uint64_t offset)
+{
+	const uint64_t size = lzjody_reader_size(r);
+	uint64_t o = offset;
+	ssize_t n;
+
+	if (offset >= size) return 0;
+	if (length > SSIZE_MAX) length = SSIZE_MAX;
+	if (length > (size - offset)) length = (size_t)(size - offset);
+	while (o < (offset + length)) {
+		n = read_group(r, (unsigned char *)buf + (o - offset), o, offset + length);
+		if (n < 0) return -1;
+		if (n == 0) break;
+		o += (uint64_t)n;
+	}
+	return (ssize_t)(o - offset);
+}
@@ -0,0 +1,415 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * Streaming compression and decompression
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See lzjody.c for license information.
+ *
+ * A stream takes input in pieces of any size and produces the same
+ * format as the lzjody utility: the header (if the context needs one),
+ * block records with length prefixes and, for seekable streams, the
+ * end marker, index and footer. Whole blocks are compressed straight
+ * from the caller's input and decoded straight into the caller's
+ * output whenever they fit, so a large output buffer receives runs of
+ * blocks with no copying; only pieces that straddle calls or do not fit
+ * go through the stream's own buffers.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lzjody.h"
+
+/* Decompressor states */
+#define DS_START 0	/* Nothing read yet */
+#define DS_HEADER 1	/* Reading the stream header */
+#define DS_BLOCKS 2	/* Reading block records */
+#define DS_END 3	/* Past the end marker of a seekable stream */
+
+/* Output the caller has not taken yet */
+struct stream_buf {
+	unsigned char *data;
+	size_t size;	/* Bytes allocated */
+	size_t len;	/* Bytes in use */
+	size_t pos;	/* Bytes already taken */
+};
+
+struct lzjody_cstream {
+	struct lzjody_ctx *ctx;
+	struct lzjody_index *index;	/* Seekable streams only */
+	struct stream_buf pend;	/* Header, block record or index */
+	unsigned char *blk;	/* Partial input block */
+	unsigned int blk_len;	/* Bytes in blk */
+	unsigned int bsize;	/* Block size */
+	unsigned int bound;	/* Largest block record */
+	unsigned int options;	/* Compressor options */
+	int ended;	/* Everything up to the footer has been queued */
+};
+
+struct lzjody_dstream {
+	struct lzjody_ctx *ctx;
+	struct stream_buf pend;	/* Decoded block */
+	unsigned char *rec;	/* Partial header or block record */
+	size_t rec_len;	/* Bytes in rec */
+	unsigned int bsize;	/* Block size */
+	unsigned int psize;	/* Block prefix size */
+	unsigned int bound;	/* Largest compressed block */
+	int state;	/* DS_xxx */
+	uint64_t pos;	/* Stream offset of the next record */
+	uint64_t tail;	/* Bytes after the end marker */
+	unsigned char footer[LZJODY_FOOTER_SIZE];	/* The last of them */
+};
+
+/* Copy as much pending output as fits; returns nonzero if some is left */
+static int stream_flush(struct stream_buf * const pend, unsigned char * const out,
+		const size_t out_len, size_t * const out_pos)
+{
+	size_t n = pend->len - pend->pos;
+
+	if (n > (out_len - *out_pos)) n = out_len - *out_pos;
+	if (n) memcpy(out + *out_pos, pend->data + pend->pos, n);
+	*out_pos += n;
+	pend->pos += n;
+	if (pend->pos < pend->len) return 1;
+	pend->pos = 0;
+	pend->len = 0;
+	return 0;
+}
+
+/* Make room for 'size' bytes of pending output */
+static int stream_reserve(struct stream_buf * const pend, const size_t size)
+{
+	unsigned char *p;
+
+	if (size <= pend->size) return 0;
+	p = (unsigned char *)realloc(pend->data, size);
+	if (!p) return -1;
+	pend->data = p;
+	pend->size = size;
+	return 0;
+}
+
+
+/* Start compressing a stream with ctx, which must already be set up
+ * (block size, window, dedup, dictionary, seekable) and must not be
+ * changed or used for anything else until the stream is freed.
+ * 'options' are the lzjody_compress_ctx() options. */
+extern struct lzjody_cstream *lzjody_cstream_create(struct lzjody_ctx * const ctx,
+		const unsigned int options)
+{
+	struct lzjody_cstream *cs;
+	int i;
+
+	if (!ctx) return NULL;
+	cs = (struct lzjody_cstream *)calloc(1, sizeof(struct lzjody_cstream));
+	if (!cs) goto error_oom;
+	lzjody_ctx_reset(ctx);
+	cs->ctx = ctx;
+	/* Block records always carry their prefixes */
+	cs->options = options & ~(unsigned int)O_NOPREFIX;
+	cs->bsize = lzjody_ctx_block_size(ctx);
+	cs->bound = lzjody_ctx_bound(ctx);
+	cs->blk = (unsigned char *)malloc(cs->bsize);
+	if (!cs->blk || (stream_reserve(&cs->pend, cs->bound) < 0)) goto error_oom;
+
+	/* The header goes out ahead of the first block */
+	i = lzjody_header_write(ctx, cs->pend.data);
+	if (i < 0) goto error;
+	cs->pend.len = (size_t)i;
+	if (lzjody_ctx_seekable(ctx)) {
+		cs->index = lzjody_index_create(ctx, lzjody_index_default_bits(ctx), (uint64_t)i);
+		if (!cs->index) goto error;
+	}
+	return cs;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a stream\n");
+error:
+	lzjody_cstream_free(cs);
+	return NULL;
+}
+
+extern void lzjody_cstream_free(struct lzjody_cstream * const cs)
+{
+	if (!cs) return;
+	lzjody_index_free(cs->index);
+	free(cs->pend.data);
+	free(cs->blk);
+	free(cs);
+	return;
+}
+
+/* Compress one block into 'out', which holds at least a bound */
+static int cstream_block(struct lzjody_cstream * const cs,
+		const unsigned char * const in, const unsigned int length,
+		unsigned char * const out)
+{
+	int i;
+
+	i = lzjody_compress_ctx(cs->ctx, in, out, cs->options, length);
+	if (i < 0) return -1;
+	if (cs->index && (lzjody_index_add(cs->index, out, (size_t)i, length) < 0))
+		return -1;
+	return i;
+}
+
+/* Compress in[*in_pos..in_len) into out[*out_pos..out_len), advancing
+ * both positions. Returns 0 once all input is taken (a partial block is
+ * kept for the next call), 1 if the output filled up first, in which
+ * case call again with more room, or -1 on error. */
+extern int lzjody_cstream_compress(struct lzjody_cstream * const cs,
+		const unsigned char * const in, const size_t in_len, size_t * const in_pos,
+		unsigned char * const out, const size_t out_len, size_t * const out_pos)
+{
+	size_t n;
+	int i;
+
+	if (cs->ended) goto error_ended;
+	while (1) {
+		if (stream_flush(&cs->pend, out, out_len, out_pos)) return 1;
+		if (*in_pos == in_len) return 0;
+		/* Whole blocks go straight from the input to the output */
+		if ((cs->blk_len == 0) && ((in_len - *in_pos) >= cs->bsize)
+				&& ((out_len - *out_pos) >= cs->bound)) {
+			i = cstream_block(cs, in + *in_pos, cs->bsize, out + *out_pos);
+			if (i < 0) return -1;
+			*in_pos += cs->bsize;
+			*out_pos += (size_t)i;
+			continue;
+		}
+		n = cs->bsize - cs->blk_len;
+		if (n > (in_len - *in_pos)) n = in_len - *in_pos;
+		memcpy(cs->blk + cs->blk_len, in + *in_pos, n);
+		cs->blk_len += (unsigned int)n;
+		*in_pos += n;
+		if (cs->blk_len < cs->bsize) return 0;
+		i = cstream_block(cs, cs->blk, cs->blk_len, cs->pend.data);
+		if (i < 0) return -1;
+		cs->pend.len = (size_t)i;
+		cs->blk_len = 0;
+	}
+
+error_ended:
+	fprintf(stderr, "liblzjody: error: stream already ended\n");
+	return -1;
+}
+
+/* Compress the last partial block and write the index of a seekable
+ * stream. Returns 1 while output is left (call again with more room),
+ * 0 when the stream is complete or -1 on error. */
+extern int lzjody_cstream_end(struct lzjody_cstream * const cs,
+		unsigned char * const out, const size_t out_len, size_t * const out_pos)
+{
+	int i;
+
+	while (1) {
+		if (stream_flush(&cs->pend, out, out_len, out_pos)) return 1;
+		if (cs->ended) return 0;
+		if (cs->blk_len) {
+			i = cstream_block(cs, cs->blk, cs->blk_len, cs->pend.data);
+			if (i < 0) return -1;
+			cs->pend.len = (size_t)i;
+			cs->blk_len = 0;
+			continue;
+		}
+		if (cs->index) {
+			if (stream_reserve(&cs->pend, lzjody_index_size(cs->index)) < 0)
+				goto error_oom;
+			cs->pend.len = lzjody_index_write(cs->index, cs->pend.data);
+		}
+		cs->ended = 1;
+	}
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for an index\n");
+	return -1;
+}
+
+
+/* Start decompressing a stream into ctx
+ * The header, if any, sets up the context; a preset dictionary must be
+ * set beforehand. The context must not be used for anything else until
+ * the stream is freed. */
+extern struct lzjody_dstream *lzjody_dstream_create(struct lzjody_ctx * const ctx)
+{
+	struct lzjody_dstream *ds;
+
+	if (!ctx) return NULL;
+	ds = (struct lzjody_dstream *)calloc(1, sizeof(struct lzjody_dstream));
+	if (!ds) goto error_oom;
+	ds->ctx = ctx;
+	ds->state = DS_START;
+	ds->rec = (unsigned char *)malloc(LZJODY_HEADER_SIZE);
+	if (!ds->rec) goto error_oom;
+	return ds;
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a stream\n");
+	lzjody_dstream_free(ds);
+	return NULL;
+}
+
+extern void lzjody_dstream_free(struct lzjody_dstream * const ds)
+{
+	if (!ds) return;
+	free(ds->pend.data);
+	free(ds->rec);
+	free(ds);
+	return;
+}
+
+/* Size the buffers once the block size is known */
+static int dstream_setup(struct lzjody_dstream * const ds)
+{
+	unsigned char *p;
+
+	lzjody_ctx_reset(ds->ctx);
+	ds->bsize = lzjody_ctx_block_size(ds->ctx);
+	ds->psize = lzjody_ctx_prefix_size(ds->ctx);
+	ds->bound = lzjody_ctx_bound(ds->ctx);
+	p = (unsigned char *)realloc(ds->rec, (size_t)ds->psize + ds->bound);
+	if (!p) return -1;
+	ds->rec = p;
+	return stream_reserve(&ds->pend, ds->bsize);
+}
+
+/* Find 'need' bytes of the current header or record
+ * Returns a pointer into the input if all of it is there (the caller
+ * moves past it), otherwise collects what there is in ds->rec and
+ * returns ds->rec once complete or NULL if more input is needed. The
+ * prefix is looked at first, so ds->rec may already hold more. */
+static const unsigned char *dstream_gather(struct lzjody_dstream * const ds,
+		const unsigned char * const in, const size_t in_len,
+		size_t * const in_pos, const size_t need)
+{
+	size_t n;
+
+	if ((ds->rec_len == 0) && ((in_len - *in_pos) >= need)) return in + *in_pos;
+	if (ds->rec_len < need) {
+		n = need - ds->rec_len;
+		if (n > (in_len - *in_pos)) n = in_len - *in_pos;
+		memcpy(ds->rec + ds->rec_len, in + *in_pos, n);
+		ds->rec_len += n;
+		*in_pos += n;
+	}
+	return (ds->rec_len >= need) ? ds->rec : NULL;
+}
+
+/* Decompress in[*in_pos..in_len) into out[*out_pos..out_len),
+ * advancing both positions. Returns 0 once all input is taken, 1 if
+ * the output filled up first, in which case call again with more room,
+ * or -1 on error. Blocks are decoded in place while the output has a
+ * block of room. After the end marker of a seekable stream the index
+ * and footer are only kept track of for lzjody_dstream_end(). */
+extern int lzjody_dstream_decompress(struct lzjody_dstream * const ds,
+		const unsigned char * const in, const size_t in_len, size_t * const in_pos,
+		unsigned char * const out, const size_t out_len, size_t * const out_pos)
+{
+	const unsigned char *p;
+	unsigned char *dst;
+	size_t n;
+	unsigned int length;
+	unsigned int flags;
+	int i;
+
+	while (1) {
+		if (stream_flush(&ds->pend, out, out_len, out_pos)) return 1;
+		if (ds->state == DS_END) {
+			/* Keep the last LZJODY_FOOTER_SIZE bytes */
+			n = in_len - *in_pos;
+			if (n >= LZJODY_FOOTER_SIZE) {
+				memcpy(ds->footer, in + in_len - LZJODY_FOOTER_SIZE, LZJODY_FOOTER_SIZE);
+			} else {
+				memmove(ds->footer, ds->footer + n, LZJODY_FOOTER_SIZE - n);
+				memcpy(ds->footer + LZJODY_FOOTER_SIZE - n, in + *in_pos, n);
+			}
+			ds->tail += n;
+			*in_pos = in_len;
+			return 0;
+		}
+		if (*in_pos == in_len) return 0;
+
+		/* Large block and dictionary streams start with a header */
+		if (ds->state == DS_START) {
+			ds->state = DS_HEADER;
+			if (*(in + *in_pos) == LZJODY_MAGIC) continue;
+			lzjody_ctx_set_dict(ds->ctx, NULL, 0);
+			if (dstream_setup(ds) < 0) goto error_oom;
+			ds->state = DS_BLOCKS;
+			continue;
+		}
+		if (ds->state == DS_HEADER) {
+			p = dstream_gather(ds, in, in_len, in_pos, LZJODY_HEADER_SIZE);
+			if (!p) return 0;
+			if (p != ds->rec) *in_pos += LZJODY_HEADER_SIZE;
+			ds->rec_len = 0;
+			ds->pos = LZJODY_HEADER_SIZE;
+			if (lzjody_header_read(ds->ctx, p) < 0) return -1;
+			if (dstream_setup(ds) < 0) goto error_oom;
+			ds->state = DS_BLOCKS;
+			continue;
+		}
+
+		p = dstream_gather(ds, in, in_len, in_pos, ds->psize);
+		if (!p) return 0;
+		length = lzjody_prefix_read(ds->ctx, p, &flags);
+		if (length > ds->bound) goto error_length;
+		/* Zero-length blocks cannot be decompressed; in a seekable
+		 * stream one marks the start of the index */
+		if (length == 0) {
+			if (!lzjody_ctx_seekable(ds->ctx)) goto error_zero;
+			if (p != ds->rec) *in_pos += ds->psize;
+			ds->state = DS_END;
+			ds->rec_len = 0;
+			ds->pos += ds->psize;
+			continue;
+		}
+		p = dstream_gather(ds, in, in_len, in_pos, (size_t)ds->psize + length);
+		if (!p) return 0;
+		if (p != ds->rec) *in_pos += (size_t)ds->psize + length;
+		ds->rec_len = 0;
+		ds->pos += (uint64_t)ds->psize + length;
+
+		/* Decode in place if a whole block fits */
+		dst = ((out_len - *out_pos) >= ds->bsize) ? (out + *out_pos) : ds->pend.data;
+		i = lzjody_decompress_ctx(ds->ctx, p + ds->psize, dst, length, flags & 0xe0);
+		if (i < 0) goto error_block;
+		if (dst == ds->pend.data) ds->pend.len = (size_t)i;
+		else *out_pos += (size_t)i;
+	}
+
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory for a stream\n");
+	return -1;
+error_length:
+	fprintf(stderr, "liblzjody: data error: block prefix too large (%u > %u)\n",
+			length, ds->bound);
+	return -1;
+error_zero:
+	fprintf(stderr, "liblzjody: data error: zero-length block\n");
+	return -1;
+error_block:
+	fprintf(stderr, "liblzjody: data error: cannot decompress block\n");
+	return -1;
+}
+
+/* Check that the input ended where a stream may end: not inside the
+ * header or a block, and for a seekable stream after a whole index and
+ * footer (see lzjody_index_check()). Returns 0 if so, otherwise -1. */
+extern int lzjody_dstream_end(const struct lzjody_dstream * const ds)
+{
+	if (ds->state == DS_START) return 0;
+	if ((ds->state == DS_HEADER) || ds->rec_len) goto error_short;
+	if ((ds->state == DS_BLOCKS) && lzjody_ctx_seekable(ds->ctx)) goto error_index;
+	if (ds->state == DS_END)
+		return lzjody_index_check(ds->ctx, ds->footer, ds->pos, ds->tail);
+	return 0;
+
+error_short:
+	fprintf(stderr, "liblzjody: data error: stream ends inside a block\n");
+	return -1;
+error_index:
+	fprintf(stderr, "liblzjody: data error: seekable stream ends before its index\n");
+	return -1;
+}
@@ -0,0 +1,149 @@
+/*
+ * Lempel-Ziv-JodyBruchon compression library
+ * Preset dictionary trainer
+ *
+ * Copyright (C) 2014-2020 by Jody Bruchon <jody@jodybruchon.com>
+ * See lzjody.c for license information.
+ *
+ * The sample data is cut into 4 KiB pages and every KGRAM_LEN byte
+ * string is counted once per page it appears in. Candidate segments of
+ * SEG_LEN bytes are scored by how many other pages share their strings
+ * and the best ones are copied into the dictionary. Once a segment is
+ * picked its strings stop counting, so the dictionary doesn't fill up
+ * with copies of the same boilerplate. The best segments go at the end
+ * of the dictionary, closest to the data being compressed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "lzjody.h"
+
+#define KGRAM_LEN 8	/* Length of counted strings */
+#define SEG_LEN 64	/* Length of dictionary segments */
+#define SEG_STEP 16	/* Distance between candidate segments */
+#define TRAIN_HASH_BITS 20
+#define TRAIN_HASH_SIZE (1 << TRAIN_HASH_BITS)
+
+struct seg_t {
+	uint32_t score;
+	uint32_t pos;
+};
+
+static inline uint32_t kgram_hash(const unsigned char * const p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(uint64_t));
+	return (uint32_t)((v * 0x9e3779b97f4a7c15ULL) >> (64 - TRAIN_HASH_BITS));
+}
+
+/* Strings found in only one page are worth nothing */
+static uint32_t seg_score(const unsigned char * const p,
+		const uint32_t * const restrict count)
+{
+	uint32_t score = 0;
+	uint32_t c;
+
+	for (int i = 0; i <= (SEG_LEN - KGRAM_LEN); i++) {
+		c = count[kgram_hash(p + i)];
+		if (c > 1) score += c - 1;
+	}
+	return score;
+}
+
+/* Max-heap of candidate segments ordered by score */
+static void heap_down(struct seg_t * const restrict heap, const uint32_t n,
+		uint32_t i)
+{
+	const struct seg_t item = heap[i];
+	uint32_t child;
+
+	while ((child = (i * 2) + 1) < n) {
+		if (((child + 1) < n) && (heap[child + 1].score > heap[child].score)) child++;
+		if (heap[child].score <= item.score) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = item;
+	return;
+}
+
+extern int lzjody_train_dict(const unsigned char * const samples,
+		const unsigned int length, unsigned char * const dict,
+		const unsigned int size)
+{
+	uint32_t *count = NULL;	/* Pages containing each string */
+	uint32_t *last = NULL;	/* Last page each string was counted in */
+	struct seg_t *heap = NULL;
+	uint32_t n = 0;
+	uint32_t page, end, pos, h;
+	uint32_t fill = size;	/* Dictionary is filled from the end */
+	uint32_t score;
+
+	if (size < SEG_LEN) goto error_size;
+	count = (uint32_t *)calloc(TRAIN_HASH_SIZE, sizeof(uint32_t));
+	last = (uint32_t *)calloc(TRAIN_HASH_SIZE, sizeof(uint32_t));
+	heap = (struct seg_t *)malloc(((length / SEG_STEP) + 1) * sizeof(struct seg_t));
+	if (!count || !last || !heap) goto error_oom;
+
+	/* Count the pages each string appears in */
+	for (page = 0; (page * LZJODY_BSIZE) < length; page++) {
+		pos = page * LZJODY_BSIZE;
+		end = ((length - pos) > LZJODY_BSIZE) ? (pos + LZJODY_BSIZE) : length;
+		for (; (pos + KGRAM_LEN) <= end; pos++) {
+			h = kgram_hash(samples + pos);
+			if (last[h] == page + 1) continue;
+			last[h] = page + 1;
+			count[h]++;
+		}
+	}
+
+	/* Score every candidate segment that lies inside one page */
+	for (pos = 0; (pos + SEG_LEN) <= length; pos += SEG_STEP) {
+		if ((pos % LZJODY_BSIZE) > (LZJODY_BSIZE - SEG_LEN)) continue;
+		score = seg_score(samples + pos, count);
+		if (score == 0) continue;
+		heap[n].score = score;
+		heap[n].pos = pos;
+		n++;
+	}
+	for (h = n / 2; h > 0; h--) heap_down(heap, n, h - 1);
+
+	/* Scores only go down, so a segment that is still the best after
+	 * rescoring is the best one left */
+	while ((n > 0) && (fill >= SEG_LEN)) {
+		pos = heap[0].pos;
+		score = seg_score(samples + pos, count);
+		if (score < heap[0].score) {
+			heap[0].score = score;
+			if (score == 0) heap[0] = heap[--n];
+			heap_down(heap, n, 0);
+			continue;
+		}
+		fill -= SEG_LEN;
+		memcpy(dict + fill, samples + pos, SEG_LEN);
+		for (int i = 0; i <= (SEG_LEN - KGRAM_LEN); i++)
+			count[kgram_hash(samples + pos + i)] = 0;
+		heap[0] = heap[--n];
+		heap_down(heap, n, 0);
+	}
+
+	/* Move a partly filled dictionary to the start of the buffer */
+	if (fill) memmove(dict, dict + fill, size - fill);
+	free(count);
+	free(last);
+	free(heap);
+	return (int)(size - fill);
+
+error_size:
+	fprintf(stderr, "liblzjody: error: dictionary size %u is too small\n", size);
+	return -1;
+error_oom:
+	fprintf(stderr, "liblzjody: error: out of memory training a dictionary\n");
+	free(count);
+	free(last);
+	free(heap);
+	return -1;
+}
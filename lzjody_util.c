@@ -5,12 +5,24 @@
  * Released under The MIT License
  */
 
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE	/* fallocate(), O_DIRECT */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <getopt.h>
+#if !defined _WIN32 && !defined __CYGWIN__
+#include <sys/mman.h>
+#endif
+#ifdef THREADED
+#include <pthread.h>
+#endif
 #include "lzjody.h"
 #include "lzjody_util.h"
 
@@ -24,11 +36,9 @@
  #include <io.h>
 #endif
 
-#ifdef THREADED
-#include <pthread.h>
-pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond;	/* pthreads change condition */
-static int thread_error;	/* nonzero if any thread fails */
+/* Systems without O_DIRECT always go through the page cache */
+#ifndef O_DIRECT
+ #define O_DIRECT 0
 #endif
 
 /* Debugging stuff */
@@ -42,52 +52,1315 @@ static int thread_error;	/* nonzero if any thread fails */
 
 struct files_t files;
 
+/* Map an input file given with -i so that blocks are compressed and
+ * decompressed straight from the page cache instead of being copied
+ * into buffers first. Anything that cannot be mapped is read with
+ * stdio as usual. */
+static void in_map(void)
+{
+#ifndef ON_WINDOWS
+	struct stat st;
+	void *p;
+
+	if (fstat(fileno(files.in), &st) != 0 || !S_ISREG(st.st_mode)) return;
+	if ((st.st_size == 0) || ((uintmax_t)st.st_size > SIZE_MAX)) return;
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(files.in), 0);
+	if (p == MAP_FAILED) return;
+ #ifdef MADV_SEQUENTIAL
+	madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+ #endif
+	files.map = (const unsigned char *)p;
+	files.map_size = (size_t)st.st_size;
+	files.map_pos = 0;
+#endif /* ON_WINDOWS */
+	return;
+}
+
+/* Read up to 'length' input bytes and return where they are: 'buf',
+ * or the input mapping if there is one. *got is 0 at end of input. */
+static const unsigned char *in_read(unsigned char * const buf,
+		const size_t length, size_t * const got)
+{
+	const unsigned char *p;
+
+	if (!files.map) {
+		*got = fread(buf, 1, length, files.in);
+		return buf;
+	}
+	p = files.map + files.map_pos;
+	*got = files.map_size - files.map_pos;
+	if (*got > length) *got = length;
+	files.map_pos += *got;
+	return p;
+}
+
+/* Look at the next input byte without reading it */
+static int in_peek(void)
+{
+	int c;
+
+	if (files.map)
+		return (files.map_pos < files.map_size) ? *(files.map + files.map_pos) : EOF;
+	c = getc(files.in);
+	if (c != EOF) ungetc(c, files.in);
+	return c;
+}
+
+/* Write zeros into output holes if the file already had data there
+ * Holes are punched instead where the filesystem supports it */
+static int sparse_fill(const off_t pos, off_t length)
+{
+	static const unsigned char zeros[SPARSE_SIZE];
+	size_t n;
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(fileno(files.out), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				pos, length) == 0)
+		return 0;
+#else
+	(void)pos;
+#endif
+	while (length > 0) {
+		n = (length > SPARSE_SIZE) ? SPARSE_SIZE : (size_t)length;
+		if (fwrite(zeros, 1, n, files.out) != n) return -1;
+		length -= (off_t)n;
+	}
+	return 0;
+}
+
+/* Move the output position past any pending hole */
+static int sparse_seek(void)
+{
+	off_t pos;
+	off_t length;
+
+	if (files.hole == 0) return 0;
+	if (fflush(files.out) != 0) return -1;
+	pos = ftello(files.out);
+	if (pos < 0) return -1;
+	/* Output that was not truncated may have old data under the hole */
+	if (pos < files.size) {
+		length = files.size - pos;
+		if (length > files.hole) length = files.hole;
+		if (sparse_fill(pos, length) < 0) return -1;
+		if (fseeko(files.out, pos, SEEK_SET) != 0) return -1;
+	}
+	if (fseeko(files.out, files.hole, SEEK_CUR) != 0) return -1;
+	files.hole = 0;
+	return 0;
+}
+
+/* Write decompressed data; in a regular file, SPARSE_SIZE pieces that
+ * are all zeros are seeked over instead, so they become holes */
+static size_t write_out(const unsigned char *p, const size_t length)
+{
+	size_t remain = length;
+	size_t n;
+
+	if (!files.sparse) return fwrite(p, 1, length, files.out);
+	while (remain) {
+		n = (remain > SPARSE_SIZE) ? SPARSE_SIZE : remain;
+		if ((*p == 0) && (memcmp(p, p + 1, n - 1) == 0)) {
+			files.hole += (off_t)n;
+		} else {
+			if (sparse_seek() < 0) break;
+			if (fwrite(p, 1, n, files.out) != n) break;
+		}
+		p += n;
+		remain -= n;
+	}
+	return length - remain;
+}
+
+/* Use sparse output if stdout is a regular file we can seek in */
+static void sparse_init(void)
+{
+#ifndef ON_WINDOWS
+	struct stat st;
+	int flags;
+
+	if (fstat(fileno(files.out), &st) != 0 || !S_ISREG(st.st_mode)) return;
+	flags = fcntl(fileno(files.out), F_GETFL);
+	if (flags < 0 || (flags & O_APPEND)) return;
+	if (ftello(files.out) < 0) return;
+	files.sparse = 1;
+	files.size = st.st_size;
+#endif /* ON_WINDOWS */
+	return;
+}
+
+/* Seek past a trailing hole and extend the file to cover it */
+static int sparse_finish(void)
+{
+	off_t pos;
+
+	if (!files.sparse || files.hole == 0) return 0;
+	if (sparse_seek() < 0) return -1;
+	pos = ftello(files.out);
+	if (pos < 0) return -1;
+	if (pos > files.size && ftruncate(fileno(files.out), pos) != 0) return -1;
+	return 0;
+}
+
 #ifdef THREADED
-static void *compress_thread(void *arg)
+/* Flag a failure and wake every thread so they can exit */
+static void pool_fail(struct pool_t * const pool)
 {
-	struct thread_info * const thr = arg;
-	const unsigned char *ipos = thr->blk;	/* Uncompressed input pointer */
-	unsigned char *opos = thr->out;	/* Compressed output pointer */
+	pool->error = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_cond_broadcast(&pool->free_cond);
+	return;
+}
+
+/* Compress every block in a job */
+static int compress_job(struct lzjody_ctx * const ctx,
+		struct job_t * const job, const unsigned char options)
+{
+	const unsigned char *ipos = job->src;	/* Uncompressed input pointer */
+	unsigned char *opos = job->out;	/* Compressed output pointer */
 	int i;
-	int bsize = LZJODY_BSIZE;	/* Compressor block size */
-	int remain = thr->length;	/* Remaining input bytes */
+	int bsize = (int)lzjody_ctx_block_size(ctx);	/* Compressor block size */
+	int remain = job->length;	/* Remaining input bytes */
 
+	/* Every job starts at a reset point */
+	lzjody_ctx_reset(ctx);
 	while (remain) {
-		if (remain < LZJODY_BSIZE) bsize = remain;
-		i = lzjody_compress(ipos, opos, thr->options, bsize);
-		if (i < 0) {
-			thread_error = 1;
-			pthread_cond_signal(&cond);
-		}
+		if (remain < bsize) bsize = remain;
+		i = lzjody_compress_ctx(ctx, ipos, opos, options, bsize);
+		if (i < 0) return -1;
 		ipos += bsize;
 		opos += i;
 		remain -= bsize;
 	}
-	thr->o_length = opos - thr->out;
-	thr->working = 0;
-	pthread_cond_signal(&cond);
+	job->o_length = (int)(opos - job->out);
+	return 0;
+}
+
+/* Decompress every length-prefixed block record in a job
+ * The reader has already checked each prefix against the job size */
+static int decompress_job(struct lzjody_ctx * const ctx,
+		struct job_t * const job)
+{
+	const unsigned char *ipos = job->src;	/* Compressed input pointer */
+	const unsigned char * const iend = job->src + job->length;
+	unsigned char *opos = job->out;	/* Decompressed output pointer */
+	const int bsize = (int)lzjody_ctx_block_size(ctx);
+	const int psize = (int)lzjody_ctx_prefix_size(ctx);
+	unsigned int options;
+	int length;
+	int c_length;
+
+	/* Every job starts at a reset point */
+	lzjody_ctx_reset(ctx);
+	while (ipos < iend) {
+		length = (int)lzjody_prefix_read(ctx, ipos, &options);
+		ipos += psize;
+
+		/* Stored (O_NOCOMPRESS) blocks are copied by the library too,
+		 * so streaming mode history stays complete */
+		c_length = lzjody_decompress_ctx(ctx, ipos, opos, length, options & 0xe0);
+		if (c_length < 0) return -1;
+		if (c_length > bsize) goto error_blocksize_decomp;
+		ipos += length;
+		opos += c_length;
+	}
+	job->o_length = (int)(opos - job->out);
+	return 0;
+
+error_blocksize_decomp:
+	fprintf(stderr, "Error: decompressor overflow (%d > %d)\n",
+			c_length, bsize);
+	return -1;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct pool_t * const pool = arg;
+	struct lzjody_ctx *ctx;
+	struct job_t *job;
+	int err;
+
+	ctx = lzjody_ctx_create();
+	if (ctx && ((lzjody_ctx_set_level(ctx, pool->level) < 0)
+			|| (lzjody_ctx_set_block_size(ctx, pool->bsize) < 0)
+			|| (lzjody_ctx_set_dict(ctx, pool->dict, pool->dict_len) < 0)
+			|| (lzjody_ctx_set_window(ctx, pool->window, pool->reset) < 0)
+			|| (lzjody_ctx_set_dedup(ctx, pool->dedup) < 0))) {
+		lzjody_ctx_free(ctx);
+		ctx = NULL;
+	}
+	pthread_mutex_lock(&pool->mtx);
+	if (!ctx) pool_fail(pool);
+	while (1) {
+		while (!pool->error && !pool->eof && pool->claimed == pool->queued)
+			pthread_cond_wait(&pool->work_cond, &pool->mtx);
+		if (pool->error || pool->claimed == pool->queued) break;
+		job = pool->jobs + (pool->claimed % pool->slots);
+		pool->claimed++;
+		pthread_mutex_unlock(&pool->mtx);
+
+		if (pool->mode == 'd') err = decompress_job(ctx, job);
+		else err = compress_job(ctx, job, pool->options);
+
+		pthread_mutex_lock(&pool->mtx);
+		if (err < 0) {
+			pool_fail(pool);
+			break;
+		}
+		job->state = JOB_DONE;
+		pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+	lzjody_ctx_free(ctx);
+	return NULL;
+}
+
+/* Wait for one I/O engine write and release its job slot once all
+ * of the job's writes are done. Called without the pool lock. */
+static int writer_reap(struct pool_t * const pool)
+{
+	struct job_t *job;
+	void *tag;
+	ssize_t res;
+
+	if (io_wait(pool->io, &tag, &res) < 0) return -1;
+	job = (struct job_t *)tag;
+	pthread_mutex_lock(&pool->mtx);
+	job->pending--;
+	if (job->pending == 0) {
+		job->state = JOB_FREE;
+		pthread_cond_signal(&pool->free_cond);
+	}
+	pthread_mutex_unlock(&pool->mtx);
+	if (res < 0) {
+		fprintf(stderr, "Error writing file %s: %s\n", files.out_name, strerror((int)-res));
+		return -1;
+	}
+	return 0;
+}
+
+/* Queue one engine write, making room first if the engine is full */
+static int writer_queue(struct pool_t * const pool, struct job_t * const job,
+		const unsigned char * const p, const size_t length, const uint64_t pos)
+{
+	if (io_inflight(pool->io) == IO_DEPTH && writer_reap(pool) < 0) return -1;
+	job->pending++;
+	if (io_write(pool->io, files.out_fd, p, length, pos, job) == 0) return 0;
+	job->pending--;
+	fprintf(stderr, "Error writing file %s (cannot queue a write)\n", files.out_name);
+	return -1;
+}
+
+/* Queue the writes for a finished job and move on without waiting for
+ * them. Decompressed zeros are skipped as holes, like write_out() does.
+ * With O_DIRECT, a partial last piece at the end of the stream is left
+ * in *tail for writer_finish(). Returns -1 on error. */
+static int writer_submit(struct pool_t * const pool, struct job_t * const job,
+		size_t * const tail)
+{
+	const unsigned char * const p = job->out;
+	const size_t length = (size_t)job->o_length;
+	size_t run = 0;	/* Start of the current run of data */
+	size_t i = 0;
+	size_t n;
+
+	if (pool->mode == 'c') return writer_queue(pool, job, p, length, pool->out_pos);
+	while (run < length) {
+		/* Find the end of a run of SPARSE_SIZE pieces with data */
+		for (i = run; i < length; i += n) {
+			n = ((length - i) > SPARSE_SIZE) ? SPARSE_SIZE : (length - i);
+			if ((*(p + i) == 0) && (memcmp(p + i, p + i + 1, n - 1) == 0)) break;
+		}
+		n = i - run;
+		if (files.out_direct && (n % IO_ALIGN)) {
+			*tail = n % IO_ALIGN;
+			n -= *tail;
+		}
+		if (n && (writer_queue(pool, job, p + run, n, pool->out_pos + run) < 0)) return -1;
+		if (i >= length) break;
+		/* Skip the hole; the file is extended over it at the end */
+		for (run = i; run < length; run += n) {
+			n = ((length - run) > SPARSE_SIZE) ? SPARSE_SIZE : (length - run);
+			if ((*(p + run) != 0) || (memcmp(p + run, p + run + 1, n - 1) != 0)) break;
+		}
+	}
+	return 0;
+}
+
+/* Write the unaligned end of an O_DIRECT stream, extend the file over
+ * a trailing hole and put the stdio position after the output */
+static int writer_finish(struct pool_t * const pool, const unsigned char * const tail,
+		const size_t tail_len)
+{
+	int flags;
+
+	if (tail_len) {
+		flags = fcntl(files.out_fd, F_GETFL);
+		if ((flags < 0) || (fcntl(files.out_fd, F_SETFL, flags & ~O_DIRECT) != 0)
+				|| (pwrite(files.out_fd, tail, tail_len,
+						(off_t)(pool->out_pos - tail_len)) != (ssize_t)tail_len))
+			return -1;
+	}
+	if ((pool->mode == 'd') && (ftruncate(files.out_fd, (off_t)pool->out_pos) != 0)) return -1;
+	if (fseeko(files.out, (off_t)pool->out_pos, SEEK_SET) != 0) return -1;
+	return 0;
+}
+
+/* Write finished jobs in the order they were read
+ * With an I/O engine, several jobs' writes are in flight at once and
+ * each slot is released when its writes finish */
+static void *writer_thread(void *arg)
+{
+	struct pool_t * const pool = arg;
+	struct job_t *job;
+	const unsigned char *tail = NULL;	/* O_DIRECT unaligned stream end */
+	size_t tail_len = 0;
+	size_t i;
+
+	pthread_mutex_lock(&pool->mtx);
+	while (1) {
+		job = pool->jobs + (pool->written % pool->slots);
+		while (!pool->error && job->state != JOB_DONE
+				&& !(pool->eof && pool->written == pool->queued)) {
+			/* Finish writes while waiting for the next job */
+			if (pool->io && io_inflight(pool->io)) {
+				pthread_mutex_unlock(&pool->mtx);
+				i = (size_t)writer_reap(pool);
+				pthread_mutex_lock(&pool->mtx);
+				if (i != 0) pool_fail(pool);
+				continue;
+			}
+			pthread_cond_wait(&pool->done_cond, &pool->mtx);
+		}
+		if (pool->error || job->state != JOB_DONE) break;
+		/* The extra reference keeps the slot until the index has it */
+		if (pool->io) {
+			job->state = JOB_WRITING;
+			job->pending = 1;
+		}
+		pthread_mutex_unlock(&pool->mtx);
+
+		if (pool->io) {
+			i = (size_t)job->o_length;
+			if (tail_len || (writer_submit(pool, job, &tail_len) < 0)) i = 0;
+			if (tail_len) tail = job->out + job->o_length - tail_len;
+		} else if (pool->mode == 'd') i = write_out(job->out, (size_t)job->o_length);
+		else i = fwrite(job->out, 1, (size_t)job->o_length, files.out);
+		/* Jobs reach the writer in stream order, so it keeps the index */
+		if ((i == (size_t)job->o_length) && pool->index
+				&& (lzjody_index_add(pool->index, job->out,
+						(size_t)job->o_length, (uint64_t)job->length) < 0))
+			i = 0;
+
+		pthread_mutex_lock(&pool->mtx);
+		if (i != (size_t)job->o_length) {
+			fprintf(stderr, "Error writing file %s (%d of %d written)\n",
+					files.out_name, (int)i, job->o_length);
+			pool_fail(pool);
+			break;
+		}
+		pool->out_pos += (uint64_t)job->o_length;
+		if (pool->io) job->pending--;
+		if (!pool->io || (job->pending == 0)) {
+			job->state = JOB_FREE;
+			pthread_cond_signal(&pool->free_cond);
+		}
+		pool->written++;
+	}
+	pthread_mutex_unlock(&pool->mtx);
+
+	/* Every queued write must finish before the buffers go away */
+	if (pool->io) {
+		i = 0;
+		while (io_inflight(pool->io)) if (writer_reap(pool) < 0) i = 1;
+		pthread_mutex_lock(&pool->mtx);
+		if (!i && !pool->error && (writer_finish(pool, tail, tail_len) < 0)) {
+			fprintf(stderr, "Error writing file %s\n", files.out_name);
+			i = 1;
+		}
+		if (i) pool_fail(pool);
+		pthread_mutex_unlock(&pool->mtx);
+	}
+	return NULL;
+}
+
+static void pool_free(struct pool_t * const pool)
+{
+	if (pool->jobs) {
+		for (unsigned int i = 0; i < pool->slots; i++) {
+			free(pool->jobs[i].in);
+			free(pool->jobs[i].out);
+		}
+	}
+	free(pool->jobs);
+	free(pool->workers);
+	io_destroy(pool->io);
+	pthread_mutex_destroy(&pool->mtx);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->free_cond);
+	return;
+}
+
+/* Allocate job slots and start the worker and writer threads
+ * Worker contexts copy their settings from 'conf' */
+static int pool_start(struct pool_t * const pool, const int mode,
+		const unsigned int nworkers, const unsigned int chunk,
+		const struct lzjody_ctx * const conf, const size_t in_size,
+		const size_t out_size)
+{
+	unsigned int i;
+
+	memset(pool, 0, sizeof(struct pool_t));
+	pool->mode = mode;
+	pool->bsize = lzjody_ctx_block_size(conf);
+	pool->window = lzjody_ctx_window_size(conf);
+	pool->reset = lzjody_ctx_reset_interval(conf);
+	pool->dedup = lzjody_ctx_dedup(conf);
+	pool->dict = lzjody_ctx_dict(conf, &pool->dict_len);
+	pool->level = lzjody_ctx_level(conf);
+	pool->nworkers = nworkers;
+	pool->slots = nworkers * 2;
+	pool->chunk = chunk;
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	pthread_cond_init(&pool->free_cond, NULL);
+
+	pool->jobs = (struct job_t *)calloc(pool->slots, sizeof(struct job_t));
+	pool->workers = (pthread_t *)calloc(nworkers, sizeof(pthread_t));
+	if (!pool->jobs || !pool->workers) goto oom;
+	for (i = 0; i < pool->slots; i++) {
+		/* O_DIRECT transfers need aligned buffers */
+		if (files.in_direct || files.out_direct) {
+			if (posix_memalign((void **)&pool->jobs[i].in, IO_ALIGN, in_size) != 0
+					|| posix_memalign((void **)&pool->jobs[i].out, IO_ALIGN, out_size) != 0)
+				goto oom;
+			continue;
+		}
+		pool->jobs[i].in = (unsigned char *)malloc(in_size);
+		pool->jobs[i].out = (unsigned char *)malloc(out_size);
+		if (!pool->jobs[i].in || !pool->jobs[i].out) goto oom;
+	}
+
+	/* The engine writes after anything already written through stdio */
+	if (files.io && (files.out_fd >= 0)) {
+		if (fflush(files.out) != 0 || ftello(files.out) < 0) {
+			fprintf(stderr, "Error writing file %s\n", files.out_name);
+			pool_free(pool);
+			return -1;
+		}
+		pool->out_pos = (uint64_t)ftello(files.out);
+		pool->io = io_create(files.io, IO_DEPTH);
+		if (!pool->io) goto oom;
+	}
+
+	DLOG("lzjody: starting %u worker threads\n", nworkers);
+	for (pool->started = 0; pool->started < nworkers; pool->started++)
+		if (pthread_create(pool->workers + pool->started, NULL, worker_thread, pool) != 0)
+			break;
+	if (pool->started == 0 || pthread_create(&pool->writer, NULL, writer_thread, pool) != 0) {
+		pthread_mutex_lock(&pool->mtx);
+		pool_fail(pool);
+		pthread_mutex_unlock(&pool->mtx);
+		for (i = 0; i < pool->started; i++) pthread_join(pool->workers[i], NULL);
+		fprintf(stderr, "Error: cannot create threads\n");
+		pool_free(pool);
+		return -1;
+	}
+	return 0;
+
+oom:
+	fprintf(stderr, "Error: out of memory\n");
+	pool_free(pool);
+	return -1;
+}
+
+/* Wait for the next job slot to be released by the writer
+ * Returns NULL if any thread has failed */
+static struct job_t *pool_get_job(struct pool_t * const pool)
+{
+	struct job_t * const job = pool->jobs + (pool->queued % pool->slots);
+
+	pthread_mutex_lock(&pool->mtx);
+	while (!pool->error && job->state != JOB_FREE)
+		pthread_cond_wait(&pool->free_cond, &pool->mtx);
+	pthread_mutex_unlock(&pool->mtx);
+	if (pool->error) return NULL;
+	return job;
+}
+
+/* Hand a filled job slot to the workers */
+static void pool_submit(struct pool_t * const pool, struct job_t * const job)
+{
+	pthread_mutex_lock(&pool->mtx);
+	job->state = JOB_READY;
+	pool->queued++;
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mtx);
+	return;
+}
+
+/* Abort all threads from the reader side */
+static void pool_abort(struct pool_t * const pool)
+{
+	pthread_mutex_lock(&pool->mtx);
+	pool_fail(pool);
+	pthread_mutex_unlock(&pool->mtx);
+	return;
+}
+
+/* Let the workers and writer drain the queue, then tear down the pool */
+static int pool_finish(struct pool_t * const pool)
+{
+	int error;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->eof = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_cond_broadcast(&pool->done_cond);
+	pthread_mutex_unlock(&pool->mtx);
+	for (unsigned int i = 0; i < pool->started; i++)
+		pthread_join(pool->workers[i], NULL);
+	pthread_join(pool->writer, NULL);
+
+	error = pool->error;
+	pool_free(pool);
+	return error ? -1 : 0;
+}
+
+/* Fill jobs from the input file with up to IO_DEPTH engine reads in
+ * flight. Reads finish in any order but jobs are queued in file order. */
+static int io_read_jobs(struct pool_t * const pool, const size_t in_size)
+{
+	struct io_engine *io;
+	struct job_t *job;
+	struct stat st;
+	uint64_t size;
+	uint64_t pos = 0;	/* File offset of the next read */
+	unsigned int ahead = 0;	/* Jobs being read but not yet queued */
+	int state;
+	size_t len;
+	void *tag;
+	ssize_t res = 0;
+
+	if (fstat(files.in_fd, &st) != 0) goto error_read;
+	size = (uint64_t)st.st_size;
+	io = io_create(files.io, IO_DEPTH);
+	if (!io) {
+		fprintf(stderr, "Error: out of memory\n");
+		return -1;
+	}
+
+	while (1) {
+		/* Start reads into the free slots after the oldest job */
+		while ((pos < size) && (ahead < pool->slots) && (io_inflight(io) < IO_DEPTH)) {
+			if (ahead == 0) {
+				job = pool_get_job(pool);
+				if (!job) goto error_drain;
+			} else {
+				job = pool->jobs + ((pool->queued + ahead) % pool->slots);
+				pthread_mutex_lock(&pool->mtx);
+				state = job->state;
+				pthread_mutex_unlock(&pool->mtx);
+				if (state != JOB_FREE) break;
+			}
+			job->length = (int)(((size - pos) > in_size) ? in_size : (size - pos));
+			job->src = job->in;
+			job->loaded = 0;
+			len = (size_t)job->length;
+			if (files.in_direct) len = (len + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1);
+			if (io_read(io, files.in_fd, job->in, len, (size_t)job->length, pos, job) < 0)
+				goto error_drain;
+			pos += (uint64_t)job->length;
+			ahead++;
+		}
+		if (ahead == 0) break;
+
+		/* Queue the oldest job once its read is done */
+		job = pool->jobs + (pool->queued % pool->slots);
+		while (!job->loaded) {
+			if (io_wait(io, &tag, &res) < 0) goto error_drain;
+			if (res < ((struct job_t *)tag)->length) goto error_drain;
+			((struct job_t *)tag)->loaded = 1;
+		}
+		pool_submit(pool, job);
+		ahead--;
+	}
+	io_destroy(io);
+	return 0;
+
+error_drain:
+	/* The engine still owns the buffers of any reads in flight */
+	while (io_wait(io, &tag, &res) == 0) continue;
+	io_destroy(io);
+	if (pool->error) return -1;
+error_read:
+	fprintf(stderr, "Error reading file %s\n", files.in_name);
+	return -1;
+}
 
+/* Write the end marker, block index and footer of a seekable stream */
+static int index_finish(struct lzjody_index * const idx)
+{
+	unsigned char *buf;
+	size_t length = lzjody_index_size(idx);
+
+	buf = (unsigned char *)malloc(length);
+	if (!buf) goto error_mem;
+	length = lzjody_index_write(idx, buf);
+	if (fwrite(buf, 1, length, files.out) != length) goto error_write;
+	free(buf);
+	lzjody_index_free(idx);
 	return 0;
+
+error_mem:
+	fprintf(stderr, "Error: out of memory\n");
+	lzjody_index_free(idx);
+	return -1;
+error_write:
+	fprintf(stderr, "Error writing file %s (index)\n", files.out_name);
+	free(buf);
+	lzjody_index_free(idx);
+	return -1;
+}
+
+/* Compress the input with a pool of worker threads
+ * Output is identical to the single-threaded compressor */
+static int threaded_compress(const unsigned int nworkers,
+		const unsigned int chunk, const struct lzjody_ctx * const ctx,
+		const unsigned char options)
+{
+	struct pool_t pool;
+	struct job_t *job;
+	unsigned char header[LZJODY_HEADER_SIZE];
+	struct lzjody_index *idx = NULL;	/* Block index being written */
+	const unsigned int bsize = lzjody_ctx_block_size(ctx);
+	const size_t in_size = (size_t)bsize * chunk;
+	size_t length;
+	int i;
+
+	/* Seekable streams end with an index of the block offsets */
+	i = lzjody_header_write(ctx, header);
+	if (i > 0 && !fwrite(header, (size_t)i, 1, files.out)) goto error_write;
+	if (lzjody_ctx_seekable(ctx)) {
+		idx = lzjody_index_create(ctx, lzjody_index_default_bits(ctx), (uint64_t)i);
+		if (!idx) return -1;
+	}
+	if (pool_start(&pool, 'c', nworkers, chunk, ctx, in_size,
+				(size_t)lzjody_ctx_bound(ctx) * chunk) < 0)
+		goto error;
+	pool.options = options;
+	pool.index = idx;
+	if (files.io && (files.in_fd >= 0)) {
+		if (io_read_jobs(&pool, in_size) < 0) pool_abort(&pool);
+		goto finish;
+	}
+
+	/* Read jobs until EOF */
+	while ((job = pool_get_job(&pool))) {
+		job->src = in_read(job->in, in_size, &length);
+		if (ferror(files.in)) {
+			fprintf(stderr, "Error reading file %s\n", files.in_name);
+			pool_abort(&pool);
+			break;
+		}
+		if (length == 0) break;
+		job->length = (int)length;
+		pool_submit(&pool, job);
+		if (length < in_size) break;
+	}
+finish:
+	if (pool_finish(&pool) < 0) goto error;
+	return idx ? index_finish(idx) : 0;
+
+error_write:
+	fprintf(stderr, "Error writing file %s\n", files.out_name);
+	return -1;
+error:
+	lzjody_index_free(idx);
+	return -1;
+}
+
+/* Read the rest of the input after the end marker of a seekable
+ * stream at stream offset 'pos' and check that it is a whole index */
+static int index_tail(const struct lzjody_ctx * const ctx, const uint64_t pos)
+{
+	unsigned char buf[4096];
+	unsigned char footer[LZJODY_FOOTER_SIZE];
+	const unsigned char *p;
+	uint64_t tail = 0;	/* Bytes after the end marker */
+	size_t i;
+
+	while (1) {
+		p = in_read(buf, sizeof(buf), &i);
+		if (i == 0) break;
+		/* Keep the last LZJODY_FOOTER_SIZE bytes */
+		if (i >= LZJODY_FOOTER_SIZE) {
+			memcpy(footer, p + i - LZJODY_FOOTER_SIZE, LZJODY_FOOTER_SIZE);
+		} else {
+			memmove(footer, footer + i, LZJODY_FOOTER_SIZE - i);
+			memcpy(footer + LZJODY_FOOTER_SIZE - i, p, i);
+		}
+		tail += i;
+	}
+	if (ferror(files.in)) {
+		fprintf(stderr, "Error reading file %s\n", files.in_name);
+		return -1;
+	}
+	return lzjody_index_check(ctx, footer, pos, tail);
+}
+
+/* Decompress the input with a pool of worker threads
+ * The reader splits the stream on block length prefixes and hands
+ * batches of 'chunk' whole block records to the workers */
+static int threaded_decompress(const unsigned int nworkers,
+		const unsigned int chunk, struct lzjody_ctx * const ctx)
+{
+	struct pool_t pool;
+	struct job_t *job;
+	const unsigned int bsize = lzjody_ctx_block_size(ctx);
+	const int psize = (int)lzjody_ctx_prefix_size(ctx);
+	const int bound = (int)lzjody_ctx_bound(ctx);
+	const size_t rec_size = (size_t)bound + (size_t)psize;
+	unsigned char *rec;
+	const unsigned char *p;
+	unsigned int blocks;
+	unsigned int flags;
+	size_t i;
+	int length;
+	int end = 0;	/* Seekable stream end marker seen */
+	uint64_t pos = LZJODY_HEADER_SIZE;	/* Stream offset of the next record when seekable */
+
+	if (pool_start(&pool, 'd', nworkers, chunk, ctx, rec_size * chunk,
+				(size_t)bsize * chunk) < 0)
+		return -1;
+
+	while ((job = pool_get_job(&pool))) {
+		job->length = 0;
+		/* Mapped input records are used in place; they are contiguous */
+		job->src = files.map ? (files.map + files.map_pos) : job->in;
+		for (blocks = 0; blocks < chunk; blocks++) {
+			rec = job->in + job->length;
+			length = psize;
+			p = in_read(rec, (size_t)psize, &i);
+			if (i == 0) break;
+			if (i != (size_t)psize) goto error_shortread;
+			length = (int)lzjody_prefix_read(ctx, p, &flags);
+			if (length > bound) goto error_blocksize_d_prefix;
+			/* Zero-length blocks cannot be decompressed; in a
+			 * seekable stream one marks the start of the index */
+			if (length == 0) {
+				if (!lzjody_ctx_seekable(ctx)) goto error_zero;
+				pos += (uint64_t)psize;
+				end = 1;
+				break;
+			}
+
+			in_read(rec + psize, (size_t)length, &i);
+			if (ferror(files.in)) goto error_read;
+			if (i != (size_t)length) goto error_shortread;
+			job->length += length + psize;
+			pos += (uint64_t)length + (uint64_t)psize;
+		}
+		if (ferror(files.in)) goto error_read;
+		if (job->length == 0) break;
+		pool_submit(&pool, job);
+		if (end || (blocks < chunk)) break;
+	}
+	/* A seekable stream that ends without its end marker is cut short */
+	if (lzjody_ctx_seekable(ctx) && !end) goto error_index;
+	if (end && (index_tail(ctx, pos) < 0)) goto error_abort;
+	return pool_finish(&pool);
+
+error_read:
+	fprintf(stderr, "Error reading file %s\n", files.in_name);
+	goto error_abort;
+error_shortread:
+	fprintf(stderr, "Error: short read: %d < %d (eof %d, error %d)\n",
+			(int)i, length, feof(files.in), ferror(files.in));
+	goto error_abort;
+error_blocksize_d_prefix:
+	fprintf(stderr, "Error: decompressor prefix too large (%d > %d)\n",
+			length, bound);
+	goto error_abort;
+error_zero:
+	fprintf(stderr, "Error: zero-length block\n");
+	goto error_abort;
+error_index:
+	fprintf(stderr, "Error: seekable stream ends before its index\n");
+error_abort:
+	pool_abort(&pool);
+	pool_finish(&pool);
+	return -1;
 }
 #endif /* THREADED */
 
+/* Compress with the streaming API; whole blocks are compressed from
+ * the input straight into a large output buffer */
+static int stream_compress(struct lzjody_ctx * const ctx, const unsigned char options)
+{
+	struct lzjody_cstream *cs;
+	unsigned char *buf;
+	unsigned char *out;
+	const unsigned char *p;
+	const size_t out_size = OUT_BUFSIZE + lzjody_ctx_bound(ctx);
+	size_t got;
+	size_t pos;
+	size_t o;
+	int ret;
+
+	cs = lzjody_cstream_create(ctx, options);
+	buf = (unsigned char *)malloc(OUT_BUFSIZE);
+	out = (unsigned char *)malloc(out_size);
+	if (!cs || !buf || !out) goto error;
+	while ((p = in_read(buf, OUT_BUFSIZE, &got)), got) {
+		pos = 0;
+		do {
+			o = 0;
+			ret = lzjody_cstream_compress(cs, p, got, &pos, out, out_size, &o);
+			if (ret < 0) goto error;
+			if (fwrite(out, 1, o, files.out) != o) goto error_write;
+		} while (ret > 0);
+	}
+	if (ferror(files.in)) goto error_read;
+	do {
+		o = 0;
+		ret = lzjody_cstream_end(cs, out, out_size, &o);
+		if (ret < 0) goto error;
+		if (fwrite(out, 1, o, files.out) != o) goto error_write;
+	} while (ret > 0);
+	lzjody_cstream_free(cs);
+	free(buf);
+	free(out);
+	return 0;
+
+error_read:
+	fprintf(stderr, "Error reading file %s\n", files.in_name);
+	goto error;
+error_write:
+	fprintf(stderr, "Error writing file %s\n", files.out_name);
+error:
+	lzjody_cstream_free(cs);
+	free(buf);
+	free(out);
+	return -1;
+}
+
+/* Decompress with the streaming API; runs of blocks are decoded into
+ * one output buffer and written together */
+static int stream_decompress(struct lzjody_ctx * const ctx)
+{
+	struct lzjody_dstream *ds;
+	unsigned char *buf;
+	unsigned char *out;
+	const unsigned char *p;
+	size_t got;
+	size_t pos;
+	size_t o;
+	int ret;
+
+	ds = lzjody_dstream_create(ctx);
+	buf = (unsigned char *)malloc(OUT_BUFSIZE);
+	out = (unsigned char *)malloc(OUT_BUFSIZE);
+	if (!ds || !buf || !out) goto error;
+	while ((p = in_read(buf, OUT_BUFSIZE, &got)), got) {
+		pos = 0;
+		do {
+			o = 0;
+			ret = lzjody_dstream_decompress(ds, p, got, &pos, out, OUT_BUFSIZE, &o);
+			if (ret < 0) goto error;
+			if (write_out(out, o) != o) goto error_write;
+		} while (ret > 0);
+	}
+	if (ferror(files.in)) goto error_read;
+	if (lzjody_dstream_end(ds) < 0) goto error;
+	lzjody_dstream_free(ds);
+	free(buf);
+	free(out);
+	return 0;
+
+error_read:
+	fprintf(stderr, "Error reading file %s\n", files.in_name);
+	goto error;
+error_write:
+	fprintf(stderr, "Error writing file %s\n", files.out_name);
+error:
+	lzjody_dstream_free(ds);
+	free(buf);
+	free(out);
+	return -1;
+}
+
+#ifdef THREADED
+/* One thread's part of a range read */
+struct range_part {
+	struct lzjody_reader *r;
+	unsigned char *buf;
+	size_t length;
+	uint64_t offset;
+	ssize_t done;	/* lzjody_pread() result */
+	int started;	/* Running in its own thread */
+	pthread_t tid;
+};
+
+static void *range_thread(void *arg)
+{
+	struct range_part * const p = (struct range_part *)arg;
+
+	p->done = lzjody_pread(p->r, p->buf, p->length, p->offset);
+	return NULL;
+}
+#endif
+
+/* lzjody_pread() with the read split between up to 'nthreads' threads
+ * that share the reader */
+static ssize_t range_pread(struct lzjody_reader * const r, unsigned char * const buf,
+		const size_t length, const uint64_t offset, unsigned int nthreads)
+{
+#ifdef THREADED
+	struct range_part part[RANGE_THREADS];
+	struct range_part *p;
+	size_t piece;
+	ssize_t done = 0;
+	unsigned int n;
+	unsigned int i;
+
+	if (nthreads > RANGE_THREADS) nthreads = RANGE_THREADS;
+	if (nthreads < 2) return lzjody_pread(r, buf, length, offset);
+	piece = (length + nthreads - 1) / nthreads;
+	for (n = 0; (n < nthreads) && ((n * piece) < length); n++) {
+		p = part + n;
+		p->r = r;
+		p->buf = buf + (n * piece);
+		p->offset = offset + (n * piece);
+		p->length = ((length - (n * piece)) < piece) ? (length - (n * piece)) : piece;
+		p->started = (pthread_create(&p->tid, NULL, range_thread, p) == 0);
+		if (!p->started) range_thread(p);
+	}
+	for (i = 0; i < n; i++)
+		if (part[i].started) pthread_join(part[i].tid, NULL);
+	/* Parts past a short one are past the end of the stream */
+	for (i = 0; i < n; i++) {
+		if (part[i].done < 0) return -1;
+		done += part[i].done;
+		if ((size_t)part[i].done < part[i].length) break;
+	}
+	return done;
+#else
+	(void)nthreads;
+	return lzjody_pread(r, buf, length, offset);
+#endif
+}
+
+/* Decompress 'range' bytes starting at uncompressed 'offset' from a
+ * seekable stream on stdin, which must be a regular file */
+static int range_read(const struct lzjody_ctx * const ctx, uint64_t offset,
+		uint64_t range, const unsigned int nthreads)
+{
+	struct lzjody_reader *r;
+	const unsigned char *dict;
+	unsigned int dict_len;
+	unsigned char *buf;
+	size_t length;
+	ssize_t i;
+
+	dict = lzjody_ctx_dict(ctx, &dict_len);
+	buf = (unsigned char *)malloc(RANGE_BYTES);
+	if (!buf) goto error_mem;
+	/* Reads are sequential, so a large cache would not help */
+	r = lzjody_reader_open(fileno(files.in), dict, dict_len, RANGE_BYTES);
+	if (!r) goto error_open;
+	while (range) {
+		length = (range < RANGE_BYTES) ? (size_t)range : RANGE_BYTES;
+		i = range_pread(r, buf, length, offset, nthreads);
+		if (i < 0) goto error_read;
+		if (i == 0) break;
+		if (write_out(buf, (size_t)i) != (size_t)i) goto error_write;
+		offset += (uint64_t)i;
+		range -= (uint64_t)i;
+	}
+	lzjody_reader_close(r);
+	free(buf);
+	return 0;
+
+error_mem:
+	fprintf(stderr, "Error: out of memory\n");
+	return -1;
+error_open:
+	fprintf(stderr, "Error: -O needs a seekable stream in a file\n");
+	free(buf);
+	return -1;
+error_read:
+	fprintf(stderr, "Error: cannot decompress at offset %ju\n", (uintmax_t)offset);
+	goto error_close;
+error_write:
+	fprintf(stderr, "Error writing file %s\n", files.out_name);
+error_close:
+	lzjody_reader_close(r);
+	free(buf);
+	return -1;
+}
+
+/* Parse a block size with an optional K or M suffix */
+static long parse_size(const char * const arg)
+{
+	char *end;
+	long size = strtol(arg, &end, 10);
+
+	if (*end == 'k' || *end == 'K') {
+		size <<= 10;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size <<= 20;
+		end++;
+	}
+	if (*end != '\0') return -1;
+	return size;
+}
+
+/* Append a whole file to a buffer, growing it as needed */
+static int read_file(const char * const name, unsigned char ** const buf,
+		size_t * const length)
+{
+	FILE *fp;
+	unsigned char *p;
+	size_t size = *length + 0x10000;
+	size_t i;
+
+	fp = fopen(name, "rb");
+	if (!fp) goto error_open;
+	while (1) {
+		p = (unsigned char *)realloc(*buf, size);
+		if (!p) goto error_mem;
+		*buf = p;
+		i = fread(*buf + *length, 1, size - *length, fp);
+		*length += i;
+		if (ferror(fp)) goto error_read;
+		if (*length < size) break;
+		size *= 2;
+	}
+	fclose(fp);
+	return 0;
+
+error_open:
+	fprintf(stderr, "Error opening file %s\n", name);
+	return -1;
+error_mem:
+	fprintf(stderr, "Error: out of memory reading %s\n", name);
+	fclose(fp);
+	return -1;
+error_read:
+	fprintf(stderr, "Error reading file %s\n", name);
+	fclose(fp);
+	return -1;
+}
+
+/* Build a dictionary from sample files and write it to stdout */
+static int train_dict(char ** const names, const int count,
+		const unsigned int size)
+{
+	unsigned char *samples = NULL;
+	unsigned char *dict;
+	size_t length = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (read_file(names[i], &samples, &length) < 0) goto error;
+	if (length > 0xffffffffU) goto error_large;
+	dict = (unsigned char *)malloc(size);
+	if (!dict) goto error;
+	i = lzjody_train_dict(samples, (unsigned int)length, dict, size);
+	free(samples);
+	if (i < 0) {
+		free(dict);
+		return -1;
+	}
+	if (i > 0 && !fwrite(dict, (size_t)i, 1, stdout)) {
+		fprintf(stderr, "Error writing file %s\n", "stdout");
+		i = -1;
+	}
+	free(dict);
+	return (i < 0) ? -1 : 0;
+
+error_large:
+	fprintf(stderr, "Error: too much sample data\n");
+error:
+	free(samples);
+	return -1;
+}
+
+/* Open an -i/-o file again for the I/O engine; only regular files can
+ * take positional reads and writes. If *want_direct is set, O_DIRECT
+ * is tried first and *direct tells whether it worked. Returns -1 to
+ * leave the file to stdio. */
+static int io_open(const char * const name, const int flags,
+		int * const want_direct, int * const direct)
+{
+	struct stat st;
+	int fd = -1;
+
+	if (want_direct && *want_direct) {
+		fd = open(name, flags | O_DIRECT);
+		if (fd < 0) fprintf(stderr, "warning: %s: no direct I/O, using the page cache\n", name);
+		else *direct = 1;
+	}
+	if (fd < 0) fd = open(name, flags);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		*direct = 0;
+		return -1;
+	}
+	return fd;
+}
+
 int main(int argc, char **argv)
 {
-	static unsigned char blk[LZJODY_BSIZE];
-	static unsigned char out[LZJODY_BSIZE + 4];
+	static const struct option long_opts[] = {
+		{ "train", no_argument, NULL, 't' },
+		{ "io", required_argument, NULL, 'I' },
+		{ "direct", no_argument, NULL, 'U' },
+		{ NULL, 0, NULL, 0 }
+	};
+	static struct lzjody_ctx *ctx;
+	static unsigned char header[LZJODY_HEADER_SIZE];
+	unsigned char *dict = NULL;	/* Preset dictionary */
+	size_t dict_len = 0;
+	long dict_size = DICT_SIZE;	/* Size of a dictionary to train */
 	int i;
 	int length = 0;	/* Incoming data block length counter */
-	int c_length;   /* Compressed block length temp variable */
-	int blocknum = 0;	/* Current block number */
 	unsigned char options = 0;	/* Compressor options */
+	int mode = 0;	/* 'c' = compress, 'd' = decompress, 't' = train */
+	long nthreads = 1;	/* Number of worker threads */
+	int threaded = 0;	/* Use the worker pool */
+	long chunk = 0;	/* Blocks per thread job */
+	long bsize = LZJODY_BSIZE;	/* Compressor block size */
+	long window = 0;	/* Streaming mode window size */
+	long reset = 0;	/* Blocks between window reset points */
+	int level = LZJODY_DEFAULT_LEVEL;	/* Compression level */
+	int dedup = 0;	/* Deduplicate repeated blocks */
+	int seekable = 0;	/* Write a block index */
+	int ranged = 0;	/* Decompress only part of the stream */
+	uint64_t r_offset = 0;	/* Start of the part to decompress */
+	uint64_t r_length = UINT64_MAX;	/* Length of the part to decompress */
+	char *endp;
+	const char *in_name = NULL;	/* Input file (-i) */
+	const char *out_name = NULL;	/* Output file (-o) */
+	int io = IO_NONE;	/* I/O engine for -i/-o files (--io) */
+	int direct = 0;	/* Bypass the page cache (--direct) */
+	const unsigned char *p;
+	size_t got;
+	int opt;
+
+	if (argc < 2) goto usage;
+
 #ifdef THREADED
-	struct thread_info *thr;
-	int nprocs = 1;		/* Number of processors */
-	int eof = 0;	/* End of file? */
-	char running = 0;	/* Number of threads running */
+ #ifdef _SC_NPROCESSORS_ONLN
+	/* Default to one worker thread per online processor */
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) nthreads = 1;
+ #endif /* _SC_NPROCESSORS_ONLN */
 #endif /* THREADED */
 
-	if (argc < 2) goto usage;
+	while ((opt = getopt_long(argc, argv, "cdpAX0123456789B:W:R:D:S:T:C:O:L:i:o:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+		case 'd':
+		case 't':
+			mode = opt;
+			break;
+		case 'D':
+			if (read_file(optarg, &dict, &dict_len) < 0) exit(EXIT_FAILURE);
+			if (dict_len > LZJODY_MAX_LBSIZE) goto usage;
+			break;
+		case 'S':
+			dict_size = parse_size(optarg);
+			if (dict_size < 64 || dict_size > LZJODY_MAX_LBSIZE) goto usage;
+			break;
+		case 'p':
+			options |= O_ALL_PLANES;
+			break;
+		case 'X':
+			dedup = 1;
+			break;
+		case 'A':
+			seekable = 1;
+			break;
+		case 'i':
+			in_name = optarg;
+			break;
+		case 'o':
+			out_name = optarg;
+			break;
+		case 'I':
+			if (strcmp(optarg, "uring") == 0) io = IO_URING;
+			else if (strcmp(optarg, "threads") == 0) io = IO_THREADS;
+			else if (strcmp(optarg, "off") == 0) io = IO_NONE;
+			else goto usage;
+			break;
+		case 'U':
+			direct = 1;
+			break;
+		case 'O':
+			r_offset = strtoull(optarg, &endp, 10);
+			if (*endp || !*optarg) goto usage;
+			ranged = 1;
+			break;
+		case 'L':
+			r_length = strtoull(optarg, &endp, 10);
+			if (*endp || !*optarg) goto usage;
+			ranged = 1;
+			break;
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			level = opt - '0';
+			break;
+		case 'B':
+			bsize = parse_size(optarg);
+			if (bsize != LZJODY_BSIZE && (bsize < LZJODY_MIN_LBSIZE
+					|| bsize > LZJODY_MAX_LBSIZE
+					|| (bsize & (bsize - 1)))) goto usage;
+			break;
+		case 'W':
+			window = parse_size(optarg);
+			if (window < 0) goto usage;
+			break;
+		case 'R':
+			reset = strtol(optarg, &endp, 10);
+			if (*endp || !*optarg) goto usage;
+			if (reset < 1) goto usage;
+			break;
+		case 'T':
+			nthreads = strtol(optarg, &endp, 10);
+			if (*endp || !*optarg) goto usage;
+			if (nthreads < 1 || nthreads > 1024) goto usage;
+			break;
+		case 'C':
+			chunk = strtol(optarg, &endp, 10);
+			if (*endp || !*optarg) goto usage;
+			if (chunk < 1 || chunk > 65536) goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (mode == 't') {
+		if (optind == argc) goto usage;
+		if (train_dict(argv + optind, argc - optind, (unsigned int)dict_size) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	if (mode == 0 || optind != argc) goto usage;
+	if (ranged && mode != 'd') goto usage;
+#ifndef THREADED
+	if (nthreads > 1) fprintf(stderr, "warning: built without threads, ignoring -T\n");
+	if (io != IO_NONE) fprintf(stderr, "warning: built without threads, ignoring --io\n");
+	io = IO_NONE;
+	direct = 0;
+#endif
+	if (direct && io == IO_NONE) goto usage;
 
 	/* Windows requires that data streams be put into binary mode */
 #ifdef ON_WINDOWS
@@ -97,223 +1370,179 @@ int main(int argc, char **argv)
 
 	files.in = stdin;
 	files.out = stdout;
+	files.in_name = "stdin";
+	files.out_name = "stdout";
+	files.in_fd = -1;
+	files.out_fd = -1;
+	if (ranged) io = IO_NONE;
+	if (in_name) {
+		files.in = fopen(in_name, "rb");
+		if (!files.in) goto error_open;
+		files.in_name = in_name;
+		/* Compressed input is small next to the output; keep it mapped */
+		if (io && mode == 'c') files.in_fd = io_open(in_name, O_RDONLY, &direct, &files.in_direct);
+		if (!ranged && files.in_fd < 0) in_map();
+	}
+	if (out_name) {
+		files.out = fopen(out_name, "wb");
+		if (!files.out) goto error_open;
+		files.out_name = out_name;
+		if (io) files.out_fd = io_open(out_name, O_WRONLY,
+				(mode == 'd') ? &direct : NULL, &files.out_direct);
+	}
+	if (files.in_fd >= 0 || files.out_fd >= 0) files.io = io;
+#ifdef THREADED
+	/* The I/O engines are driven by the thread pool */
+	threaded = (nthreads > 1) || files.io;
+#endif
+	/* Write in large pieces; this costs nothing even on a pipe */
+	setvbuf(files.out, NULL, _IOFBF, OUT_BUFSIZE);
 
-	if (!strncmp(argv[1], "-c", 2)) {
-#ifndef THREADED
-		/* Non-threaded compression */
-		/* fprintf(stderr, "blk %p, blkend %p, files %p\n",
-				blk, blk + LZJODY_BSIZE - 1, files); */
-		while((length = fread(blk, 1, LZJODY_BSIZE, files.in))) {
-			if (ferror(files.in)) goto error_read;
-			DLOG("\n--- Compressing block %d\n", blocknum);
-			i = lzjody_compress(blk, out, options, length);
-			if (i < 0) goto error_compression;
-			DLOG("c_size %d bytes\n", i);
-			i = fwrite(out, i, 1, files.out);
-			if (!i) goto error_write;
-			blocknum++;
-		}
+	ctx = lzjody_ctx_create();
+	if (!ctx) goto error_mem;
+	lzjody_ctx_set_level(ctx, level);
+	if (dict && (lzjody_ctx_set_dict(ctx, dict, (unsigned int)dict_len) < 0)) goto usage;
+	free(dict);
 
-#else /* Using POSIX threads */
+	/* The reader finds the header and index itself */
+	if (ranged) {
+		sparse_init();
+		if (range_read(ctx, r_offset, r_length, (unsigned int)nthreads) < 0)
+			goto error_decompression;
+		if (sparse_finish() < 0) goto error_sparse;
+		goto done;
+	}
 
- #ifdef _SC_NPROCESSORS_ONLN
-		/* Get number of online processors for pthreads */
-		nprocs = (int)sysconf(_SC_NPROCESSORS_ONLN);
-		if (nprocs < 1) {
-			fprintf(stderr, "warning: system returned bad number of processors: %d\n", nprocs);
-			nprocs = 1;
+	/* Large block and dictionary streams start with a header; the
+	 * single-threaded stream decompressor reads it itself */
+	if (mode == 'd' && threaded) {
+		i = in_peek();
+		if (i == EOF) {
+			if (ferror(files.in)) goto error_read;
+			goto done;
 		}
- #endif /* _SC_NPROCESSORS_ONLN */
-		/* Run two threads per processor */
-		nprocs <<= 1;
-		fprintf(stderr, "lzjody: compressing with %d worker threads\n", nprocs);
-
-		/* Allocate per-thread input/output memory and control blocks */
-		thr = (struct thread_info *)calloc(nprocs, sizeof(struct thread_info));
-		if (!thr) goto oom;
-
-		/* Set compressor options */
-		for (i = 0; i < nprocs; i++) (thr + i)->options = options;
-
-		thread_error = 0;
-		while (1) {
-			struct thread_info *cur = NULL;
-			uint32_t min_blk;	/* Minimum block number */
-			unsigned int min_thread;	/* Thread for min_blk */
-			int thread;	/* Temporary thread scan counter */
-			int open_thr;	/* Next open thread */
-
-			/* See if lowest block number is finished */
-			while (1) {
-				min_blk = 0xffffffff;
-				min_thread = 0;
-				/* Scan threads for smallest block number */
-				pthread_mutex_lock(&mtx);
-				for (thread = 0; thread < nprocs; thread++) {
-					unsigned int j;
-
-				fprintf(stderr, ":thr %p, thread %d\n",
-						(void *)thr, thread);
-					if (thread_error != 0) goto error_compression;
-					j = (thr + thread)->block;
-					if (j > 0 && j < min_blk) {
-						min_blk = j;
-						min_thread = thread;
-				fprintf(stderr, ":j%d:%d thr %p, cur %p, min_thread %d\n",
-						j, min_blk, (void *)thr, (void *)cur, min_thread);
-					}
-				}
-				pthread_mutex_unlock(&mtx);
-
-				cur = thr + min_thread;
-				fprintf(stderr, "thr %p, cur %p, min_thread %d\n",
-						(void *)thr, (void *)cur, min_thread);
-				if (cur->working == 0 && cur->length > 0) {
-					pthread_detach(cur->id);
-					/* flush finished block */
-					i = fwrite(cur->out, cur->o_length, 1, files.out);
-					if (!i) goto error_write;
-					cur->block = 0;
-					cur->length = 0;
-					DLOG("Thread %d done\n", min_thread);
-					running--;
-				} else break;
-			}
+		if (i == LZJODY_MAGIC) {
+			length = LZJODY_HEADER_SIZE;
+			p = in_read(header, LZJODY_HEADER_SIZE, &got);
+			i = (int)got;
+			if (i != LZJODY_HEADER_SIZE) goto error_shortread;
+			if (lzjody_header_read(ctx, p) < 0) goto error_decompression;
+		} else lzjody_ctx_set_dict(ctx, NULL, 0);
+	} else if (mode == 'c') {
+		if (lzjody_ctx_set_block_size(ctx, (unsigned int)bsize) < 0) goto usage;
+		/* Default to a reset point about every RESET_BYTES of input */
+		if (reset == 0) reset = (RESET_BYTES / bsize) ? (RESET_BYTES / bsize) : 1;
+		if (lzjody_ctx_set_window(ctx, (unsigned int)window, (unsigned int)reset) < 0)
+			goto usage;
+		/* Dedup references reach back to the last reset point */
+		if (dedup && reset > (LZJODY_MAX_DEDUP / bsize)) reset = LZJODY_MAX_DEDUP / bsize;
+		if (dedup && (lzjody_ctx_set_dedup(ctx, (unsigned int)reset) < 0)) goto usage;
+		lzjody_ctx_set_seekable(ctx, seekable);
+	}
+	bsize = lzjody_ctx_block_size(ctx);
 
-			/* Terminate when all blocks are written */
-			if (eof && (running == 0)) break;
-
-			/* Start threads */
-			if (running < nprocs) {
-				/* Don't read any more if EOF reached */
-				if (!eof) {
-					/* Find next open thread */
-					cur = thr;
-					for (open_thr = 0; open_thr < nprocs; open_thr++) {
-						if (cur->working == 0 && cur->block == 0) break;
-						cur++;
-					}
-
-					/* If no threads are available, wait for one */
-					if (open_thr == nprocs) {
-						pthread_mutex_lock(&mtx);
-						pthread_cond_wait(&cond, &mtx);
-						pthread_mutex_unlock(&mtx);
-						continue;
-					}
-
-					/* Read next block */
-					length = fread(cur->blk, 1, (LZJODY_BSIZE * CHUNK), files.in);
-					if (ferror(files.in)) goto error_read;
-					if (length < (LZJODY_BSIZE * CHUNK)) eof = 1;
-					if (length > 0) {
-						blocknum++;
-
-						/* Set up thread */
-						cur->working = 1;
-						cur->block = blocknum;
-						cur->length = length;
-						cur->o_length = 0;
-						running++;
-						DLOG("Thread %d start\n", open_thr);
-
-						/* Start thread */
-						pthread_create(&(cur->id), NULL,
-								compress_thread,
-								(void *)cur);
-					} else eof = 1;
-				} else if (running > 0) {
-					/* EOF but threads still running */
-					pthread_mutex_lock(&mtx);
-					pthread_cond_wait(&cond, &mtx);
-					pthread_mutex_unlock(&mtx);
-				}
-			}
+	/* Default to roughly 1 MiB of input per thread job */
+	if (chunk == 0) {
+		chunk = (long)CHUNK * LZJODY_BSIZE / bsize;
+		if (chunk < 1) chunk = 1;
+	}
+	/* Thread jobs must start at window reset points */
+	reset = lzjody_ctx_reset_interval(ctx);
+	if (reset > 1) chunk = ((chunk + reset - 1) / reset) * reset;
+
+	if (mode == 'c') {
+#ifdef THREADED
+		if (threaded) {
+			if (threaded_compress((unsigned int)nthreads, (unsigned int)chunk,
+						ctx, options) < 0)
+				goto error_compression;
+			goto done;
 		}
-		free(thr);
 #endif /* THREADED */
+		if (stream_compress(ctx, options) < 0) goto error_compression;
 	}
 
 	/* Decompress */
-	if (!strncmp(argv[1], "-d", 2)) {
-		while(fread(blk, 1, 2, files.in)) {
-			/* Get block-level decompression options */
-			options = *blk & 0xc0;
-
-			/* Read the length of the compressed data */
-			length = *(blk + 1);
-			length |= ((*blk & 0x1f) << 8);
-			if (length > (LZJODY_BSIZE + 4)) goto error_blocksize_d_prefix;
-
-			i = fread(blk, 1, length, files.in);
-			if (ferror(files.in)) goto error_read;
-			if (i != length) goto error_shortread;
-
-			if (options & O_NOCOMPRESS) {
-				c_length = *(blk + 1);
-				c_length |= ((*blk & 0x1f) << 8);
-				DLOG("--- Writing uncompressed block %d (%d bytes)\n", blocknum, c_length);
-				if (c_length > LZJODY_BSIZE) goto error_unc_length;
-				i = fwrite((blk + 2), 1, c_length, files.out);
-				if (i != c_length) {
-					length = c_length;
-					goto error_write;
-				}
-			} else {
-				DLOG("--- Decompressing block %d\n", blocknum);
-				length = lzjody_decompress(blk, out, i, options);
-				if (length < 0) goto error_decompress;
-				if (length > LZJODY_BSIZE) goto error_blocksize_decomp;
-				i = fwrite(out, 1, length, files.out);
-				if (i != length) goto error_write;
- /*			     DLOG("Wrote %d bytes\n", i); */
-			}
-
-
-			blocknum++;
+	if (mode == 'd') {
+		sparse_init();
+#ifdef THREADED
+		if (threaded) {
+			if (threaded_decompress((unsigned int)nthreads, (unsigned int)chunk, ctx) < 0)
+				goto error_decompression;
+			if (sparse_finish() < 0) goto error_sparse;
+			goto done;
 		}
+#endif /* THREADED */
+		if (stream_decompress(ctx) < 0) goto error_decompression;
+		if (sparse_finish() < 0) goto error_sparse;
 	}
 
+done:
+	/* Buffered output may fail only now, e.g. on a full disk */
+	if (fflush(files.out) != 0) goto error_flush;
 	exit(EXIT_SUCCESS);
 
+error_open:
+	fprintf(stderr, "Error: cannot open %s\n", files.in ? out_name : in_name);
+	exit(EXIT_FAILURE);
+error_flush:
+	fprintf(stderr, "Error writing file %s\n", files.out_name);
+	exit(EXIT_FAILURE);
+error_mem:
+	fprintf(stderr, "Error: out of memory\n");
+	exit(EXIT_FAILURE);
 error_compression:
 	fprintf(stderr, "Fatal error during compression, aborting.\n");
 	exit(EXIT_FAILURE);
+error_decompression:
+	fprintf(stderr, "Fatal error during decompression, aborting.\n");
+	exit(EXIT_FAILURE);
 error_read:
-	fprintf(stderr, "Error reading file %s\n", "stdin");
+	fprintf(stderr, "Error reading file %s\n", files.in_name);
 	exit(EXIT_FAILURE);
-error_write:
-	fprintf(stderr, "Error writing file %s (%d of %d written)\n", "stdout",
-			i, length);
+error_sparse:
+	fprintf(stderr, "Error writing file %s (cannot extend over a hole)\n", files.out_name);
 	exit(EXIT_FAILURE);
 error_shortread:
 	fprintf(stderr, "Error: short read: %d < %d (eof %d, error %d)\n",
 			i, length, feof(files.in), ferror(files.in));
 	exit(EXIT_FAILURE);
-error_unc_length:
-	fprintf(stderr, "Error: uncompressed length too large (%d > %d)\n",
-			c_length, LZJODY_BSIZE);
-	exit(EXIT_FAILURE);
-error_blocksize_d_prefix:
-	fprintf(stderr, "Error: decompressor prefix too large (%d > %d)\n",
-			length, (LZJODY_BSIZE + 4));
-	exit(EXIT_FAILURE);
-error_blocksize_decomp:
-	fprintf(stderr, "Error: decompressor overflow (%d > %d)\n",
-			length, LZJODY_BSIZE);
-	exit(EXIT_FAILURE);
-error_decompress:
-	fprintf(stderr, "Error: cannot decompress block %d\n", blocknum);
-	exit(EXIT_FAILURE);
-#ifdef THREADED
-oom:
-	fprintf(stderr, "Error: out of memory\n");
-	exit(EXIT_FAILURE);
-#endif
 usage:
 	fprintf(stderr, "lzjody %s, a compression utility by Jody Bruchon (%s)\n",
 			LZJODY_UTIL_VER, LZJODY_UTIL_VERDATE);
 	fprintf(stderr, "\nlzjody -c   compress stdin to stdout\n");
 	fprintf(stderr, "\nlzjody -d   decompress stdin to stdout\n");
+	fprintf(stderr, "\nOptions:\n");
+	fprintf(stderr, "  -i file     read this file instead of stdin (mapped into memory)\n");
+	fprintf(stderr, "  -o file     write this file instead of stdout\n");
+	fprintf(stderr, "  -0 ... -9   compression level: 0 is fastest, 9 compresses best (default: %d)\n",
+			LZJODY_DEFAULT_LEVEL);
+	fprintf(stderr, "  -p          also try 2, 8 and 16 byte planes when compressing\n");
+	fprintf(stderr, "              (older lzjody versions cannot decompress the output)\n");
+	fprintf(stderr, "  -B size     block size: 4K (default) or a power of two from\n");
+	fprintf(stderr, "              64K to 1M; large blocks are detected when decompressing\n");
+	fprintf(stderr, "  -W size     streaming mode: LZ matches may reach this far into\n");
+	fprintf(stderr, "              earlier blocks (1 to 15 blocks, at most 1M with the block)\n");
+	fprintf(stderr, "  -R blocks   streaming mode reset point interval, a power of two\n");
+	fprintf(stderr, "              (default: every %dM of input)\n", RESET_BYTES >> 20);
+	fprintf(stderr, "  -D file     use a preset dictionary (needed again to decompress)\n");
+	fprintf(stderr, "  -X          store blocks repeated since the last reset point as\n");
+	fprintf(stderr, "              references (needs up to -R blocks of memory to decompress)\n");
+	fprintf(stderr, "  -A          seekable output: end the stream with a block index\n");
+	fprintf(stderr, "  -O offset   with -d: decompress from this uncompressed offset of a\n");
+	fprintf(stderr, "              seekable stream; the input must be a file\n");
+	fprintf(stderr, "  -L length   with -d: decompress at most this many bytes (default: all)\n");
+#ifdef THREADED
+	fprintf(stderr, "  -T threads  number of worker threads (default: one per CPU)\n");
+	fprintf(stderr, "  -C blocks   blocks per thread job (default: %d for 4K blocks)\n",
+			CHUNK);
+	fprintf(stderr, "  --io=engine read and write -i/-o files with %d requests in flight:\n",
+			IO_DEPTH);
+	fprintf(stderr, "              uring (io_uring), threads (helper threads) or off (default)\n");
+	fprintf(stderr, "  --direct    with --io: bypass the page cache for uncompressed data\n");
+#endif
+	fprintf(stderr, "\nlzjody --train [-S size] files...\n");
+	fprintf(stderr, "            build a dictionary from sample files and write it to stdout\n");
+	fprintf(stderr, "  -S size     dictionary size (default: %dK)\n", DICT_SIZE >> 10);
 	exit(EXIT_FAILURE);
 }
@@ -9,6 +9,7 @@
 #define LZJODY_UTIL_H
 
 #include <lzjody.h>
+#include "lzjody_io.h"
 
 #define LZJODY_UTIL_VER "0.1"
 #define LZJODY_UTIL_VERDATE "2014-12-29"
@@ -28,22 +29,93 @@
 struct files_t {
 	FILE *in;
 	FILE *out;
+	const char *in_name;	/* For error messages */
+	const char *out_name;
+	const unsigned char *map;	/* Input file mapping (-i), or NULL */
+	size_t map_size;
+	size_t map_pos;	/* Next input byte in the mapping */
+	int io;	/* I/O engine for -i/-o files with threads (IO_xxx) */
+	int in_fd;	/* Engine input descriptor, or -1 */
+	int out_fd;	/* Engine output descriptor, or -1 */
+	int in_direct;	/* in_fd/out_fd use O_DIRECT */
+	int out_direct;
+	int sparse;	/* Output is a regular file; zeros become holes */
+	off_t hole;	/* Zero bytes skipped but not yet seeked over */
+	off_t size;	/* Size of the output file before writing */
 };
 
-/* Number of LZJODY_BSIZE blocks to process per thread */
-#define CHUNK 1024
+/* Output buffer size; writes reach the file in pieces this large */
+#define OUT_BUFSIZE 0x100000
+
+/* Zero runs this long and aligned to it are written as holes */
+#define SPARSE_SIZE 4096
+
+/* Default number of LZJODY_BSIZE blocks to process per job */
+#define CHUNK 256
+
+/* Default spacing of streaming mode reset points in bytes */
+#define RESET_BYTES 0x400000
+
+/* Bytes per read when decompressing part of a stream (-O / -L) */
+#define RANGE_BYTES 0x100000
+
+/* Most threads one -O / -L read is split between */
+#define RANGE_THREADS 16
+
+/* Default size of a trained dictionary */
+#define DICT_SIZE 0x10000
 
 #ifdef THREADED
-/* Per-thread working state */
-struct thread_info {
-	unsigned char blk[LZJODY_BSIZE * CHUNK];	/* Thread input blocks */
-	unsigned char out[(LZJODY_BSIZE + 4) * CHUNK];	/* Thread output blocks */
-	char options;	/* Compressor options */
-	pthread_t id;	/* Thread ID */
-	int block;	/* What block is thread working on? */
-	int length;	/* Total bytes in block */
-	int o_length;	/* Output length */
-	int working;	/* Is thread working (1) or idle (0)? */
+/* Job slot states */
+#define JOB_FREE 0	/* Slot can be filled by the reader */
+#define JOB_READY 1	/* Slot is queued or being worked on */
+#define JOB_DONE 2	/* Slot is waiting for the writer */
+#define JOB_WRITING 3	/* Slot is being written by the I/O engine */
+
+/* One unit of work; a job holds 'chunk' blocks */
+struct job_t {
+	unsigned char *in;	/* Job input buffer */
+	const unsigned char *src;	/* Job input blocks: 'in' or the input mapping */
+	unsigned char *out;	/* Job output blocks */
+	int length;	/* Total bytes in 'in' */
+	int o_length;	/* Total bytes in 'out' */
+	int state;	/* JOB_xxx */
+	int pending;	/* I/O engine writes not finished */
+	int loaded;	/* I/O engine read finished */
+};
+
+/* Fixed worker pool fed through a ring of job slots
+ * Job N always lives in slot (N % slots), so the ring doubles as the
+ * reorder buffer that keeps the writer in input order. */
+struct pool_t {
+	struct job_t *jobs;	/* Job slot ring */
+	pthread_t *workers;	/* Worker thread IDs */
+	pthread_t writer;	/* Output thread ID */
+	unsigned int nworkers;	/* Number of worker threads */
+	unsigned int started;	/* Worker threads actually running */
+	unsigned int slots;	/* Number of job slots */
+	unsigned int chunk;	/* Blocks per job */
+	unsigned int bsize;	/* Block size */
+	unsigned int window;	/* Streaming mode window size */
+	unsigned int reset;	/* Blocks between window reset points */
+	unsigned int dedup;	/* Dedup cache size in blocks */
+	struct lzjody_index *index;	/* Block index for seekable output */
+	const unsigned char *dict;	/* Preset dictionary */
+	unsigned int dict_len;
+	int level;	/* Compression level */
+	uintmax_t queued;	/* Jobs submitted by the reader */
+	uintmax_t claimed;	/* Jobs taken by workers */
+	uintmax_t written;	/* Jobs flushed by the writer */
+	int eof;	/* Reader is finished */
+	int error;	/* Nonzero if any thread fails */
+	unsigned char options;	/* Compressor options */
+	int mode;	/* 'c' = compress, 'd' = decompress */
+	struct io_engine *io;	/* Output engine, or NULL for stdio */
+	uint64_t out_pos;	/* Output file offset of the next job */
+	pthread_mutex_t mtx;
+	pthread_cond_t work_cond;	/* A job was queued */
+	pthread_cond_t done_cond;	/* A job was finished */
+	pthread_cond_t free_cond;	/* A job slot was released */
 };
 #endif /* THREADED */
 
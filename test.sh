@@ -32,6 +32,173 @@ S1="$(sha1sum $IN | cut -d' ' -f1)"
 S2="$(sha1sum $OUT | cut -d' ' -f1)"
 test "$S1" != "$S2" && echo -e "\nCompressor/decompressor tests FAILED: mismatched hashes.\n" && clean_exit 1
 
+# Threaded compression must produce identical output
+echo -n "Testing threaded compression...";
+$LZJODY -c -T 4 -C 3 < $IN > $TF 2>>log.test.compress || { echo "FAILED"; clean_exit 1; }
+cmp -s $TF $COMP || { echo "FAILED: output differs"; clean_exit 1; }
+echo "passed"
+
+echo -n "Testing threaded decompression...";
+$LZJODY -d -T 4 -C 3 < $COMP > $TF 2>>log.test.decompress || { echo "FAILED"; clean_exit 1; }
+cmp -s $TF $IN || { echo "FAILED: output differs"; clean_exit 1; }
+echo "passed"
+
+echo -n "Testing multi-width byte planes...";
+$LZJODY -c -p -T 1 < $IN 2>>log.test.compress | $LZJODY -d 2>>log.test.decompress > $TF || { echo "FAILED"; clean_exit 1; }
+cmp -s $TF $IN || { echo "FAILED: output differs"; clean_exit 1; }
+echo "passed"
+
+echo -n "Testing compression levels...";
+for LEVEL in 0 1 5 9
+	do $LZJODY -c -$LEVEL -T 1 < $IN 2>>log.test.compress > $TF || { echo "FAILED: -$LEVEL"; clean_exit 1; }
+	$LZJODY -c -$LEVEL -T 4 -C 3 < $IN 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: -$LEVEL threaded output differs"; clean_exit 1; }
+	$LZJODY -d < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: -$LEVEL output differs"; clean_exit 1; }
+done
+$LZJODY -c -3 -T 1 < $IN 2>>log.test.compress | cmp -s - $COMP || { echo "FAILED: -3 is not the default"; clean_exit 1; }
+echo "passed"
+
+echo -n "Testing incompressible data...";
+head -c 100000 /dev/urandom > $TF.rnd
+$LZJODY -c -T 1 < $TF.rnd 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.rnd; clean_exit 1; }
+test $(wc -c < $TF) -le $((100000 + 25 * 4)) || { echo "FAILED: stored blocks too large"; rm -f $TF.rnd; clean_exit 1; }
+$LZJODY -c -T 4 -C 2 < $TF.rnd 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; rm -f $TF.rnd; clean_exit 1; }
+$LZJODY -d -T 4 -C 2 < $TF 2>>log.test.decompress | cmp -s - $TF.rnd || { echo "FAILED: threaded output differs"; rm -f $TF.rnd; clean_exit 1; }
+$LZJODY -d < $TF 2>>log.test.decompress | cmp -s - $TF.rnd || { echo "FAILED: output differs"; rm -f $TF.rnd; clean_exit 1; }
+$LZJODY -c -B 64K < $TF.rnd 2>>log.test.compress | $LZJODY -d 2>>log.test.decompress | cmp -s - $TF.rnd || { echo "FAILED: large blocks"; rm -f $TF.rnd; clean_exit 1; }
+rm -f $TF.rnd
+echo "passed"
+
+echo -n "Testing zero blocks...";
+{ head -c 20000 $IN; head -c 50000 /dev/zero; head -c 20000 $IN; head -c 10000 /dev/zero; } > $TF.zero
+$LZJODY -c < $TF.zero 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.zero; clean_exit 1; }
+rm -f $TF.out; $LZJODY -d < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED"; rm -f $TF.zero $TF.out; clean_exit 1; }
+cmp -s $TF.out $TF.zero || { echo "FAILED: sparse output differs"; rm -f $TF.zero $TF.out; clean_exit 1; }
+rm -f $TF.out; $LZJODY -d -T 4 -C 2 < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED"; rm -f $TF.zero $TF.out; clean_exit 1; }
+cmp -s $TF.out $TF.zero || { echo "FAILED: threaded sparse output differs"; rm -f $TF.zero $TF.out; clean_exit 1; }
+# Holes over old data in a file that was not truncated
+head -c 100000 $IN > $TF.out; $LZJODY -d < $TF 2>>log.test.decompress 1<> $TF.out || { echo "FAILED"; rm -f $TF.zero $TF.out; clean_exit 1; }
+cmp -s $TF.out $TF.zero || { echo "FAILED: output over old data differs"; rm -f $TF.zero $TF.out; clean_exit 1; }
+$LZJODY -d < $TF 2>>log.test.decompress | cmp -s - $TF.zero || { echo "FAILED: output differs"; rm -f $TF.zero $TF.out; clean_exit 1; }
+rm -f $TF.zero $TF.out
+echo "passed"
+
+echo -n "Testing block dedup...";
+{ head -c 65536 $IN; head -c 65536 $IN; cat $IN; head -c 65536 $IN; } > $TF.dup
+$LZJODY -c -X -R 64 < $TF.dup 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.dup; clean_exit 1; }
+test $(wc -c < $TF) -lt $($LZJODY -c < $TF.dup 2>>log.test.compress | wc -c) || { echo "FAILED: no smaller"; rm -f $TF.dup; clean_exit 1; }
+$LZJODY -c -X -R 64 -T 4 -C 2 < $TF.dup 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; rm -f $TF.dup; clean_exit 1; }
+$LZJODY -d -T 4 -C 2 < $TF 2>>log.test.decompress | cmp -s - $TF.dup || { echo "FAILED: threaded output differs"; rm -f $TF.dup; clean_exit 1; }
+$LZJODY -d < $TF 2>>log.test.decompress | cmp -s - $TF.dup || { echo "FAILED: output differs"; rm -f $TF.dup; clean_exit 1; }
+$LZJODY -c -X -B 64K -W 128K < $TF.dup 2>>log.test.compress | $LZJODY -d 2>>log.test.decompress | cmp -s - $TF.dup || { echo "FAILED: streaming window"; rm -f $TF.dup; clean_exit 1; }
+rm -f $TF.dup
+echo "passed"
+
+echo -n "Testing large blocks...";
+$LZJODY -c -B 64K < $IN 2>>log.test.compress > $TF || { echo "FAILED"; clean_exit 1; }
+$LZJODY -c -B 64K -T 4 -C 2 < $IN 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d -T 4 -C 2 < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED"; rm -f $TF.out; clean_exit 1; }
+cmp -s $TF.out $IN || { echo "FAILED: output differs"; rm -f $TF.out; clean_exit 1; }
+rm -f $TF.out
+echo "passed"
+
+echo -n "Testing streaming window...";
+$LZJODY -c -B 64K -W 128K -R 4 < $IN 2>>log.test.compress > $TF || { echo "FAILED"; clean_exit 1; }
+$LZJODY -c -B 64K -W 128K -R 4 -T 4 -C 2 < $IN 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d -T 4 -C 1 < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: output differs"; clean_exit 1; }
+echo "passed"
+
+echo -n "Testing seekable streams...";
+$LZJODY -c -A < $IN 2>>log.test.compress > $TF || { echo "FAILED"; clean_exit 1; }
+$LZJODY -c -A -T 4 -C 2 < $IN 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d -T 4 -C 2 < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: output differs"; clean_exit 1; }
+for R in "0 100" "4095 2" "70000 150000" "200000 999999"
+	do set -- $R
+	$LZJODY -d -O $1 -L $2 < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED: range $1"; rm -f $TF.out; clean_exit 1; }
+	tail -c +$(($1 + 1)) $IN | head -c $2 | cmp -s - $TF.out || { echo "FAILED: range $1 differs"; rm -f $TF.out; clean_exit 1; }
+done
+$LZJODY -d -O 5000 -L 500000 -T 4 < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED: threaded range"; rm -f $TF.out; clean_exit 1; }
+tail -c +5001 $IN | head -c 500000 | cmp -s - $TF.out || { echo "FAILED: threaded range differs"; rm -f $TF.out; clean_exit 1; }
+$LZJODY -c -A -B 64K -W 128K -R 4 < $IN 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.out; clean_exit 1; }
+$LZJODY -d -O 300000 -L 5000 < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED: streaming window range"; rm -f $TF.out; clean_exit 1; }
+tail -c +300001 $IN | head -c 5000 | cmp -s - $TF.out || { echo "FAILED: streaming window range differs"; rm -f $TF.out; clean_exit 1; }
+{ head -c 65536 $IN; cat $IN; head -c 65536 $IN; } > $TF.dup
+$LZJODY -c -A -X < $TF.dup 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.out $TF.dup; clean_exit 1; }
+for R in "65536 70000" "626000 2000"
+	do set -- $R
+	$LZJODY -d -O $1 -L $2 < $TF 2>>log.test.decompress > $TF.out || { echo "FAILED: dedup range $1"; rm -f $TF.out $TF.dup; clean_exit 1; }
+	tail -c +$(($1 + 1)) $TF.dup | head -c $2 | cmp -s - $TF.out || { echo "FAILED: dedup range $1 differs"; rm -f $TF.out $TF.dup; clean_exit 1; }
+done
+rm -f $TF.dup
+rm -f $TF.out
+$LZJODY -c -A < $IN 2>>log.test.compress > $TF || { echo "FAILED"; clean_exit 1; }
+# Cut the stream after its last block (before the 2-byte end marker),
+# inside the index and inside the footer
+set -- $(tail -c 24 $TF | head -c 8 | od -An -tu1)
+O=0; for B in "$@"; do O=$((O * 256 + B)); done
+for L in $((O - 2)) $((O + 3)) $(($(wc -c < $TF) - 1))
+	do head -c $L $TF > $TF.cut
+	$LZJODY -d -T 1 < $TF.cut > /dev/null 2>>log.test.decompress && { echo "FAILED: truncated stream accepted"; rm -f $TF.cut; clean_exit 1; }
+	$LZJODY -d -T 4 < $TF.cut > /dev/null 2>>log.test.decompress && { echo "FAILED: threaded truncated stream accepted"; rm -f $TF.cut; clean_exit 1; }
+done
+rm -f $TF.cut
+echo "passed"
+
+echo -n "Testing file options...";
+$LZJODY -c -i $IN -o $TF 2>>log.test.compress || { echo "FAILED"; clean_exit 1; }
+cmp -s $TF $COMP || { echo "FAILED: output differs"; clean_exit 1; }
+$LZJODY -c -T 4 -C 2 -i $IN 2>>log.test.compress | cmp -s - $COMP || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d -T 4 -C 2 -i $COMP 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: threaded output differs"; clean_exit 1; }
+$LZJODY -d -i $COMP -o $TF 2>>log.test.decompress || { echo "FAILED"; clean_exit 1; }
+cmp -s $TF $IN || { echo "FAILED: output differs"; clean_exit 1; }
+echo "passed"
+
+# Engines must produce the same files as stdio, with or without O_DIRECT
+for ENGINE in uring threads
+	do echo -n "Testing $ENGINE I/O engine...";
+	for DIRECT in "" --direct
+		do $LZJODY -c -T 1 --io=$ENGINE $DIRECT -i $IN -o $TF 2>>log.test.compress || { echo "FAILED"; clean_exit 1; }
+		cmp -s $TF $COMP || { echo "FAILED: output differs"; clean_exit 1; }
+		$LZJODY -d -T 4 -C 2 --io=$ENGINE $DIRECT -i $COMP -o $TF 2>>log.test.decompress || { echo "FAILED"; clean_exit 1; }
+		cmp -s $TF $IN || { echo "FAILED: output differs"; clean_exit 1; }
+	done
+	echo "passed"
+done
+
+# Blocks that straddle the utility's 1 MiB reads go through the
+# stream API's buffers
+echo -n "Testing streams across reads...";
+{ cat $IN; head -c 1200000 /dev/urandom; cat $IN; } > $TF.in
+for OPTS in "" "-B 64K -A"
+	do $LZJODY -c -T 1 $OPTS < $TF.in 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.in; clean_exit 1; }
+	$LZJODY -c -T 4 $OPTS < $TF.in 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; rm -f $TF.in; clean_exit 1; }
+	$LZJODY -d -T 1 < $TF 2>>log.test.decompress | cmp -s - $TF.in || { echo "FAILED: output differs"; rm -f $TF.in; clean_exit 1; }
+done
+rm -f $TF.in
+echo "passed"
+
+echo -n "Testing preset dictionary...";
+$LZJODY --train -S 16K $IN 2>>log.test.compress > $TF.dict || { echo "FAILED: training"; rm -f $TF.dict; clean_exit 1; }
+$LZJODY -c -D $TF.dict < $IN 2>>log.test.compress > $TF || { echo "FAILED"; rm -f $TF.dict; clean_exit 1; }
+$LZJODY -c -D $TF.dict -T 4 -C 2 < $IN 2>>log.test.compress | cmp -s - $TF || { echo "FAILED: threaded output differs"; rm -f $TF.dict; clean_exit 1; }
+$LZJODY -d -D $TF.dict -T 4 -C 2 < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: threaded output differs"; rm -f $TF.dict; clean_exit 1; }
+$LZJODY -d -D $TF.dict < $TF 2>>log.test.decompress | cmp -s - $IN || { echo "FAILED: output differs"; rm -f $TF.dict; clean_exit 1; }
+$LZJODY -d < $TF > /dev/null 2>>log.test.decompress && { echo "FAILED: decoded without the dictionary"; rm -f $TF.dict; clean_exit 1; }
+rm -f $TF.dict
+echo "passed"
+
+# Every CPU kernel tier must produce identical output
+for TIER in scalar sse2 avx2 avx512
+	do echo -n "Testing $TIER kernels...";
+	LZJODY_CPU=$TIER $LZJODY -c -T 1 < $IN 2>>log.test.compress > $TF || { echo "FAILED"; clean_exit 1; }
+	cmp -s $TF $COMP || { echo "FAILED: output differs"; clean_exit 1; }
+	LZJODY_CPU=$TIER $LZJODY -d -T 1 < $COMP 2>>log.test.decompress > $TF || { echo "FAILED"; clean_exit 1; }
+	cmp -s $TF $IN || { echo "FAILED: output differs"; clean_exit 1; }
+	echo "passed"
+done
+
 
 ### Decompressor tests
 
@@ -45,6 +212,14 @@ dd if=/dev/zero bs=4095 count=1 2>/dev/null >> $TF
 $LZJODY -d < $TF 2>> log.test.invalid && echo "FAILED" && clean_exit 1
 echo "passed"
 
+echo -n "Testing invalid stored block lengths...";
+echo "Stored length test:" >> log.test.invalid
+printf '\220\002\017\240' > $TF
+dd if=/dev/zero bs=4096 count=1 2>/dev/null >> $TF
+$LZJODY -d -T 1 < $TF > /dev/null 2>> log.test.invalid && echo "FAILED" && clean_exit 1
+$LZJODY -d -T 4 -C 2 < $TF > /dev/null 2>> log.test.invalid && echo "FAILED: threaded" && clean_exit 1
+echo "passed"
+
 echo -n "Testing invalid (zero) lengths...";
 echo "Zero length test:" >> log.test.invalid
 echo -en '\x00\x00\x00' | \